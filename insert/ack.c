@@ -0,0 +1,115 @@
+/*
+ * ack.c
+ * Spot TCP acknowledgements which a newer one makes redundant
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ack.h"
+
+/* Get the big-endian uint16_t at b */
+#define GET16(b) ((uint16_t)(((b)[0] << 8) | (b)[1]))
+
+/* TCP flags and options */
+#define TCP_ACK  0x10
+#define TCPOPT_EOL  0
+#define TCPOPT_NOP  1
+#define TCPOPT_SACK 5
+
+int ack_pure(const uint8_t *b, size_t n, uint8_t *key, uint32_t *ack) {
+        size_t off;     /* Offset of the IP, then TCP, header */
+        size_t iplen;   /* Bytes of IP header and payload */
+        size_t hl;      /* Header length */
+        size_t i;
+        uint16_t et;    /* EtherType */
+
+        memset(key, 0, ACKKEYLEN);
+        if (14 > n) {
+                return 0;
+        }
+        memcpy(key, b, 12);
+
+        /* Skip a VLAN tag */
+        off = 12;
+        et = GET16(b + off);
+        off += 2;
+        if (0x8100 == et && off + 4 <= n) {
+                et = GET16(b + off + 2);
+                off += 4;
+        }
+
+        /* Find the TCP header and how much is after it */
+        switch (et) {
+        case 0x0800: /* IPv4 */
+                if (off + 20 > n || 4 != (b[off] >> 4) ||
+                                6 != b[off + 9] ||
+                                0 != (GET16(b + off + 6) & 0x3FFF)) {
+                        return 0;
+                }
+                hl = (b[off] & 0x0F) * 4;
+                iplen = GET16(b + off + 2);
+                memcpy(key + 12, b + off + 12, 4);
+                memcpy(key + 12 + 16, b + off + 16, 4);
+                break;
+        case 0x86DD: /* IPv6, without extension headers */
+                if (off + 40 > n || 6 != (b[off] >> 4) ||
+                                6 != b[off + 6]) {
+                        return 0;
+                }
+                hl = 40;
+                iplen = 40 + GET16(b + off + 4);
+                memcpy(key + 12, b + off + 8, 16);
+                memcpy(key + 12 + 16, b + off + 24, 16);
+                break;
+        default:
+                return 0;
+        }
+        if (20 > hl || off + iplen > n || hl + 20 > iplen) {
+                return 0;
+        }
+        iplen -= hl;
+        off += hl;
+
+        /* Nothing but an ACK, and nothing after the header */
+        hl = (b[off + 12] >> 4) * 4;
+        if (20 > hl || hl != iplen || TCP_ACK != b[off + 13]) {
+                return 0;
+        }
+
+        /* SACK blocks say something an older ACK doesn't */
+        for (i = 20; i < hl; ) {
+                if (TCPOPT_EOL == b[off + i]) {
+                        break;
+                } else if (TCPOPT_NOP == b[off + i]) {
+                        ++i;
+                        continue;
+                } else if (TCPOPT_SACK == b[off + i] || i + 1 >= hl ||
+                                2 > b[off + i + 1]) {
+                        return 0;
+                }
+                i += b[off + i + 1];
+        }
+
+        memcpy(key + 12 + 16 + 16, b + off, 4);
+        *ack = ((uint32_t)b[off + 8] << 24) | ((uint32_t)b[off + 9] << 16) |
+                ((uint32_t)b[off + 10] << 8) | b[off + 11];
+        return 1;
+}
@@ -0,0 +1,39 @@
+/*
+ * ack.h
+ * Spot TCP acknowledgements which a newer one makes redundant
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_ACK_H
+#define HAVE_ACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A TCP flow's key: destination and source MAC addresses, source and
+ * destination IP addresses (IPv4 addresses take up the first 4 bytes of
+ * each 16), and source and destination ports */
+#define ACKKEYLEN (6 + 6 + 16 + 16 + 2 + 2)
+
+/* If the n-byte frame at b is a pure TCP ACK (no payload, no other flags, and
+ * no SACK blocks), put its flow in key and its acknowledgement number in ack
+ * and return nonzero.  Otherwise, return 0. */
+int ack_pure(const uint8_t *b, size_t n, uint8_t *key, uint32_t *ack);
+
+#endif /* HAVE_ACK_H */
@@ -0,0 +1,59 @@
+/*
+ * arena.c
+ * Single preallocated arena from which insert's buffers are carved
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "insert.h"
+#include "retvals.h"
+#include "sha2.h"
+
+/* Allocations are rounded up to this many bytes */
+#define ARENAALIGN 16
+
+static uint8_t *arena = NULL; /* The arena itself */
+static size_t arena_used = 0; /* Bytes handed out so far */
+
+/* Allocate the arena.  Must be called once, before arena_alloc. */
+int arena_init(void) {
+        if (NULL == (arena = calloc(ARENALEN, sizeof(uint8_t)))) {
+                return RET_ENOMEM;
+        }
+        arena_used = 0;
+        return 0;
+}
+
+/* Carve n bytes out of the arena.  Returns NULL if there's not enough room
+ * left.  Memory from the arena is never freed. */
+void *arena_alloc(size_t n) {
+        void *p;
+
+        /* Keep everything aligned */
+        n = (n + ARENAALIGN - 1) & ~(size_t)(ARENAALIGN - 1);
+        if (NULL == arena || ARENALEN - arena_used < n) {
+                return NULL;
+        }
+        p = arena + arena_used;
+        arena_used += n;
+        return p;
+}
@@ -1,3 +1,4 @@
 #!/bin/sh
 
-cc -Wall -Os --pedantic -ggdb -lpthread -lpcap -o insert *.c 
+# Extra flags may be given in CFLAGS, e.g. CFLAGS=-DLOWMEM ./build.sh
+cc -Wall -Os --pedantic -ggdb $CFLAGS -lpthread -lpcap -o insert *.c 
@@ -3,7 +3,7 @@
  * pcap initialization functions
  * by J. Stuart McMurray
  * created 20150220
- * last modified 20150222
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -21,40 +21,321 @@
  */
 
 #include <pcap.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <time.h>
 
+#include "cap.h"
 #include "insert.h"
+#include "learn.h"
 #include "retvals.h"
+#include "sha2.h"
 
-/* pcap_setup initializes (and starts) pcap, but doesn't start it */
-int pcap_setup(pcap_t **pret) {
-        struct bpf_program fp; /* BPF filter */
+/* Handles used for injection, one per channel.  The capture threads may
+ * replace them. */
+static pcap_t *inj_handle[MAXCHANNELS];
+static int inj_inonly[MAXCHANNELS]; /* Nonzero if inj_handle only captures
+                                       incoming */
+static pthread_mutex_t inj_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int setup_inonly[MAXCHANNELS]; /* Nonzero if pcap_setup's handle does
+                                         too */
+
+uint64_t cap_echoes = 0; /* Injected frames captured and dropped */
+
+#if 0 < ECHOSET
+/* Frames recently injected, for pcaps which capture them */
+static struct {
+        uint8_t digest[DIGESTLEN]; /* Hash of the size and frame */
+        uint16_t len;              /* Size of the frame */
+        uint64_t when;             /* When injected, in ms, 0 if unused */
+} echoes[ECHOSET];
+static int echo_next = 0; /* Next slot in echoes to use */
+static pthread_mutex_t echo_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif /* #if 0 < ECHOSET */
+
+/* The capture filter, narrowed to what shift can use as it's learned.  Each
+ * channel's capture thread sets its own handle's filter.  Older pcaps can't
+ * compile two filters at once, so filt_mtx is held while compiling. */
+static char filt[LEARNFILTLEN];
+static pthread_mutex_t filt_mtx = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int filt_stale[MAXCHANNELS]; /* Nonzero if the filter should be
+                                              rebuilt */
+static atomic_uint_least64_t filt_when[MAXCHANNELS]; /* When the filter was
+                                                        last set, ms */
+
+/* Frames to truncate, if TRUNCFILT isn't empty.  Only used by channel 0's
+ * capture thread. */
+static struct bpf_program truncprog;
+static int have_truncprog = 0;
+
+/* Build and set channel chan's capture filter on p */
+static int set_filter(int chan, pcap_t *p);
+
+/* Put the name of channel chan's interface, from PCAPINT, in name, which
+ * must have room for PCAPINT.  Returns 0 if there's no such channel. */
+static int chan_name(int chan, char *name);
+
+/* Milliseconds since some point */
+static uint64_t now_ms(void);
+
+/* pcap_setup initializes (and starts) pcap on channel chan's interface, but
+ * doesn't start it */
+int pcap_setup(pcap_t **pret, int chan) {
         pcap_t *p;
+        char errbuf[PCAP_ERRBUF_SIZE]; /* Error message, ignored */
+        char name[sizeof(PCAPINT)];    /* Interface name */
+        int trunc;                     /* Nonzero to truncate frames */
+        int ret;
 
         *pret = NULL;
         p = NULL;
-        memset(&fp, 0, sizeof(fp));
+
+        /* Only channel 0's frames are truncated */
+        trunc = (0 == chan) && (0 != TRUNCLEN);
 
         /* Try to open the interface */
-        if (NULL == (p = pcap_open_live(PCAPINT, SNAPLEN, 0, -1, NULL))) {
+        if (!chan_name(chan, name) ||
+                        (NULL == (p = pcap_create(name, errbuf)))) {
+                return RET_ERR_PINIT;
+        }
+        if ((0 != pcap_set_snaplen(p, (trunc && '\0' == TRUNCFILT[0]) ?
+                                        TRUNCLEN : SNAPLEN)) ||
+                        (0 != pcap_set_promisc(p, 0)) ||
+                        (0 != pcap_set_timeout(p, -1)) ||
+                        ((0 != PCAPBUFLEN) &&
+                         (0 != pcap_set_buffer_size(p, PCAPBUFLEN))) ||
+                        (0 > pcap_activate(p))) {
+                pcap_close(p);
                 return RET_ERR_PINIT;
         }
 
+        /* Don't capture what we inject, if pcap can manage it */
+        setup_inonly[chan] = (0 == pcap_setdirection(p, PCAP_D_IN));
+
+        /* Set the BPF filter, with whatever's been learned so far */
+        if (0 != (ret = set_filter(chan, p))) {
+                pcap_close(p);
+                return ret;
+        }
+
+        /* Work out which frames to truncate */
+        if (trunc && '\0' != TRUNCFILT[0]) {
+                if (have_truncprog) {
+                        pcap_freecode(&truncprog);
+                        have_truncprog = 0;
+                }
+                pthread_mutex_lock(&filt_mtx);
+                ret = pcap_compile(p, &truncprog, TRUNCFILT, 1, 0);
+                pthread_mutex_unlock(&filt_mtx);
+                if (0 != ret) {
+                        pcap_close(p);
+                        return RET_ERR_BFC;
+                }
+                have_truncprog = 1;
+        }
+
+        /* Returned value */
+        *pret = p;
+
+        return 0;
+}
+
+/* Returns the number of channels, one per interface in PCAPINT */
+int cap_channels(void) {
+        int n;
+        size_t i;
+
+        n = 1;
+        for (i = 0; i < sizeof(PCAPINT) && '\0' != PCAPINT[i]; ++i) {
+                if (',' == PCAPINT[i] && MAXCHANNELS > n) {
+                        ++n;
+                }
+        }
+        return n;
+}
+
+/* Returns the number of bytes of the frame at data, described by h and
+ * captured on channel chan, to send to shift.  That's TRUNCLEN for frames to
+ * be truncated, or all of it. */
+uint32_t cap_keep(int chan, const struct pcap_pkthdr *h,
+                const uint8_t *data) {
+        if ((0 != chan) || (0 == TRUNCLEN) || (TRUNCLEN >= h->caplen)) {
+                return h->caplen;
+        }
+        if (have_truncprog && !pcap_offline_filter(&truncprog, h, data)) {
+                return h->caplen;
+        }
+        return TRUNCLEN;
+}
+
+/* Rebuild p's filter from what's been learned since it was last set.  Frames
+ * are captured with the old filter until the new one's in place. */
+int cap_refilter(int chan, pcap_t *p) {
+        return set_filter(chan, p);
+}
+
+/* Break p, chan's handle, out of pcap_dispatch if its filter needs to be
+ * rebuilt and hasn't been changed in the last LEARNSEC seconds */
+void cap_poll(int chan, pcap_t *p) {
+        if (atomic_load(&filt_stale[chan]) &&
+                        (now_ms() - atomic_load(&filt_when[chan]) >=
+                         LEARNSEC * 1000)) {
+                pcap_breakloop(p);
+        }
+}
+
+static int set_filter(int chan, pcap_t *p) {
+        struct bpf_program fp; /* BPF filter */
+        int ret;
+
+        memset(&fp, 0, sizeof(fp));
+        atomic_store(&filt_stale[chan], 0);
+        atomic_store(&filt_when[chan], now_ms());
+
         /* Compile the BPF filter */
-        if (0 != pcap_compile(p, &fp, PCAPFILT, 1, 0)) {
+        pthread_mutex_lock(&filt_mtx);
+        ret = (0 != learn_filter(filt, sizeof(filt))) ||
+                (0 != pcap_compile(p, &fp, filt, 1, 0));
+        pthread_mutex_unlock(&filt_mtx);
+        if (ret) {
                 return RET_ERR_BFC;
         }
 
         /* Set the BPF filter */
         if (0 != pcap_setfilter(p, &fp)) {
+                pcap_freecode(&fp);
                 return RET_ERR_BFS;
         }
 
         /* Free the momery allocated by pcap_compile */
         pcap_freecode(&fp);
 
-        /* Returned value */
-        *pret = p;
+        return 0;
+}
+
+static int chan_name(int chan, char *name) {
+        const char *s; /* Start of the name */
+        size_t n;      /* Length of the name */
+
+        s = PCAPINT;
+        for (; 0 < chan; --chan) {
+                if (NULL == (s = strchr(s, ','))) {
+                        return 0;
+                }
+                ++s;
+        }
+        n = strcspn(s, ",");
+        memcpy(name, s, n);
+        name[n] = '\0';
+        return 0 != n;
+}
+
+/* Set the handle used by cap_inject for channel chan.  p may be NULL, in
+ * which case frames will be silently dropped. */
+void cap_set_handle(int chan, pcap_t *p) {
+        pthread_mutex_lock(&inj_mtx);
+        inj_handle[chan] = p;
+        inj_inonly[chan] = (NULL != p) && setup_inonly[chan];
+        pthread_mutex_unlock(&inj_mtx);
+}
+
+/* Put the n bytes at b on the wire on channel chan.  digest is the hash of
+ * the frame's size (in network byte order) and the frame, and is used to
+ * spot the frame if it's captured, or may be NULL.  Returns the number of
+ * bytes injected. */
+int cap_inject(int chan, const uint8_t *b, size_t n, const uint8_t *digest) {
+        int ret;
+        int i;
+        ret = 0;
+        if (0 > chan || MAXCHANNELS <= chan) {
+                return 0;
+        }
+        pthread_mutex_lock(&inj_mtx);
+        if (NULL != inj_handle[chan]) {
+                /* Learn what shift can use, and have the capture threads
+                 * narrow their filters to it */
+                if (learn_frame(b, n) && (0 < LEARNMACS)) {
+                        for (i = 0; i < MAXCHANNELS; ++i) {
+                                atomic_store(&filt_stale[i], 1);
+                        }
+                }
+#if 0 < ECHOSET
+                /* Note it before it has a chance to be captured */
+                if (!inj_inonly[chan] && (NULL != digest)) {
+                        pthread_mutex_lock(&echo_mtx);
+                        memcpy(echoes[echo_next].digest, digest, DIGESTLEN);
+                        echoes[echo_next].len = n;
+                        echoes[echo_next].when = now_ms();
+                        echo_next = (echo_next + 1) % ECHOSET;
+                        pthread_mutex_unlock(&echo_mtx);
+                }
+#endif /* #if 0 < ECHOSET */
+                ret = pcap_inject(inj_handle[chan], b, n);
+        }
+        pthread_mutex_unlock(&inj_mtx);
+        return ret;
+}
+
+/* Returns nonzero if the n captured bytes at b are a frame which was just
+ * injected.  Each injected frame is only spotted once. */
+int cap_is_echo(const uint8_t *b, size_t n) {
+#if 0 < ECHOSET
+        uint64_t now;               /* Time now */
+        uint8_t digest[DIGESTLEN];  /* Hash of the size and frame */
+        uint8_t sizen[2];           /* Size, in network byte order */
+        sha224_ctx ctx;             /* Hash context */
+        int found;                  /* Nonzero if it's an echo */
+        int i;
 
+        /* Don't bother hashing if nothing that size was injected lately */
+        now = now_ms();
+        found = 0;
+        pthread_mutex_lock(&echo_mtx);
+        for (i = 0; i < ECHOSET; ++i) {
+                if ((0 != echoes[i].when) && (n == echoes[i].len) &&
+                                (now - echoes[i].when < ECHOMS)) {
+                        found = 1;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&echo_mtx);
+        if (!found) {
+                return 0;
+        }
+
+        /* Hash it the same way shift did */
+        sizen[0] = (n >> 8) & 0xFF;
+        sizen[1] = n & 0xFF;
+        sha224_init(&ctx);
+        sha224_update(&ctx, sizen, sizeof(sizen));
+        sha224_update(&ctx, b, n);
+        sha224_final(&ctx, digest);
+
+        found = 0;
+        pthread_mutex_lock(&echo_mtx);
+        for (i = 0; i < ECHOSET; ++i) {
+                if ((0 != echoes[i].when) && (n == echoes[i].len) &&
+                                (now - echoes[i].when < ECHOMS) &&
+                                (0 == memcmp(digest, echoes[i].digest,
+                                             DIGESTLEN))) {
+                        echoes[i].when = 0;
+                        ++cap_echoes;
+                        found = 1;
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&echo_mtx);
+        return found;
+#else /* #if 0 < ECHOSET */
         return 0;
+#endif /* #if 0 < ECHOSET */
+}
+
+/* Milliseconds since some point */
+static uint64_t now_ms(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
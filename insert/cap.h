@@ -3,7 +3,7 @@
  * pcap initialization function definitions
  * by J. Stuart McMurray
  * created 20150220
- * last modified 20150220
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -24,7 +24,48 @@
 #define HAVE_CAP_H
 
 #include <pcap.h>
-/* pcap_setup initializes (and starts) pcap, but doesn't start it */
-extern int pcap_setup(pcap_t **p);
+#include <stdint.h>
+
+/* pcap_setup initializes (and starts) pcap on channel chan's interface, but
+ * doesn't start it */
+extern int pcap_setup(pcap_t **p, int chan);
+
+/* Returns the number of channels, one per interface in PCAPINT */
+extern int cap_channels(void);
+
+/* Returns the number of bytes of the frame at data, described by h and
+ * captured on channel chan, to send to shift.  That's TRUNCLEN for frames to
+ * be truncated, or all of it.  Only channel 0's frames are truncated.  Must
+ * be called from chan's capture thread. */
+extern uint32_t cap_keep(int chan, const struct pcap_pkthdr *h,
+                const uint8_t *data);
+
+/* Rebuild p's filter from what's been learned since it was last set.  Frames
+ * are captured with the old filter until the new one's in place. */
+extern int cap_refilter(int chan, pcap_t *p);
+
+/* Break p, chan's handle, out of pcap_dispatch if its filter needs to be
+ * rebuilt and hasn't been changed in the last LEARNSEC seconds.  Must be
+ * called from chan's capture thread, which should call cap_refilter when
+ * pcap_dispatch returns -2. */
+extern void cap_poll(int chan, pcap_t *p);
+
+/* Set the handle used by cap_inject for channel chan.  p may be NULL, in
+ * which case frames will be silently dropped. */
+extern void cap_set_handle(int chan, pcap_t *p);
+
+/* Put the n bytes at b on the wire on channel chan.  digest is the hash of
+ * the frame's size (in network byte order) and the frame, and is used to
+ * spot the frame if it's captured, or may be NULL.  Returns the number of
+ * bytes injected. */
+extern int cap_inject(int chan, const uint8_t *b, size_t n,
+                const uint8_t *digest);
+
+/* Returns nonzero if the n captured bytes at b are a frame which was just
+ * injected.  Each injected frame is only spotted once. */
+extern int cap_is_echo(const uint8_t *b, size_t n);
+
+/* Number of injected frames captured and dropped */
+extern uint64_t cap_echoes;
 
 #endif /* HAVE_CAP_H */
@@ -3,7 +3,7 @@
  * Functions related to communications
  * by J. Stuart McMurray
  * created 20150122
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -23,24 +23,44 @@
 #include <sys/types.h>
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "comm.h"
 #include "crypto.h"
 #include "insert.h"
 #include "retvals.h"
+#include "session.h"
 
-/* Handshake with insert */
-int handshake(fd) {
-        uint8_t junk[MAXJUNKSIZE];      /* Initial junk data to wait on */
+#if 0 < TICKETS
+/* A resumption ticket handed to shift at the end of a pipelined handshake */
+struct ticket {
+        uint8_t id[8];          /* Sent in the clear by shift to resume */
+        uint8_t secret[KEYLEN]; /* Key for the resumed session */
+        uint32_t options;       /* Options agreed on in the original session */
+        time_t expiry;          /* Not good after this, 0 if unused */
+};
+static struct ticket tickets[TICKETS]; /* Tickets given out */
+/* Sessions hand out and take tickets at the same time */
+static pthread_mutex_t tk_mtx = PTHREAD_MUTEX_INITIALIZER;
+#endif /* #if 0 < TICKETS */
+
+static int handshake_lockstep(struct session *s);
+static int handshake_pipelined(struct session *s);
+static int recv_name(struct session *s);
+static int ticket_take(struct session *s, uint8_t id[8]);
+static int ticket_send(struct session *s);
+static int handshake_done(struct session *s);
+static uint32_t agree(uint32_t o);
+
+/* Handshake with the shift on s's socket, after reading the junk */
+int handshake(struct session *s) {
         char *endptr;                   /* Used in strtol */
         int junksize;                   /* Number of junk bytes to read */
-        uint8_t nonce[8];               /* Nonce for this connection */
-        int ret;                        /* Return value */
-        uint8_t rxname[INSTALLNAMELEN]; /* Received install name */
 
         /* Work out how much junk to read */
         endptr = NULL;
@@ -49,42 +69,252 @@ int handshake(fd) {
                 /* Unable to convert JUNKSIZE */
                 return RET_INV_JUNK;
         }
-        if (0 > junksize) {
+        if ((0 > junksize) || (MAXJUNKSIZE < junksize)) {
                 return RET_INV_JUNK;
         }
 
         /* Read that much data */
-        if (0 != recv_all(fd, junk, junksize)) {
+        if (0 != recv_skip(s, junksize, 0)) {
                 return RET_ERR_JUNK;
         }
 
+        s->options = 0;
+        if ('p' == HANDSHAKE[0]) {
+                return handshake_pipelined(s);
+        }
+        return handshake_lockstep(s);
+}
+
+/* The original handshake: send a nonce, wait for the name, echo the name */
+static int handshake_lockstep(struct session *s) {
+        uint8_t nonce[8];               /* Nonce for this connection */
+        int ret;                        /* Return value */
+
         /* Make the nonce */
         make_nonce(nonce);
 
         /* Send the nonce */
-        if (0 != (ret = send_all(fd, nonce, 8))) {
+        if (0 != (ret = send_all(s->fd, nonce, 8))) {
                 return RET_ERR_NONCE;
         }
 
         /* Initialize the crypto streams for this connection. */
-        streams_init(nonce);
+        streams_init(s, nonce);
+
+        /* Wait for the install name, and make sure it's what we expect. */
+        if (0 != (ret = recv_name(s))) {
+                return ret;
+        }
+
+        /* Send it back */
+        if (0 != send_enc(s, installname, INSTALLNAMELEN)) {
+                return RET_ERR_SIN;
+        }
 
-        /* Wait for the install name */
-        memset(rxname, 0, sizeof(rxname));
-        if (0 != recv_enc(fd, rxname, INSTALLNAMELEN)) {
+        return 0;
+}
+
+/* The pipelined handshake.  Shift sends its nonce and the encrypted name and
+ * options all at once, and insert answers with its nonce, the name, the
+ * options it'll use, and a resumption ticket, also all at once.  If shift
+ * instead sends the ID of a ticket it was given earlier, the session carries
+ * on from the ticket without the name being sent at all. */
+static int handshake_pipelined(struct session *s) {
+        uint8_t snonce[8]; /* Shift's nonce, or a ticket ID */
+        uint8_t inonce[8]; /* Insert's nonce */
+        uint8_t o[4];      /* Options, in network byte order */
+        int ret;           /* Return value */
+        int i;
+
+        /* Shift's nonce or a ticket ID comes first, in the clear */
+        if (0 != recv_all(s->fd, snonce, sizeof(snonce))) {
+                return RET_ERR_NONCE;
+        }
+
+        /* If it's a ticket we know, pick up where the last session left off
+         * and hand out a new ticket.  Anything shift sends after the ID is
+         * frame data. */
+        if (0 == ticket_take(s, snonce)) {
+                o[0] = (s->options >> 24) & 0xFF;
+                o[1] = (s->options >> 16) & 0xFF;
+                o[2] = (s->options >> 8) & 0xFF;
+                o[3] = s->options & 0xFF;
+                if (0 != send_enc(s, o, sizeof(o))) {
+                        return RET_ERR_SIN;
+                }
+                return handshake_done(s);
+        }
+
+        /* Otherwise, it's a full handshake.  The name and options are
+         * encrypted with a stream that doesn't depend on the time. */
+        hello_init(s, snonce);
+        if (0 != (ret = recv_name(s))) {
+                return ret;
+        }
+        if (0 != recv_enc(s, o, sizeof(o))) {
                 return RET_ERR_RIN;
         }
+        s->options = agree((((uint32_t)o[0]) << 24) | (((uint32_t)o[1]) << 16) |
+                (((uint32_t)o[2]) << 8) | ((uint32_t)o[3]));
 
-        /* Make sure it's what we expect */
-        if (0 != (ret = constcmp(rxname, installname, INSTALLNAMELEN))) {
-                return RET_INV_RIN;
+        /* Send our nonce, and make the session's streams from both */
+        make_nonce(inonce);
+        if (0 != send_all(s->fd, inonce, sizeof(inonce))) {
+                return RET_ERR_NONCE;
         }
+        for (i = 0; i < 8; ++i) {
+                inonce[i] ^= snonce[i];
+        }
+        streams_init(s, inonce);
 
-        /* Send it back */
-        if (0 != send_enc(fd, rxname, INSTALLNAMELEN)) {
+        /* Echo the name, and tell shift what options we'll use */
+        if (0 != send_enc(s, installname, INSTALLNAMELEN)) {
                 return RET_ERR_SIN;
         }
+        o[0] = (s->options >> 24) & 0xFF;
+        o[1] = (s->options >> 16) & 0xFF;
+        o[2] = (s->options >> 8) & 0xFF;
+        o[3] = s->options & 0xFF;
+        if (0 != send_enc(s, o, sizeof(o))) {
+                return RET_ERR_SIN;
+        }
+
+        return handshake_done(s);
+}
+
+/* Finish off the pipelined handshake by sending a ticket and getting ready
+ * to use the agreed options */
+static int handshake_done(struct session *s) {
+        int ret; /* Return value */
+
+        if (0 != (ret = ticket_send(s))) {
+                return ret;
+        }
+        if (s->options & OPT_INDEXED) {
+                streams_index(s);
+        }
+        return 0;
+}
+
+/* Work out which of the options shift asked for, o, insert will use.  The
+ * dedup cache is as big as shift asked for, but no bigger than DEDUPLEN. */
+static uint32_t agree(uint32_t o) {
+        uint32_t n; /* Dedup cache size */
+
+        n = DEDUPOPTLEN(o);
+        if (DEDUPLEN < n) {
+                n = DEDUPLEN;
+        }
+        o &= OPTIONS;
+        if (0 == n) {
+                o &= ~OPT_DEDUP;
+        } else if (o & OPT_DEDUP) {
+                o |= n << 16;
+        }
+        return o;
+}
+
+/* Wait for the install name, and make sure it's what we expect.  It's
+ * compared a bit at a time to save memory, but all of it is read and compared
+ * no matter what. */
+static int recv_name(struct session *s) {
+        uint8_t rxname[SCRATCHLEN];     /* Received install name, in bits */
+        size_t off;                     /* Offset into the install name */
+        size_t n;                       /* Size of a bit of install name */
+        int diff;                       /* Nonzero if the names differ */
+
+        diff = 0;
+        for (off = 0; off < INSTALLNAMELEN; off += n) {
+                n = INSTALLNAMELEN - off;
+                if (sizeof(rxname) < n) {
+                        n = sizeof(rxname);
+                }
+                if (0 != recv_enc(s, rxname, n)) {
+                        return RET_ERR_RIN;
+                }
+                diff |= constcmp(rxname, installname + off, n);
+        }
+        if (0 != diff) {
+                return RET_INV_RIN;
+        }
+        return 0;
+}
+
+/* If id is the ID of an unexpired ticket, use up the ticket, set up s's
+ * streams and options from it, and return 0.  Returns nonzero otherwise. */
+static int ticket_take(struct session *s, uint8_t id[8]) {
+#if 0 < TICKETS
+        time_t now;  /* Time now */
+        int found;   /* Index of the ticket, or -1 */
+        int i;
 
+        now = time(NULL);
+        found = -1;
+        pthread_mutex_lock(&tk_mtx);
+        /* Check all of them, so the time taken doesn't tell which matched */
+        for (i = 0; i < TICKETS; ++i) {
+                if (0 == constcmp(id, tickets[i].id, sizeof(tickets[i].id)) &&
+                                now < tickets[i].expiry) {
+                        found = i;
+                }
+        }
+        if (-1 == found) {
+                pthread_mutex_unlock(&tk_mtx);
+                return -1;
+        }
+
+        /* Tickets are only good once */
+        streams_setup(s, tickets[found].secret, id, 0);
+        s->options = tickets[found].options;
+        memset(&tickets[found], 0, sizeof(tickets[found]));
+        pthread_mutex_unlock(&tk_mtx);
+        return 0;
+#else /* #if 0 < TICKETS */
+        return -1;
+#endif /* #if 0 < TICKETS */
+}
+
+/* Make a new ticket, remember it, and send it encrypted to shift.  If tickets
+ * are turned off or there's no randomness to be had, an all-zero ID (and
+ * secret) is sent, which shift won't use. */
+static int ticket_send(struct session *s) {
+        uint8_t t[8 + KEYLEN]; /* ID and secret */
+#if 0 < TICKETS
+        time_t now;            /* Time now */
+        int i, slot;
+#endif /* #if 0 < TICKETS */
+
+        memset(t, 0, sizeof(t));
+#if 0 < TICKETS
+        if (0 == get_entropy(t, sizeof(t))) {
+                /* Use a free slot, or else the one closest to expiring */
+                now = time(NULL);
+                slot = 0;
+                pthread_mutex_lock(&tk_mtx);
+                for (i = 0; i < TICKETS; ++i) {
+                        if (tickets[i].expiry <= now) {
+                                slot = i;
+                                break;
+                        }
+                        if (tickets[i].expiry < tickets[slot].expiry) {
+                                slot = i;
+                        }
+                }
+                memcpy(tickets[slot].id, t, sizeof(tickets[slot].id));
+                memcpy(tickets[slot].secret, t + 8,
+                                sizeof(tickets[slot].secret));
+                tickets[slot].options = s->options;
+                tickets[slot].expiry = now + TICKETLIFE;
+                pthread_mutex_unlock(&tk_mtx);
+        } else {
+                memset(t, 0, sizeof(t));
+        }
+#endif /* #if 0 < TICKETS */
+
+        if (0 != send_enc(s, t, sizeof(t))) {
+                return RET_ERR_SIN;
+        }
+        memset(t, 0, sizeof(t));
         return 0;
 }
 
@@ -139,36 +369,71 @@ int recv_all(int fmfd, uint8_t *b, size_t len) {
 
 /* TODO: Work out why reads are non-blocking */
 
-/* Encrypt (with txctx) and send the n bytes at b to fd. */
-int send_enc(int fd, uint8_t *b, size_t n) {
-        uint8_t *ebuf; /* Buffer for encrypted data */
-        int ret;       /* Return value */
+/* Encrypt (with s's txctx) and send the n bytes at b to s's shift.  b is left
+ * alone, at the cost of a send per SCRATCHLEN bytes. */
+int send_enc(struct session *s, uint8_t *b, size_t n) {
+        uint8_t ebuf[SCRATCHLEN]; /* Buffer for encrypted data */
+        size_t off;               /* Offset into b */
+        size_t len;               /* Bytes to send this time */
+        int ret;                  /* Return value */
 
+        for (off = 0; off < n; off += len) {
+                len = n - off;
+                if (sizeof(ebuf) < len) {
+                        len = sizeof(ebuf);
+                }
+                /* Make a copy of the data, and encrypt it */
+                memcpy(ebuf, b + off, len);
+                txencrypt(s, ebuf, len);
+                /* Send it */
+                if (0 != (ret = send_all(s->fd, ebuf, len))) {
+                        return ret;
+                }
+        }
 
-        /* Allocate buffer */
-        ebuf = calloc(n, sizeof(uint8_t));
-        /* Make a copy of the data */
-        memcpy(ebuf, b, n);
-        /* Encrypt the buffer */
-        txencrypt(ebuf, n);
-        /* Send it */
-        ret = send_all(fd, ebuf, n);
+        return 0;
+}
 
-        free(ebuf);
-        return ret;
+/* Encrypt (with s's txctx) the n bytes at b in place and send them to s's
+ * shift. */
+int send_enc_inplace(struct session *s, uint8_t *b, size_t n) {
+        txencrypt(s, b, n);
+        return send_all(s->fd, b, n);
 }
 
-/* Decrypt (with rxctx) n bytes from fd into b. */
-int recv_enc(int fd, uint8_t *b, size_t n) {
+/* Decrypt (with s's rxctx) n bytes from s's shift into b. */
+int recv_enc(struct session *s, uint8_t *b, size_t n) {
         int ret; /* Return value */
 
         /* Zero the buffer */
         memset(b, 0, n);
         /* Receive data into it */
-        if (0 != (ret = recv_all(fd, b, n))) {
+        if (0 != (ret = recv_all(s->fd, b, n))) {
                 return ret;
         }
         /* Decrypt the data */
-        rxdecrypt(b, n);
+        rxdecrypt(s, b, n);
+        return 0;
+}
+
+/* Read and throw away n bytes from s's shift, decrypting them (with s's
+ * rxctx) if enc is nonzero to keep the stream in step. */
+int recv_skip(struct session *s, size_t n, int enc) {
+        uint8_t buf[SCRATCHLEN]; /* Receive buffer */
+        size_t len;              /* Bytes to read this time */
+        int ret;                 /* Return value */
+
+        for (; 0 < n; n -= len) {
+                len = sizeof(buf) < n ? sizeof(buf) : n;
+                if (enc) {
+                        ret = recv_enc(s, buf, len);
+                } else {
+                        ret = recv_all(s->fd, buf, len);
+                }
+                if (0 != ret) {
+                        return ret;
+                }
+        }
+
         return 0;
 }
@@ -3,7 +3,7 @@
  * Function protoypes related to communications
  * by J. Stuart McMurray
  * created 20150122
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -25,8 +25,10 @@
 
 #include <stdint.h>
 
-/* Handshake with insert */
-extern int handshake(int fd);
+#include "session.h"
+
+/* Handshake with the shift on s's socket */
+extern int handshake(struct session *s);
 
 /* Ok, they probably should have been void* */
 
@@ -35,9 +37,19 @@ extern int send_all(int tofd, uint8_t *b, size_t len);
 /* Receive len bytes from fmfd int b */
 extern int recv_all(int fmfd, uint8_t *b, size_t len);
 
-/* Encrypt (with txctx) and send the n bytes at b to fd. */
-extern int send_enc(int fd, uint8_t *b, size_t n);
-/* Decrypt (with rxctx) n bytes from fd into b. */
-extern int recv_enc(int fd, uint8_t *b, size_t n);
+/* Encrypt (with s's txctx) and send the n bytes at b to s's shift.  b is left
+ * alone, at the cost of a send per SCRATCHLEN bytes. */
+extern int send_enc(struct session *s, uint8_t *b, size_t n);
+/* Encrypt (with s's txctx) the n bytes at b in place and send them to s's
+ * shift. */
+extern int send_enc_inplace(struct session *s, uint8_t *b, size_t n);
+/* Decrypt (with s's rxctx) n bytes from s's shift into b. */
+extern int recv_enc(struct session *s, uint8_t *b, size_t n);
+/* Read and throw away n bytes from s's shift, decrypting them (with s's
+ * rxctx) if enc is nonzero to keep the stream in step. */
+extern int recv_skip(struct session *s, size_t n, int enc);
+
+/* Size of the buffers used by send_enc and recv_skip */
+#define SCRATCHLEN 256
 
 #endif /* HAVE_COMM_H */
@@ -3,7 +3,7 @@
  * Functions related to encryption/decryption
  * by J. Stuart McMurray
  * created 20150122
- * last modified 20150221
+ * last modified 20261018
  *
  * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -20,7 +20,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <stdio.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif /* #if defined(__linux__) */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -29,49 +35,95 @@
 #include "chacha20_simple.h"
 #include "crypto.h"
 #include "insert.h"
+#include "keystream.h"
 #include "retvals.h"
+#include "session.h"
 
 int random_seeded = 0; /* Nonzero after seed_random() */
 int noncestream_init_done = 0; /* Nonzero after noncestream_init() */
 uint64_t nonce_ctr = 0; /* Number of nonces sent */
-chacha20_ctx txctx; /* Send crypto stream */
-chacha20_ctx rxctx; /* Receive crypto stream */
+chacha20_ctx noncectx; /* Nonce stream */
+/* Sessions make nonces at the same time, and no two may be the same */
+static pthread_mutex_t nonce_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Fill b with n bytes from the kernel's random number generator.  Uses
+ * getrandom(2) (or getentropy(2) on OpenBSD), falling back to /dev/urandom.
+ * Returns 0 on success. */
+int get_entropy(uint8_t *b, size_t n) {
+        int fd;      /* /dev/urandom */
+        ssize_t ret; /* Bytes read */
+        size_t got;  /* Bytes read so far */
+
+#if defined(__linux__) && defined(SYS_getrandom)
+        /* Ask the kernel directly.  Old kernels will say ENOSYS. */
+        for (got = 0; got < n; got += ret) {
+                if (-1 == (ret = syscall(SYS_getrandom, b + got, n - got,
+                                                0))) {
+                        if (EINTR == errno) {
+                                ret = 0;
+                                continue;
+                        }
+                        break;
+                }
+        }
+        if (got == n) {
+                return 0;
+        }
+#elif defined(__OpenBSD__)
+        /* getentropy(2) gives at most 256 bytes at a time */
+        for (got = 0; got < n; got += ret) {
+                ret = n - got > 256 ? 256 : n - got;
+                if (-1 == getentropy(b + got, ret)) {
+                        break;
+                }
+        }
+        if (got == n) {
+                return 0;
+        }
+#endif /* #if defined(__linux__) && defined(SYS_getrandom) */
 
-/* Seed the random number generator.  This is probably one of those things that
- * needs to be made more secure.  */
+        /* Fall back on /dev/urandom */
+        if (-1 == (fd = open("/dev/urandom", O_RDONLY))) {
+                return RET_ERR_RAND;
+        }
+        for (got = 0; got < n; got += ret) {
+                if (0 >= (ret = read(fd, b + got, n - got))) {
+                        if (-1 == ret && EINTR == errno) {
+                                ret = 0;
+                                continue;
+                        }
+                        close(fd);
+                        return RET_ERR_RAND;
+                }
+        }
+        close(fd);
+        return 0;
+}
+
+/* Seed the random number generator from the kernel, or from the time and pid
+ * if that fails. */
 void seed_random() {
-        pid_t pid;
-        int i;
-        long r;
+        unsigned int seed;
+
         /* Don't seed twice */
         if (random_seeded) {
                 return;
         }
-        /* First seed random with the time. */
-        srandom(time(NULL));
-        /* To avoid two inserts started at the same time having the same seed
-         * reseed with the pid+1'th random number */
-        pid = getpid();
-        for (i = 0; i < pid; ++i) {
-                r = random();
-                /* This should always fail, but keep the above call from being
-                 * optimized away. */
-                if (NULL == &r) {
-                        printf("%li", r);
-                }
+        /* Prefer the kernel's idea of randomness.  The pid keeps two inserts
+         * started at the same time from having the same seed, otherwise. */
+        if (0 != get_entropy((uint8_t*)&seed, sizeof(seed))) {
+                seed = time(NULL) ^ ((unsigned int)getpid() << 16);
         }
-        /* Re-seed the random number generator with a random value */
-        srandom(random());
+        srandom(seed);
         random_seeded = 1;
-
-        /* Surely there's a better way to do this */
 }
 
 
 /* Initialize the stream used to send nonces.  This should be called fairly
  * early on in main(). */
 void noncestream_init() {
-        uint8_t nonce_arr[8];
+        uint8_t nonce_arr[8];  /* Nonce for the stream */
+        uint8_t nkey[KEYLEN];  /* Key for the stream */
         int i;
 
 
@@ -80,24 +132,24 @@ void noncestream_init() {
                 return;
         }
 
-        /* Seed the random number generator */
-        seed_random();
-
-        /* Eight bytes to use as the nonce */
-        for (i = 0; i < 8; ++i) {
-                /* If random() gives us more than a byte, use the upper one */
-                if (1 < sizeof(random())) {
+        /* Key the stream from the kernel, or from random(3) if not */
+        if ((0 != get_entropy(nkey, sizeof(nkey))) ||
+                        (0 != get_entropy(nonce_arr, sizeof(nonce_arr)))) {
+                seed_random();
+                for (i = 0; i < sizeof(nkey); ++i) {
+                        nkey[i] = (random() >> 8) & 0xFF;
+                }
+                for (i = 0; i < sizeof(nonce_arr); ++i) {
                         nonce_arr[i] = (random() >> 8) & 0xFF;
-                } else { /* If not, just use the one byte */
-                        nonce_arr[i] = random() & 0xFF;
                 }
         }
 
-        /* Zero the nonce context and the key bytes */
+        /* Zero the nonce context */
         memset((void*)&noncectx, 0, sizeof(noncectx));
 
         /* Set up stream */
-        chacha20_setup(&noncectx, key, KEYLEN, nonce_arr);
+        chacha20_setup(&noncectx, nkey, KEYLEN, nonce_arr);
+        memset(nkey, 0, sizeof(nkey));
         noncestream_init_done = 1;
 
         return;
@@ -105,6 +157,7 @@ void noncestream_init() {
 
 /* Get the next nonce */
 void make_nonce(uint8_t nonce[8]) {
+        pthread_mutex_lock(&nonce_mtx);
         ++nonce_ctr;
 
         /* Make sure the nonce stream has been initialized */
@@ -114,47 +167,104 @@ void make_nonce(uint8_t nonce[8]) {
 
         /* Encrypt the number of connection attempts */
         chacha20_encrypt(&noncectx, (uint8_t*)&nonce_ctr, nonce, 8);
+        pthread_mutex_unlock(&nonce_mtx);
         return;
 }
 
-/* Initialize the two crypto streams.  I hope a lot of this gets optimized. */
-void streams_init(uint8_t nonce[8]) {
+/* Initialize s's two crypto streams.  I hope a lot of this gets optimized. */
+void streams_init(struct session *s, uint8_t nonce[8]) {
         time_t now;             /* Time now */
-        uint64_t now8;          /* 8 bytes of time */
-        uint8_t timed_nonce[8]; /* Nonce xored with time */
-        int i;
-
-        /* Zero the contexts */
-        memset(&txctx, 0, sizeof(txctx));
-        memset(&rxctx, 0, sizeof(rxctx));
 
         /* Get the current time */
         now = time(NULL);
 
+        streams_setup(s, key, nonce, 0x000000000000 | now);
+}
+
+/* Initialize s's two crypto streams with the KEYLEN-byte key k and the nonce
+ * with when (usually the time) xored in. */
+void streams_setup(struct session *s, const uint8_t *k, uint8_t nonce[8],
+                uint64_t when) {
+        uint8_t timed_nonce[8]; /* Nonce xored with time */
+        int i;
 
-        /* Make it 8 bytes */
-        now8 = 0x000000000000 | now;
+        /* Zero the contexts */
+        memset(&s->txctx, 0, sizeof(s->txctx));
+        memset(&s->rxctx, 0, sizeof(s->rxctx));
 
         /* Make a copy of the nonce with the time xored in */
         for (i = 0; i < 8; ++i) {
-                timed_nonce[i] = nonce[i] ^ ((now8 >> (8 * i)) & 0xFF);
+                timed_nonce[i] = nonce[i] ^ ((when >> (8 * i)) & 0xFF);
         }
 
         /* Make the two keystreams */
         timed_nonce[0] &= 0xFC;
-        chacha20_setup(&rxctx, key, KEYLEN, timed_nonce);
+        chacha20_setup(&s->rxctx, k, KEYLEN, timed_nonce);
         timed_nonce[0] |= 0x03;
-        chacha20_setup(&txctx, key, KEYLEN, timed_nonce);
+        chacha20_setup(&s->txctx, k, KEYLEN, timed_nonce);
+}
+
+/* Set s's rxctx to the stream shift uses to encrypt the first flight of the
+ * pipelined handshake, given shift's nonce. */
+void hello_init(struct session *s, uint8_t snonce[8]) {
+        uint8_t hnonce[8]; /* Nonce for the hello stream */
+
+        memcpy(hnonce, snonce, sizeof(hnonce));
+        hnonce[0] = (hnonce[0] & 0xFC) | 0x01;
+        memset(&s->rxctx, 0, sizeof(s->rxctx));
+        chacha20_setup(&s->rxctx, key, KEYLEN, hnonce);
+}
+
+/* Encrypt n bytes at b with s's txctx for sending. */
+void txencrypt(struct session *s, uint8_t *b, size_t n) {
+        if (0 != ks_crypt(s, &s->txctx, b, n)) {
+                chacha20_encrypt(&s->txctx, b, b, n);
+        }
+}
+
+/* Decrypt n (received) bytes at b with s's rxctx. */
+void rxdecrypt(struct session *s, uint8_t *b, size_t n) {
+        if (0 != ks_crypt(s, &s->rxctx, b, n)) {
+                chacha20_decrypt(&s->rxctx, b, b, n);
+        }
+}
+
+/* Get s ready for indexed framing.  The two streams as they are now are used
+ * from any block for record data, and record headers are sent and received
+ * in order from block HDRBLOCK on. */
+void streams_index(struct session *s) {
+        s->txbase = s->txctx;
+        s->rxbase = s->rxctx;
+        s->txhctx = s->txctx;
+        chacha20_counter_set(&s->txhctx, HDRBLOCK);
+        s->rxhctx = s->rxctx;
+        chacha20_counter_set(&s->rxhctx, HDRBLOCK);
+}
+
+/* Encrypt n bytes at b with s's send stream starting at block.  This may be
+ * called from several threads at once. */
+void txencrypt_at(struct session *s, uint8_t *b, size_t n, uint64_t block) {
+        chacha20_ctx ctx; /* Our own copy of the stream */
+
+        ctx = s->txbase;
+        chacha20_counter_set(&ctx, block);
+        chacha20_encrypt(&ctx, b, b, n);
+}
+
+/* Make rxdecrypt start decrypting s's stream from block */
+void rxseek(struct session *s, uint64_t block) {
+        s->rxctx = s->rxbase;
+        chacha20_counter_set(&s->rxctx, block);
 }
 
-/* Encrypt n bytes at b with txctx for sending. */
-void txencrypt(uint8_t *b, size_t n) {
-        chacha20_encrypt(&txctx, b, b, n);
+/* Encrypt n bytes of s's record header at b. */
+void txhencrypt(struct session *s, uint8_t *b, size_t n) {
+        chacha20_encrypt(&s->txhctx, b, b, n);
 }
 
-/* Decrypt n (received) bytes at b with rxctx. */
-void rxdecrypt(uint8_t *b, size_t n) {
-        chacha20_decrypt(&rxctx, b, b, n);
+/* Decrypt n bytes of s's received record header at b. */
+void rxhdecrypt(struct session *s, uint8_t *b, size_t n) {
+        chacha20_decrypt(&s->rxhctx, b, b, n);
 }
 
 /* Compare the n bytes at a with the n bytes at b in constant time.  Returns 0
@@ -3,7 +3,7 @@
  * Functions definitions related to encryption/decryption
  * by J. Stuart McMurray
  * created 20150122
- * last modified 20150213
+ * last modified 20261018
  *
  * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -25,34 +25,75 @@
 
 #include "chacha20_simple.h"
 #include "insert.h"
+#include "session.h"
 #include "sha2.h"
 
 /* Seeded the random number generator */
 extern int random_seeded; /* Nonzero after seed_random() */
 
+/* Fill b with n bytes from the kernel's random number generator.  Returns 0
+ * on success. */
+int get_entropy(uint8_t *b, size_t n);
+
+/* Seed the random number generator */
+void seed_random();
+
 /* The context for the stream used to send nonces */
-chacha20_ctx noncectx;
+extern chacha20_ctx noncectx;
 extern int noncestream_init_done; /* Nonzero after noncestream_init() */
 
-/* Contexts for sending and receiving */
-extern chacha20_ctx txctx;
-extern chacha20_ctx rxctx;
+/* Initialize s's two crypto streams. */
+void streams_init(struct session *s, uint8_t nonce[8]);
+
+/* Initialize s's two crypto streams with the KEYLEN-byte key k and the nonce
+ * with when (usually the time) xored in. */
+void streams_setup(struct session *s, const uint8_t *k, uint8_t nonce[8],
+                uint64_t when);
 
-/* Initialize the two crypto streams. */
-void streams_init(uint8_t nonce[8]);
+/* Set s's rxctx to the stream shift uses to encrypt the first flight of the
+ * pipelined handshake, given shift's nonce. */
+void hello_init(struct session *s, uint8_t snonce[8]);
 
 /* Initialize the stream used to send nonces */
 void noncestream_init();
 
-/* Get the next nonce */
+/* Get the next nonce.  Nonces are unique across every session. */
 void make_nonce(uint8_t nonce[8]);
 extern uint64_t nonce_ctr; /* Number of nonces sent */
 
-/* Encrypt n bytes at b with txctx for sending. */
-void txencrypt(uint8_t *b, size_t n);
+/* Encrypt n bytes at b with s's txctx for sending. */
+void txencrypt(struct session *s, uint8_t *b, size_t n);
+
+/* Decrypt n (received) bytes at b with s's rxctx. */
+void rxdecrypt(struct session *s, uint8_t *b, size_t n);
+
+/* Indexed framing.  Each record is preceded by a header, encrypted in order
+ * from block HDRBLOCK of the stream, holding the block from which the record
+ * itself is encrypted and the record's size.  Records are encrypted from
+ * block DATABLOCK onwards, leaving the blocks below for the handshake. */
+#define HDRBLOCK (((uint64_t)1) << 63)
+#define DATABLOCK (((uint64_t)1) << 32)
+#define INDEXHDRLEN (8 + 4) /* Block and size */
+/* Number of stream blocks needed for n bytes */
+#define NBLOCKS(n) (((uint64_t)(n) + 63) / 64)
+
+/* Get s ready for indexed framing.  The two streams as they are now are used
+ * from any block for record data, and record headers are sent and received
+ * in order from block HDRBLOCK on. */
+void streams_index(struct session *s);
+
+/* Encrypt n bytes at b with s's send stream starting at block.  This may be
+ * called from several threads at once. */
+void txencrypt_at(struct session *s, uint8_t *b, size_t n, uint64_t block);
+
+/* Make rxdecrypt start decrypting s's stream from block */
+void rxseek(struct session *s, uint64_t block);
+
+/* Encrypt n bytes of s's record header at b. */
+void txhencrypt(struct session *s, uint8_t *b, size_t n);
 
-/* Decrypt n (received) bytes at b with rxctx. */
-void rxdecrypt(uint8_t *b, size_t n);
+/* Decrypt n bytes of s's received record header at b. */
+void rxhdecrypt(struct session *s, uint8_t *b, size_t n);
 
 /* Compare the n bytes at a with the n bytes at b in constant time.  Returns 0
  * if the two sets of bytes are equal. */
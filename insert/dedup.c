@@ -0,0 +1,167 @@
+/*
+ * dedup.c
+ * Keep track of the frames in shift's dedup cache
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "dedup.h"
+#include "insert.h"
+#include "retvals.h"
+#include "session.h"
+#include "sha2.h"
+
+uint64_t dedup_hits = 0;
+
+/* Shift keeps the frames themselves.  All insert needs is the digests, in
+ * the same least-recently-used order shift has them in, and a hash table to
+ * find them quickly, for each session. */
+#define NIL 0xFFFF
+struct ddent {
+        uint8_t digest[DIGESTLEN];
+        uint16_t prev;  /* More recently used */
+        uint16_t next;  /* Less recently used */
+        uint16_t hnext; /* Next in the hash bucket */
+};
+static struct ddcache {
+        struct ddent *ents;
+        uint16_t *buckets;
+        uint16_t head;   /* Most recently used */
+        uint16_t tail;   /* Least recently used */
+        uint16_t nents;  /* Entries in use */
+        uint16_t maxents; /* Cache size agreed on with shift */
+} caches[MAXSESSIONS];
+
+/* Hash bucket for a digest, which is already pretty random */
+#define NBUCKETS (0 < DEDUPLEN ? DEDUPLEN : 1)
+#define BUCKET(d) ((((uint32_t)(d)[0] << 8) | (d)[1]) % NBUCKETS)
+
+/* Take entry i out of c's LRU list */
+static void unlink_lru(struct ddcache *c, uint16_t i);
+
+/* Put entry i at the front of c's LRU list */
+static void push_lru(struct ddcache *c, uint16_t i);
+
+int dedup_init(void) {
+        struct ddcache *c;
+
+        if (0 == DEDUPLEN) {
+                return 0;
+        }
+        for (c = caches; c < caches + MAXSESSIONS; ++c) {
+                if ((NULL == (c->ents = arena_alloc(DEDUPLEN *
+                                                sizeof(*c->ents)))) ||
+                                (NULL == (c->buckets = arena_alloc(NBUCKETS *
+                                                sizeof(*c->buckets))))) {
+                        return RET_ENOMEM;
+                }
+        }
+        return 0;
+}
+
+void dedup_start(struct session *s) {
+        struct ddcache *c;
+
+        c = &caches[s->n];
+        c->maxents = DEDUPOPTLEN(s->options);
+        if (DEDUPLEN < c->maxents) {
+                c->maxents = DEDUPLEN;
+        }
+        if (!(s->options & OPT_DEDUP) || 0 == c->maxents) {
+                c->maxents = 0;
+                return;
+        }
+        memset(c->buckets, 0xFF, NBUCKETS * sizeof(*c->buckets));
+        c->head = c->tail = NIL;
+        c->nents = 0;
+}
+
+int dedup_check(struct session *s, const uint8_t *digest) {
+        struct ddcache *c;
+        struct ddent *ents;
+        uint16_t i;
+        uint16_t *p;
+
+        c = &caches[s->n];
+        if (0 == c->maxents) {
+                return 0;
+        }
+        ents = c->ents;
+
+        /* If we have it, it's now the most recently used */
+        for (i = c->buckets[BUCKET(digest)]; NIL != i; i = ents[i].hnext) {
+                if (0 == memcmp(digest, ents[i].digest, DIGESTLEN)) {
+                        unlink_lru(c, i);
+                        push_lru(c, i);
+                        ++dedup_hits;
+                        return 1;
+                }
+        }
+
+        /* If not, make room for it, the same way shift will */
+        if (c->nents < c->maxents) {
+                i = c->nents++;
+        } else {
+                i = c->tail;
+                unlink_lru(c, i);
+                for (p = &c->buckets[BUCKET(ents[i].digest)]; i != *p;
+                                p = &ents[*p].hnext) {
+                }
+                *p = ents[i].hnext;
+        }
+        memcpy(ents[i].digest, digest, DIGESTLEN);
+        ents[i].hnext = c->buckets[BUCKET(digest)];
+        c->buckets[BUCKET(digest)] = i;
+        push_lru(c, i);
+        return 0;
+}
+
+static void unlink_lru(struct ddcache *c, uint16_t i) {
+        struct ddent *ents;
+
+        ents = c->ents;
+        if (NIL != ents[i].prev) {
+                ents[ents[i].prev].next = ents[i].next;
+        } else {
+                c->head = ents[i].next;
+        }
+        if (NIL != ents[i].next) {
+                ents[ents[i].next].prev = ents[i].prev;
+        } else {
+                c->tail = ents[i].prev;
+        }
+}
+
+static void push_lru(struct ddcache *c, uint16_t i) {
+        struct ddent *ents;
+
+        ents = c->ents;
+        ents[i].prev = NIL;
+        ents[i].next = c->head;
+        if (NIL != c->head) {
+                ents[c->head].prev = i;
+        }
+        c->head = i;
+        if (NIL == c->tail) {
+                c->tail = i;
+        }
+}
@@ -0,0 +1,49 @@
+/*
+ * dedup.h
+ * Keep track of the frames in shift's dedup cache
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_DEDUP_H
+#define HAVE_DEDUP_H
+
+#include <stdint.h>
+
+#include "session.h"
+
+/* Size of a frame which is really a reference to a frame in shift's cache */
+#define DEDUPREF 1
+
+/* Number of frames sent as references */
+extern uint64_t dedup_hits;
+
+/* Allocate the cache.  Must be called before dedup_start. */
+int dedup_init(void);
+
+/* Empty s's cache and size it for its options.  Must be called before any
+ * frames are sent. */
+void dedup_start(struct session *s);
+
+/* Returns nonzero if the frame with the given digest (of its size and the
+ * frame) is in s's shift's cache, and it may be sent as a reference.  Either way,
+ * the frame becomes the most recently used.  Must be called for every frame
+ * sent, in the order they're sent. */
+int dedup_check(struct session *s, const uint8_t *digest);
+
+#endif /* HAVE_DEDUP_H */
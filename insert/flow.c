@@ -0,0 +1,241 @@
+/*
+ * flow.c
+ * Count frames by flow, for shift to see who's talking to whom
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "flow.h"
+#include "insert.h"
+#include "queue.h"
+#include "retvals.h"
+#include "sha2.h"
+
+uint64_t flow_records = 0;
+
+/* The flow table is open-addressed, with linear probing.  It's emptied before
+ * it gets too full, so probes stay short. */
+struct flow {
+        uint64_t bytes;             /* Bytes seen */
+        uint64_t first;             /* When the first frame was seen, in ms */
+        uint64_t last;              /* When the last frame was seen, in ms */
+        uint32_t frames;            /* Frames seen, 0 if the slot's unused */
+        uint8_t key[FLOWKEYLEN];
+};
+static struct flow *flows;
+static uint8_t *batch;          /* Records being queued for shift */
+static size_t nflows;           /* Slots in use */
+static uint64_t exported = 0;   /* When the table was last queued, in ms */
+
+/* Slots in the table, and the most flows in it before it's emptied */
+#define NSLOTS (0 < FLOWS ? FLOWS : 1)
+#define FLOWMAX (NSLOTS - NSLOTS / 4)
+
+/* Flow records per batch sent to shift, so the whole record, with its sizes
+ * and hash, is no bigger than the largest frame */
+#define FLOWBATCH ((MAXFRAMELEN - 2 * sizeof(uint16_t) - DIGESTLEN) / \
+                FLOWRECLEN)
+
+/* Get the big-endian uint16_t at b */
+#define GET16(b) ((uint16_t)(((b)[0] << 8) | (b)[1]))
+
+/* Put the key for the caplen-byte frame at b in key */
+static void flow_key(const uint8_t *b, size_t caplen, uint8_t *key);
+
+/* Queue every flow in the table for shift, and empty it */
+static void flow_flush(void);
+
+/* Put the n-byte big-endian v at b */
+static void put_be(uint8_t *b, uint64_t v, int n);
+
+int flow_init(void) {
+        if (0 == FLOWS) {
+                return 0;
+        }
+        if (NULL == (flows = arena_alloc(FLOWS * sizeof(*flows)))) {
+                return RET_ENOMEM;
+        }
+        memset(flows, 0, FLOWS * sizeof(*flows));
+        if (NULL == (batch = arena_alloc(FLOWBATCH * FLOWRECLEN))) {
+                return RET_ENOMEM;
+        }
+        nflows = 0;
+        return 0;
+}
+
+void flow_add(const uint8_t *b, size_t caplen, uint32_t len,
+                const struct timeval *ts) {
+        uint8_t key[FLOWKEYLEN];
+        uint64_t now;   /* Capture time, in ms */
+        uint32_t h;     /* FNV-1a hash of the key */
+        size_t i;
+
+        if (0 == FLOWS) {
+                return;
+        }
+        now = (uint64_t)ts->tv_sec * 1000 + ts->tv_usec / 1000;
+        if (0 == exported) {
+                exported = now;
+        }
+
+        /* Send what we have every so often, or if we're out of room */
+        if ((FLOWMAX <= nflows) || (now - exported >= FLOWSEC * 1000)) {
+                flow_flush();
+                exported = now;
+        }
+
+        /* Find the frame's flow */
+        flow_key(b, caplen, key);
+        h = 2166136261U;
+        for (i = 0; i < sizeof(key); ++i) {
+                h = (h ^ key[i]) * 16777619U;
+        }
+        for (i = h % NSLOTS; 0 != flows[i].frames; i = (i + 1) % NSLOTS) {
+                if (0 == memcmp(key, flows[i].key, sizeof(key))) {
+                        break;
+                }
+        }
+
+        /* Or start a new one */
+        if (0 == flows[i].frames) {
+                memcpy(flows[i].key, key, sizeof(key));
+                flows[i].bytes = 0;
+                flows[i].first = now;
+                ++nflows;
+        }
+        ++flows[i].frames;
+        flows[i].bytes += len;
+        flows[i].last = now;
+}
+
+static void flow_key(const uint8_t *b, size_t caplen, uint8_t *key) {
+        size_t off;     /* Offset of the IP header */
+        uint16_t et;    /* EtherType */
+        uint8_t *k;     /* Where the IP part of the key goes */
+        size_t hl;      /* IP header length */
+        uint8_t proto;  /* IP protocol */
+
+        memset(key, 0, FLOWKEYLEN);
+        memcpy(key, b, 12);
+
+        /* Skip a VLAN tag */
+        off = 12;
+        et = GET16(b + off);
+        off += 2;
+        if (0x8100 == et && off + 4 <= caplen) {
+                et = GET16(b + off + 2);
+                off += 4;
+        }
+        key[12] = (et >> 8) & 0xFF;
+        key[13] = et & 0xFF;
+        k = key + 14;
+
+        switch (et) {
+        case 0x0800: /* IPv4 */
+                if (off + 20 > caplen || 4 != (b[off] >> 4)) {
+                        return;
+                }
+                hl = (b[off] & 0x0F) * 4;
+                proto = b[off + 9];
+                k[0] = proto;
+                k[1] = 4;
+                memcpy(k + 2, b + off + 12, 4);
+                memcpy(k + 2 + 16, b + off + 16, 4);
+                /* Only the first fragment has the ports */
+                if (0 != (GET16(b + off + 6) & 0x1FFF)) {
+                        return;
+                }
+                off += hl;
+                break;
+        case 0x86DD: /* IPv6 */
+                if (off + 40 > caplen || 6 != (b[off] >> 4)) {
+                        return;
+                }
+                proto = b[off + 6];
+                k[0] = proto;
+                k[1] = 6;
+                memcpy(k + 2, b + off + 8, 16);
+                memcpy(k + 2 + 16, b + off + 24, 16);
+                off += 40;
+                break;
+        default:
+                return;
+        }
+
+        /* Ports, or ICMP type and code as the destination port, like
+         * IPFIX does */
+        k += 2 + 16 + 16;
+        switch (proto) {
+        case 6:   /* TCP */
+        case 17:  /* UDP */
+        case 132: /* SCTP */
+                if (off + 4 <= caplen) {
+                        memcpy(k, b + off, 4);
+                }
+                break;
+        case 1:  /* ICMP */
+        case 58: /* ICMPv6 */
+                if (off + 2 <= caplen) {
+                        memcpy(k + 2, b + off, 2);
+                }
+                break;
+        }
+}
+
+static void flow_flush(void) {
+        uint8_t *r;     /* Record being built */
+        size_t nrec;    /* Records in the batch */
+        size_t i;
+
+        nrec = 0;
+        for (i = 0; i < FLOWS; ++i) {
+                if (0 == flows[i].frames) {
+                        continue;
+                }
+                r = batch + nrec * FLOWRECLEN;
+                memcpy(r, flows[i].key, FLOWKEYLEN);
+                r += FLOWKEYLEN;
+                put_be(r, flows[i].frames, 4);
+                put_be(r + 4, flows[i].bytes, 8);
+                put_be(r + 4 + 8, flows[i].first, 8);
+                put_be(r + 4 + 8 + 8, flows[i].last, 8);
+                flows[i].frames = 0;
+                ++flow_records;
+                if (FLOWBATCH == ++nrec) {
+                        txq_put(batch, nrec * FLOWRECLEN, FLOWREC);
+                        nrec = 0;
+                }
+        }
+        if (0 != nrec) {
+                txq_put(batch, nrec * FLOWRECLEN, FLOWREC);
+        }
+        nflows = 0;
+}
+
+static void put_be(uint8_t *b, uint64_t v, int n) {
+        int i;
+
+        for (i = n - 1; 0 <= i; --i) {
+                b[i] = v & 0xFF;
+                v >>= 8;
+        }
+}
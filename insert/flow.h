@@ -0,0 +1,55 @@
+/*
+ * flow.h
+ * Count frames by flow, for shift to see who's talking to whom
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_FLOW_H
+#define HAVE_FLOW_H
+
+#include <sys/time.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A flow's key: destination and source MAC addresses, EtherType, IP
+ * protocol, IP version, source and destination addresses, and source and
+ * destination ports, all in network byte order.  IPv4 addresses take up the
+ * first 4 bytes of the 16. */
+#define FLOWKEYLEN (6 + 6 + 2 + 1 + 1 + 16 + 16 + 2 + 2)
+
+/* A flow record: the key, then the number of frames (4 bytes) and bytes (8
+ * bytes), and when the first and last frames were seen, in milliseconds since
+ * the epoch (8 bytes each), all in network byte order. */
+#define FLOWRECLEN (FLOWKEYLEN + 4 + 8 + 8 + 8)
+
+/* Number of flow records queued for shift */
+extern uint64_t flow_records;
+
+/* Allocate the flow table.  Must be called before flow_add. */
+int flow_init(void);
+
+/* Count the frame at b, of which caplen bytes were captured out of len, at
+ * ts.  Every FLOWSEC seconds, or when the table's getting full, the table is
+ * queued for shift and emptied.  Must only be called from the capture
+ * thread. */
+void flow_add(const uint8_t *b, size_t caplen, uint32_t len,
+                const struct timeval *ts);
+
+#endif /* HAVE_FLOW_H */
@@ -0,0 +1,123 @@
+/*
+ * fq.c
+ * Sort frames waiting to be sent to shift into queues
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include "fq.h"
+#include "insert.h"
+
+/* Get the big-endian uint16_t at b */
+#define GET16(b) ((uint16_t)(((b)[0] << 8) | (b)[1]))
+
+/* TCP flags */
+#define TCP_SYN 0x02
+
+/* Hash n bytes at b into h with FNV-1a */
+static uint32_t fnv(uint32_t h, const uint8_t *b, size_t n);
+
+int fq_class(const uint8_t *b, size_t n, uint16_t orig, uint32_t *hash) {
+        size_t off;     /* Offset of the IP, then transport, header */
+        uint16_t et;    /* EtherType */
+        uint8_t proto;  /* IP protocol */
+
+        *hash = 2166136261U;
+
+        /* Flow records are small and few.  A stream's records have to stay
+         * in order, so they share a queue. */
+        if (ETHHDRLEN > orig) {
+                if (STREAMREC == orig && 2 <= n) {
+                        *hash = fnv(*hash, b, 2);
+                        return 0;
+                }
+                return 1;
+        }
+
+        /* Skip a VLAN tag */
+        off = 12;
+        et = GET16(b + off);
+        off += 2;
+        if (0x8100 == et && off + 4 <= n) {
+                et = GET16(b + off + 2);
+                off += 4;
+        }
+
+        switch (et) {
+        case 0x0806: /* ARP */
+                return 1;
+        case 0x0800: /* IPv4 */
+                if (off + 20 > n || 4 != (b[off] >> 4)) {
+                        break;
+                }
+                proto = b[off + 9];
+                *hash = fnv(*hash, &proto, 1);
+                *hash = fnv(*hash, b + off + 12, 8);
+                /* Only the first fragment has the ports, but they all
+                 * have to go in the same queue */
+                if (0 != (GET16(b + off + 6) & 0x3FFF)) {
+                        return 0;
+                }
+                off += (b[off] & 0x0F) * 4;
+                goto TRANSPORT;
+        case 0x86DD: /* IPv6 */
+                if (off + 40 > n || 6 != (b[off] >> 4)) {
+                        break;
+                }
+                proto = b[off + 6];
+                *hash = fnv(*hash, &proto, 1);
+                *hash = fnv(*hash, b + off + 8, 32);
+                off += 40;
+                goto TRANSPORT;
+        }
+
+        /* Anything else is hashed by its addresses and EtherType */
+        *hash = fnv(*hash, b, 14);
+        return 0;
+
+TRANSPORT:
+        switch (proto) {
+        case 1:  /* ICMP */
+        case 58: /* ICMPv6 */
+                return 1;
+        case 6:  /* TCP */
+        case 17: /* UDP */
+                if (off + 4 > n) {
+                        return 0;
+                }
+                *hash = fnv(*hash, b + off, 4);
+                if (53 == GET16(b + off) || 53 == GET16(b + off + 2)) {
+                        return 1;
+                }
+                /* SYNs and SYN-ACKs */
+                return (6 == proto) && (off + 14 <= n) &&
+                        (b[off + 13] & TCP_SYN);
+        }
+        return 0;
+}
+
+static uint32_t fnv(uint32_t h, const uint8_t *b, size_t n) {
+        size_t i;
+
+        for (i = 0; i < n; ++i) {
+                h = (h ^ b[i]) * 16777619U;
+        }
+        return h;
+}
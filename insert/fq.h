@@ -0,0 +1,35 @@
+/*
+ * fq.h
+ * Sort frames waiting to be sent to shift into queues
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_FQ_H
+#define HAVE_FQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Work out which queue the n bytes at b, queued with the original length
+ * orig, go in.  Returns nonzero if they should be sent ahead of everything
+ * else: ARP, ICMP, DNS, TCP handshakes, and flow records.  Otherwise, a hash
+ * of the frame's flow (or record's stream) is put in hash. */
+int fq_class(const uint8_t *b, size_t n, uint16_t orig, uint32_t *hash);
+
+#endif /* HAVE_FQ_H */
@@ -0,0 +1,325 @@
+/*
+ * gro.c
+ * Merge runs of captured TCP segments into super-frames
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "gro.h"
+#include "insert.h"
+#include "queue.h"
+#include "retvals.h"
+#include "sha2.h"
+
+uint64_t gro_segs = 0;
+uint64_t gro_frames = 0;
+
+/* Get the big-endian uint16_t or uint32_t at b */
+#define GET16(b) ((uint16_t)(((b)[0] << 8) | (b)[1]))
+#define GET32(b) (((uint32_t)GET16(b) << 16) | GET16((b) + 2))
+
+/* TCP flags */
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+/* Most segments in a super-frame */
+#define NSEGS (0 < GROSEGS ? GROSEGS : 1)
+
+/* Where a captured TCP segment's headers are */
+struct groseg {
+        size_t tcpoff;  /* Offset of the TCP header */
+        size_t hl;      /* Size of all of the headers */
+        size_t plen;    /* Bytes of payload */
+        int v6;         /* Nonzero for IPv6 */
+        int ok;         /* Nonzero if it may be merged */
+};
+
+/* A super-frame being built: the first segment's headers, then every
+ * segment's payload.  Every segment but the last has mss bytes of payload. */
+struct groflow {
+        uint8_t *b;             /* Super-frame */
+        size_t n;               /* Size of the super-frame, 0 if unused */
+        struct groseg sg;       /* The first segment's headers */
+        uint16_t mss;           /* Payload of every segment but the last */
+        uint32_t seq;           /* Sequence number of the next segment */
+        uint16_t id;            /* IPv4 ID of the next segment */
+        int nseg;               /* Number of segments */
+        uint64_t when;          /* When it was started, to replace the
+                                   oldest */
+        uint8_t hdr[GSOHDRLEN + 2 * NSEGS]; /* Segment size, number of
+                                               segments, and each one's TCP
+                                               checksum */
+};
+static struct groflow supers[GROFLOWS];
+static uint64_t started = 0; /* Super-frames started */
+
+/* Find the headers of the n-byte frame at b, and work out whether it may be
+ * merged.  Returns 0 if it's not TCP. */
+static int gro_parse(const uint8_t *b, uint16_t n, struct groseg *sg);
+
+/* Find the super-frame being built for the flow of the segment at b, or
+ * return NULL */
+static struct groflow *gro_find(const uint8_t *b, const struct groseg *sg);
+
+/* Returns nonzero if the segment at b is the one which comes next in f, and
+ * it fits */
+static int gro_next(const struct groflow *f, const uint8_t *b,
+                const struct groseg *sg);
+
+/* Queue f, as a plain frame if it's only got the one segment, and mark it
+ * unused */
+static void gro_send(struct groflow *f);
+
+/* Put n at b in network byte order */
+static void put16(uint8_t *b, uint16_t n);
+
+int gro_init(void) {
+        int i;
+
+        if (0 == GROSEGS) {
+                return 0;
+        }
+        for (i = 0; i < GROFLOWS; ++i) {
+                if (NULL == (supers[i].b = arena_alloc(MAXFRAMELEN))) {
+                        return RET_ENOMEM;
+                }
+                supers[i].n = 0;
+        }
+        return 0;
+}
+
+int gro_add(const uint8_t *b, uint16_t n) {
+        struct groseg sg;
+        struct groflow *f;
+        int i;
+
+        if ((2 > GROSEGS) || !gro_parse(b, n, &sg)) {
+                return 0;
+        }
+
+        /* Tack it on to its flow's super-frame if it's next, otherwise the
+         * super-frame goes first */
+        if (NULL != (f = gro_find(b, &sg))) {
+                if (!gro_next(f, b, &sg)) {
+                        gro_send(f);
+                } else {
+                        memcpy(f->b + f->n, b + sg.hl, sg.plen);
+                        f->n += sg.plen;
+                        memcpy(f->hdr + GSOHDRLEN + 2 * f->nseg,
+                                        b + sg.tcpoff + 16, 2);
+                        ++f->nseg;
+                        f->seq += sg.plen;
+                        ++f->id;
+                        /* A short segment or a push ends the run */
+                        if ((sg.plen < f->mss) ||
+                                        (b[sg.tcpoff + 13] & TCP_PSH)) {
+                                f->b[sg.tcpoff + 13] |=
+                                        b[sg.tcpoff + 13] & TCP_PSH;
+                                gro_send(f);
+                        }
+                        return 1;
+                }
+        }
+
+        /* Start a new one if more may follow, in place of the oldest if
+         * there's no room */
+        if (!sg.ok || (b[sg.tcpoff + 13] & TCP_PSH)) {
+                return 0;
+        }
+        f = NULL;
+        for (i = 0; i < GROFLOWS; ++i) {
+                if (0 == supers[i].n) {
+                        f = &supers[i];
+                        break;
+                }
+                if ((NULL == f) || (supers[i].when < f->when)) {
+                        f = &supers[i];
+                }
+        }
+        if (0 != f->n) {
+                gro_send(f);
+        }
+        memcpy(f->b, b, n);
+        f->n = n;
+        f->sg = sg;
+        f->mss = sg.plen;
+        f->seq = GET32(b + sg.tcpoff + 4) + sg.plen;
+        f->id = GET16(b + ETHHDRLEN + 4) + 1;
+        memcpy(f->hdr + GSOHDRLEN, b + sg.tcpoff + 16, 2);
+        f->nseg = 1;
+        f->when = started++;
+        return 1;
+}
+
+void gro_flush(void) {
+        int i;
+
+        for (i = 0; i < GROFLOWS; ++i) {
+                if (0 != supers[i].n) {
+                        gro_send(&supers[i]);
+                }
+        }
+}
+
+static int gro_parse(const uint8_t *b, uint16_t n, struct groseg *sg) {
+        size_t iplen;   /* Bytes of IP header and payload */
+
+        memset(sg, 0, sizeof(*sg));
+        if (ETHHDRLEN > n) {
+                return 0;
+        }
+
+        /* Find the TCP header, and how much the IP header says there is */
+        switch (GET16(b + 12)) {
+        case 0x0800: /* IPv4 */
+                if (ETHHDRLEN + 20 > n || 4 != (b[ETHHDRLEN] >> 4) ||
+                                5 > (b[ETHHDRLEN] & 0x0F) ||
+                                6 != b[ETHHDRLEN + 9] ||
+                                0 != (GET16(b + ETHHDRLEN + 6) & 0x3FFF)) {
+                        return 0;
+                }
+                sg->tcpoff = ETHHDRLEN + (b[ETHHDRLEN] & 0x0F) * 4;
+                iplen = GET16(b + ETHHDRLEN + 2);
+                break;
+        case 0x86DD: /* IPv6, without extension headers */
+                if (ETHHDRLEN + 40 > n || 6 != (b[ETHHDRLEN] >> 4) ||
+                                6 != b[ETHHDRLEN + 6]) {
+                        return 0;
+                }
+                sg->tcpoff = ETHHDRLEN + 40;
+                iplen = 40 + GET16(b + ETHHDRLEN + 4);
+                sg->v6 = 1;
+                break;
+        default:
+                return 0;
+        }
+        if (sg->tcpoff + 20 > n) {
+                return 0;
+        }
+
+        /* Only plain data segments are merged: no IP options, no padding,
+         * and no flags but ACK and PSH */
+        sg->hl = sg->tcpoff + (b[sg->tcpoff + 12] >> 4) * 4;
+        sg->ok = (sg->v6 || ETHHDRLEN + 20 == sg->tcpoff) &&
+                (ETHHDRLEN + iplen == n) && (sg->tcpoff + 20 <= sg->hl) &&
+                (sg->hl < n) && (TCP_ACK == (b[sg->tcpoff + 13] & ~TCP_PSH));
+        if (sg->ok) {
+                sg->plen = n - sg->hl;
+        }
+        return 1;
+}
+
+static struct groflow *gro_find(const uint8_t *b, const struct groseg *sg) {
+        struct groflow *f;
+        int same;
+
+        for (f = supers; f < supers + GROFLOWS; ++f) {
+                if ((0 == f->n) || (sg->v6 != f->sg.v6)) {
+                        continue;
+                }
+                /* Same addresses and ports */
+                if (sg->v6) {
+                        same = 0 == memcmp(f->b + ETHHDRLEN + 8,
+                                        b + ETHHDRLEN + 8, 32);
+                } else {
+                        same = 0 == memcmp(f->b + ETHHDRLEN + 12,
+                                        b + ETHHDRLEN + 12, 8);
+                }
+                if (same && (0 == memcmp(f->b + f->sg.tcpoff, b + sg->tcpoff,
+                                                4))) {
+                        return f;
+                }
+        }
+        return NULL;
+}
+
+static int gro_next(const struct groflow *f, const uint8_t *b,
+                const struct groseg *sg) {
+        const uint8_t *h; /* First segment's headers */
+        size_t ip;        /* Offset of the IP header */
+        size_t t;         /* Offset of the TCP header */
+
+        h = f->b;
+        ip = ETHHDRLEN;
+        t = sg->tcpoff;
+
+        /* It has to fit, with the record's sizes and hash as well, and no
+         * segment but the last may be short */
+        if (!sg->ok || (NSEGS <= f->nseg) || (sg->hl != f->sg.hl) ||
+                        (sg->plen > f->mss) ||
+                        (MAXFRAMELEN - 2 * sizeof(uint16_t) - DIGESTLEN <
+                         GSOHDRLEN + 2 * (f->nseg + 1) + f->n + sg->plen)) {
+                return 0;
+        }
+
+        /* Same Ethernet header */
+        if (0 != memcmp(h, b, ETHHDRLEN)) {
+                return 0;
+        }
+
+        /* Same IP header, but for the length, the checksum, and the IPv4 ID,
+         * which goes up by one each segment */
+        if (sg->v6) {
+                if ((0 != memcmp(h + ip, b + ip, 4)) ||
+                                (0 != memcmp(h + ip + 6, b + ip + 6, 34))) {
+                        return 0;
+                }
+        } else if ((0 != memcmp(h + ip, b + ip, 2)) ||
+                        (f->id != GET16(b + ip + 4)) ||
+                        (0 != memcmp(h + ip + 6, b + ip + 6, 4)) ||
+                        (0 != memcmp(h + ip + 12, b + ip + 12, 8))) {
+                return 0;
+        }
+
+        /* Same TCP header, but for the sequence number, which carries on
+         * from the last segment, PSH, and the checksum */
+        return (0 == memcmp(h + t, b + t, 4)) && (f->seq == GET32(b + t + 4)) &&
+                (0 == memcmp(h + t + 8, b + t + 8, 5)) &&
+                (0 == memcmp(h + t + 14, b + t + 14, 2)) &&
+                (0 == memcmp(h + t + 18, b + t + 18, sg->hl - t - 18));
+}
+
+static void gro_send(struct groflow *f) {
+        if (1 == f->nseg) {
+                txq_put(f->b, f->n, f->n);
+                f->n = 0;
+                return;
+        }
+
+        /* The IP header's length covers the lot, as in a GSO packet */
+        if (f->sg.v6) {
+                put16(f->b + ETHHDRLEN + 4, f->n - ETHHDRLEN - 40);
+        } else {
+                put16(f->b + ETHHDRLEN + 2, f->n - ETHHDRLEN);
+        }
+        put16(f->hdr, f->mss);
+        put16(f->hdr + 2, f->nseg);
+        txq_put_gso(f->hdr, GSOHDRLEN + 2 * f->nseg, f->b, f->n);
+        gro_segs += f->nseg;
+        ++gro_frames;
+        f->n = 0;
+}
+
+static void put16(uint8_t *b, uint16_t n) {
+        b[0] = (n >> 8) & 0xFF;
+        b[1] = n & 0xFF;
+}
@@ -0,0 +1,46 @@
+/*
+ * gro.h
+ * Merge runs of captured TCP segments into super-frames
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_GRO_H
+#define HAVE_GRO_H
+
+#include <stdint.h>
+
+/* Number of segments merged into super-frames, and super-frames queued */
+extern uint64_t gro_segs;
+extern uint64_t gro_frames;
+
+/* Allocate the super-frame buffers.  Must be called before gro_add. */
+int gro_init(void);
+
+/* Merge the n-byte frame at b into a super-frame, if it's the next in-order
+ * TCP segment of one being built or could start one, and return nonzero.
+ * Otherwise, queue the super-frame of its flow, if there is one, so the frame
+ * can be queued after it, and return 0.  Must only be called from channel 0's
+ * capture thread. */
+int gro_add(const uint8_t *b, uint16_t n);
+
+/* Queue every super-frame being built, at the end of a batch of captured
+ * frames.  Must only be called from channel 0's capture thread. */
+void gro_flush(void);
+
+#endif /* HAVE_GRO_H */
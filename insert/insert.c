@@ -3,7 +3,7 @@
  * The remote half of thriftiness
  * by J. Stuart McMurray
  * created 20150117
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -22,44 +22,76 @@
 
 #include <pcap.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "cap.h"
 #include "comm.h"
+#include "crypto.h"
+#include "dedup.h"
+#include "flow.h"
+#include "gro.h"
 #include "insert.h"
+#include "keystream.h"
 #include "net.h"
+#include "queue.h"
+#include "rate.h"
 #include "retvals.h"
 #include "rx.h"
+#include "session.h"
+#include "stream.h"
 #include "tx.h"
 
 /* Install name buffer, for comparisons */
 uint8_t installname[INSTALLNAMELEN];
 uint8_t key[KEYLEN];
 
-/* Error "returned" from read/write threads */
-int reterr;             /* Error itself */
-pthread_mutex_t retmtx; /* Mutex to lock reterr */
+/* Sessions and capture threads set errors at the same time */
+static pthread_mutex_t errmtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Base and maximum time to sleep between attempts to connect */
+static int sleepsec;
+static int maxsleepsec;
+
+/* Handshake with the shift on s's socket and, if that works, proxy comms
+ * between us (pcap) and it, then close the socket.  Returns the handshake's
+ * error, if it fails. */
+static int session(struct session *s);
+
+/* Run session on the session at arg in its own thread.  A listening insert
+ * runs several of these at once. */
+static void *session_thread(void *arg);
 
 /* Wait for a connection or make a connection to a remote host, proxy comms
  * between us (pcap) and them */
 int main(void) {
-        int sleepsec;
         int remfd;
         char *endptr;
         int ret;
         int i;
-        pcap_t *p;      /* Pcap handle */
-        pthread_t itos; /* Thread to sniff packets and send them to shift */
-        struct its_data itos_data; /* Data for insert_to_shift */
+        int nfail;      /* Number of consecutive failed attempts */
+        pthread_t capt[MAXCHANNELS]; /* Threads to sniff packets and queue
+                                        them, one per channel */
+        struct session *s; /* Session with the shift on remfd */
 
         /* Work how long to sleep between connections */
         sleepsec = strtol(SLEEPSEC, &endptr, 0);
         if ((0 == sleepsec) && ('\0' != *endptr)) {
                 return RET_INV_SLEEP;
         }
+        maxsleepsec = strtol(MAXSLEEPSEC, &endptr, 0);
+        if ((0 == maxsleepsec) && ('\0' != *endptr)) {
+                return RET_INV_SLEEP;
+        }
+
+        /* Work out how fast to send */
+        if (0 != (ret = rate_init())) {
+                return ret;
+        }
 
         /* Make sure the installname isn't too long, and copy it to a buffer */
         if ('\0' == INSTALLNAME[0]) {
@@ -76,17 +108,39 @@ int main(void) {
         memset(key, 0, sizeof(key));
         memcpy(key, KEY, sizeof(key));
 
-        /* Initialize thread return mutex */
-        pthread_mutex_init(&retmtx, NULL);
+        /* Get the session slots ready */
+        sess_init();
+
+        /* Random numbers are used for the nonce and backoff jitter */
+        seed_random();
+        noncestream_init();
 
-        /* Set up the stream to make randomish nonces */
+        /* All of the big buffers come from one place */
+        if ((0 != (ret = arena_init())) || (0 != (ret = txq_init())) ||
+                        (0 != (ret = rx_init())) || (0 != (ret = tx_init())) ||
+                        (0 != (ret = ks_init())) ||
+                        (0 != (ret = dedup_init())) ||
+                        (0 != (ret = flow_init())) ||
+                        (0 != (ret = gro_init())) ||
+                        (0 != (ret = stream_init()))) {
+                return ret;
+        }
+
+        /* Capture the whole time, even while there's no connection, once
+         * for every session */
+        for (i = 0; i < cap_channels(); ++i) {
+                if (0 != (ret = start_thread(&capt[i], capture,
+                                                (void *)(intptr_t)i))) {
+                        return ret;
+                }
+        }
+
+        nfail = 0;
         for (;;) {
-                reterr = 0;
-                p = NULL;
                 ret = 0;
 
                 /* Clear the error variable */
-                unsetenv(ERRVAR);
+                clrerr();
 
                 /* Get a file descriptor representing the remote end */
                 if ('l' == ADDR[0]) {
@@ -103,49 +157,170 @@ int main(void) {
                 if (0 > remfd) {
                         goto TRYAGAIN;
                 }
-                /* Set send/receive timeouts */
-                if (0 > (ret = set_txrx_timeouts(remfd))) {
+                /* Make sure there's room for another session */
+                if (NULL == (s = sess_new(remfd))) {
+                        ret = RET_ERR_SESS;
                         goto TRYAGAIN;
                 }
-                /* Attemp to handshake */
-                if (0 > (ret = handshake(remfd))) {
-                        /* If it fails, close the connection, try again */
+                /* Set send/receive timeouts */
+                if (0 > (ret = set_txrx_timeouts(remfd))) {
+                        sess_done(s);
                         goto TRYAGAIN;
                 }
 
-                /* Start pcap going */
-                if (0 > (ret = pcap_setup(&p))) {
-                        goto TRYAGAIN;
+                /* When listening, the session gets a thread of its own,
+                 * handshake and all, so a slow shift doesn't hold up the
+                 * rest, and we go back to waiting for the next shift */
+                if ('l' == ADDR[0]) {
+                        if (0 != (ret = start_thread(&s->t, session_thread,
+                                                        s))) {
+                                sess_done(s);
+                                goto TRYAGAIN;
+                        }
+                        s->threaded = 1;
+                        nfail = 0;
+                        continue;
                 }
 
-                /* Start pthread to receive data from pcap and send to shift */
-                memset(&itos, 0, sizeof(itos));
-                memset(&itos_data, 0, sizeof(itos_data));
-                itos_data.fd = remfd;
-                itos_data.p = p;
-                pthread_create(&itos, NULL, insert_to_shift, &itos_data);
-                /* Receive data from shift and put it on the network */
-                shift_to_insert(remfd, p);
-                /* When it's done, cancel the insert-to-shift comms */
-                pthread_cancel(itos);
-
-                /* Wait for insert->shift thread to end */
-                pthread_join(itos, NULL);
-                /* Set the error returned by one of the threads */
-                if (0 != reterr) {
-                        seterr(reterr);
+                /* Otherwise, there's only the one.  If the handshake works,
+                 * try again right away once the session's over. */
+                if (0 == (ret = session(s))) {
+                        nfail = 0;
                 }
+                remfd = -1;
 TRYAGAIN:
                 /* Set the error code if it's nonzero */
                 if (0 != ret) {
                         seterr(ret);
                 }
-                if (NULL != p) {
-                        pcap_close(p);
+                if (0 <= remfd) {
+                        close(remfd);
+                }
+                backoff(nfail++);
+        }
+}
+
+static int session(struct session *s) {
+        int ret;
+        int i;
+        pthread_t itos[TXTHREADS]; /* Threads to send queued packets to shift */
+        struct its_data itos_data[TXTHREADS]; /* Data for insert_to_shift */
+        int nitos;      /* Number of insert_to_shift threads started */
+
+        /* Attemp to handshake.  If it fails, close the connection. */
+        if (0 > (ret = handshake(s))) {
+                close(s->fd);
+                sess_done(s);
+                return ret;
+        }
+
+        /* Start queueing frames for this shift, too */
+        sess_attach(s);
+
+        /* Work out keystream in the background */
+        ks_start(s);
+
+        /* Start pthreads to send queued frames to shift */
+        tx_start(s);
+        rate_start(s);
+        memset(itos, 0, sizeof(itos));
+        memset(itos_data, 0, sizeof(itos_data));
+        for (nitos = 0; nitos < TXTHREADS; ++nitos) {
+                itos_data[nitos].s = s;
+                itos_data[nitos].n = nitos;
+                if (0 != (ret = start_thread(&itos[nitos], insert_to_shift,
+                                                &itos_data[nitos]))) {
+                        break;
                 }
-                close(remfd);
-                sleep(sleepsec);
         }
+        /* Receive data from shift and put it on the network */
+        if (TXTHREADS == nitos) {
+                shift_to_insert(s);
+        }
+        /* When it's done, cancel the insert-to-shift comms */
+        for (i = 0; i < nitos; ++i) {
+                pthread_cancel(itos[i]);
+        }
+
+        /* Wait for insert->shift threads to end */
+        for (i = 0; i < nitos; ++i) {
+                pthread_join(itos[i], NULL);
+        }
+        rate_stop(s);
+        ks_stop(s);
+        stream_stop(s);
+        sess_detach(s);
+        /* Set the error returned by one of the threads */
+        if (0 != s->reterr) {
+                seterr(s->reterr);
+        }
+        if (0 != ret) {
+                seterr(ret);
+        }
+        close(s->fd);
+        sess_done(s);
+        return 0;
+}
+
+static void *session_thread(void *arg) {
+        int ret;
+
+        if (0 != (ret = session((struct session *)arg))) {
+                seterr(ret);
+        }
+        return NULL;
+}
+
+/* Sleep before the nfail'th consecutive retry (starting at 0).  The first
+ * retry happens right away, after which the sleep time starts at sleepsec and
+ * doubles every time, up to maxsleepsec.  Up to half of it is randomly taken
+ * off. */
+void backoff(int nfail) {
+        uint64_t us;  /* Microseconds to sleep */
+        uint64_t max; /* Maximum microseconds to sleep */
+        int i;
+
+        if (0 == nfail) {
+                return;
+        }
+
+        /* Exponential backoff, capped */
+        us = (uint64_t)sleepsec * 1000000;
+        max = (uint64_t)maxsleepsec * 1000000;
+        for (i = 1; i < nfail && us < max; ++i) {
+                us *= 2;
+        }
+        if (us > max) {
+                us = max;
+        }
+
+        /* Jitter */
+        if (0 != us / 2) {
+                us -= random() % (us / 2);
+        }
+
+        /* usleep(3) may not be able to sleep for a second or more */
+        sleep(us / 1000000);
+        usleep(us % 1000000);
+}
+
+/* Start a thread with a THREADSTACK-sized stack */
+int start_thread(pthread_t *t, void *(*f)(void *), void *arg) {
+        pthread_attr_t attr;
+        int ret;
+
+        pthread_attr_init(&attr);
+        if ((0 != THREADSTACK) &&
+                        (0 != pthread_attr_setstacksize(&attr, THREADSTACK))) {
+                pthread_attr_destroy(&attr);
+                return RET_ERR_THR;
+        }
+        ret = pthread_create(t, &attr, f, arg);
+        pthread_attr_destroy(&attr);
+        if (0 != ret) {
+                return RET_ERR_THR;
+        }
+        return 0;
 }
 
 /* Set the environment variable specifed by ERRVAR to the absolute value of the
@@ -160,6 +335,8 @@ void seterr(int code) {
         evar = NULL;
         errloc = NULL;
 
+        pthread_mutex_lock(&errmtx);
+
         /* First try ERRVAR, then PATH */
         for (i = 0; NULL != vars[i]; ++i) {
                 /* Get a pointer to the variable */
@@ -187,25 +364,18 @@ void seterr(int code) {
 
         /* Put it in the environment variable */
         memcpy(evar, codes, ret);
+        pthread_mutex_unlock(&errmtx);
         return;
 
 giveup:
         unsetenv("PATH");
+        pthread_mutex_unlock(&errmtx);
         return;
 }
 
-/* Safely reterr to r if it's not already set */
-void set_reterr(int r) {
-        /* If it's already set, give up */
-        if (0 != reterr) {
-                return;
-        }
-        /* Lock reterr */
-        pthread_mutex_lock(&retmtx);
-        /* Change it if it's still 0 */
-        if (0 == reterr) {
-                reterr = r;
-        }
-        /* Unlock reterr */
-        pthread_mutex_unlock(&retmtx);
+/* Clear the environment variable specified by ERRVAR */
+void clrerr(void) {
+        pthread_mutex_lock(&errmtx);
+        unsetenv(ERRVAR);
+        pthread_mutex_unlock(&errmtx);
 }
@@ -3,7 +3,7 @@
  * Defines and such for insert
  * by J. Stuart McMurray
  * created 20150117
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -43,12 +43,17 @@
 #define KEY "012345678901234567890123456789AB"
 /* Address and port for listening (or connecting).  A leading c will cause
  * insert to connect to the address, and a leading l will cause insert to
- * listen on the address.  Note that this needs to be configured. */
+ * listen on the address.  A listening insert serves up to MAXSESSIONS shifts
+ * at once.  Note that this needs to be configured. */
 #define ADDR "l0.0.0.0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0a"
 #define PORT "31337\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0p"
-/* Sleep time, in seconds, between calls or to wait after client disconnects,
- * zero-padded out to 8 characters */
+/* Sleep time, in seconds, between calls or to wait after a failed attempt to
+ * connect or handshake, zero-padded out to 8 characters.  The first attempt
+ * after a session ends is made right away.  Every consecutive failure doubles
+ * the sleep time, up to MAXSLEEPSEC, and a random amount up to half the
+ * sleep time is taken off so that many inserts don't retry in lockstep. */
 #define SLEEPSEC "0x000001"
+#define MAXSLEEPSEC "0x00003c"
 /* The environment variable in which to store error codes.  If this is a
  * variable that already exists in insert's environment, the first ERRLEN
  * characters after the '=' will be set to the error code listen in retvals.h.
@@ -69,22 +74,208 @@
  * comparison will be done in constant time. */
 #define INSTALLNAME "0001\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0i"
 #define INSTALLNAMELEN 1024
+/* The handshake to use, padded with nulls and ending in h.  l is the original
+ * lockstep handshake.  p is the pipelined handshake, which takes a single
+ * round trip and allows shift to resume a recent session without any round
+ * trips, and must be turned on in shift with -pipeline.  See the file named
+ * protocol. */
+#define HANDSHAKE "l\0\0\0\0\0\0h"
+/* Number of resumption tickets to remember for the pipelined handshake, and
+ * how long, in seconds, each is good for.  0 tickets turns off resumption. */
+#define TICKETS 4
+#define TICKETLIFE 600
 /* The number of bytes of data to read (and ignore) before insert starts the
  * handshake with shift, zero-padded out to 8 characters.  It may not be
  * larger than MAXJUNKSIZE. */
 #define JUNKSIZE "0x000010"
-/* The maximum size of JUNKSIZE.  This is the amount of memory allocated to
- * read junk during the handshake (though only JUNKSIZE bytes will be read). */
+/* The maximum size of JUNKSIZE.  Junk is read (and ignored) a bit at a time,
+ * so this doesn't affect memory use. */
 #define MAXJUNKSIZE 1024
 /* The interface attached to the network to shift into, right-padded with null
- * bytes and ending in n (for nic). */
-#define PCAPINT "em0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0c"
+ * bytes and ending in n (for nic).  More interfaces (e.g. VLANs) may follow,
+ * separated by commas, to shift into several networks over one session.  The
+ * first is channel 0, which goes to shift's tun device, and the rest are
+ * channels 1, 2, and so on, for shift's -chans devices.  Only the first
+ * MAXCHANNELS are used. */
+#define PCAPINT "em0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0c"
 /* The capture filter.  This can be a null string (great for sniffing), or 
  * nearly any other BPF filter.  Padded on the right with nulls, and ends in a
  * f.  NB: 'ip broadcast' probably won't work. */
-/* Number of bytes per frame */
 #define PCAPFILT "arp or dst 192.168.111.9\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0f"
-#define SNAPLEN 65535 /* Max size for two bytes */
+/* Monitoring.  If shift asks for truncated frames, frames longer than
+ * TRUNCLEN bytes (at least 14) are cut down to that and sent with their
+ * original length.  If TRUNCFILT is a null string, every frame is, and pcap
+ * only captures TRUNCLEN bytes of each.  Otherwise, only frames matching the
+ * BPF filter in TRUNCFILT are.  TRUNCFILT is padded on the right with nulls,
+ * and ends in a t.  TRUNCLEN 0 turns this off. */
+#define TRUNCLEN 0
+#define TRUNCFILT "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0t"
+/* Where pcap can't be told to capture only incoming frames, frames insert
+ * injects may be captured and sent back to shift.  To stop that, a hash of
+ * each of the last ECHOSET frames injected is kept for ECHOMS milliseconds,
+ * and captured frames which match are dropped.  0 turns this off. */
+#define ECHOSET 32
+#define ECHOMS 1000
+/* Insert learns the source MAC addresses of up to LEARNMACS frames shift
+ * sends, and snoops the IGMP and MLD it sends to keep track of up to MCGROUPS
+ * multicast groups it's joined.  Once shift's sent something, PCAPFILT is
+ * narrowed to broadcast frames, frames to those groups, and frames to those
+ * addresses.  The filter is swapped for a new one on the same pcap handle at
+ * most every LEARNSEC seconds.  LEARNMACS 0 keeps PCAPFILT as it is. */
+#define LEARNMACS 16
+#define MCGROUPS 32
+#define LEARNSEC 10
+/* Broadcast and multicast frames are sorted into classes (mDNS, SSDP, LLMNR,
+ * NetBIOS, STP and friends, ARP, and everything else) and each class may send
+ * at most STORMPPS frames per second to shift, with bursts of up to STORMBURST
+ * frames.  ARP gets ARPPPS, as shift can't do much without it.  Multicast to
+ * groups shift hasn't joined isn't sent at all, unless MCGROUPS is 0.
+ * STORMPPS 0 turns off the limits. */
+#define STORMPPS 10
+#define STORMBURST 50
+#define ARPPPS 100
+/* When a pure TCP ACK is captured while an older one for the same flow is
+ * still waiting to be sent, the newer one takes the older one's place in the
+ * queue instead of both being sent.  Up to ACKTHIN flows are kept track of at
+ * once.  0 turns this off. */
+#define ACKTHIN 16
+/* Receive offload.  If shift asks for it, runs of up to GROSEGS in-order TCP
+ * segments of the same flow captured in one go are merged into a single
+ * super-frame, which shift splits up again, so a bulk transfer costs a record
+ * (size, hash, and send) per run rather than per segment.  Super-frames are
+ * no bigger than MAXFRAMELEN, so this does little with LOWMEM.  0 turns this
+ * off. */
+#define GROSEGS 32
+/* Flow export.  If shift asks for flows, frames aren't sent at all.  Instead,
+ * insert counts them by flow (MAC and IP addresses, protocol, and ports), and
+ * sends shift what it's counted every FLOWSEC seconds, or sooner if the flow
+ * table fills up.  Flows are checked on the next captured frame, so a quiet
+ * network sends them late. */
+#define FLOWSEC 60
+/* Streams.  Shift may forward TCP connections made to it (shift's -fwd) to
+ * hosts on insert's network, in which case insert makes the connections
+ * itself and only the bytes sent each way go through the tunnel.  Each end's
+ * kernel does its own acknowledgements and windowing, so a slow or lossy link
+ * between shift and insert doesn't slow down the TCP on either side.  At most
+ * STREAMS connections may be open at once per session.  0 turns this off.
+ * Bytes from shift wait in a buffer for the remote host to take them (see
+ * STREAMBUFLEN), which shift doesn't send more than, and a stream whose remote
+ * host or shift stops taking bytes for ten seconds is closed. */
+#define STREAMS 16
+/* Queueing.  Frames waiting to be sent to shift are sorted by flow into
+ * FQFLOWS queues, which take turns sending about FQQUANTUM bytes each, so a
+ * busy flow doesn't hold up the rest.  A queue whose frames have been waiting
+ * longer than CODELTARGET milliseconds for at least CODELINTERVAL
+ * milliseconds has frames dropped from its front, more often the longer it
+ * goes on, which tells TCP to slow down (CoDel).  ARP, ICMP, DNS, and TCP
+ * handshakes skip the queues entirely.  FQFLOWS 0 puts every frame in one
+ * queue, and CODELTARGET 0 turns off dropping. */
+#define FQFLOWS 64
+#define FQQUANTUM 1514
+#define CODELTARGET 5
+#define CODELINTERVAL 100
+/* Rate limiting.  Insert sends shift at most RATE bytes per second (counting
+ * only what goes through the tunnel, not TCP/IP overhead), zero-padded out to
+ * 10 characters, with bursts of up to RATEBURST bytes.  Where the kernel can
+ * pace a socket (SO_MAX_PACING_RATE), it does the pacing, otherwise insert
+ * waits between frames.  Captured frames may use at most RATEFRAMES percent
+ * of the rate, and streams RATESTREAMS percent, from 1 to 100.  RATESCHED is
+ * a comma-separated list of HHMM=rate, in local time and bytes per second,
+ * e.g. "0800=50000,1800=0".  Each rate is used from its time of day until the
+ * next, in place of RATE.  RATESCHED is padded on the right with nulls, and
+ * ends in an r.  A rate of 0 means no limit. */
+#define RATE "0x00000000"
+#define RATEBURST 65536
+#define RATEFRAMES 100
+#define RATESTREAMS 100
+#define RATESCHED "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0r"
+/* Memory use.  Building with -DLOWMEM (e.g. CFLAGS=-DLOWMEM ./build.sh) sizes
+ * everything for small embedded boxes.  Any of these may also be set with -D.
+ *
+ * MAXFRAMELEN is the largest frame which will be captured, injected, or sent
+ * in either direction, in bytes, and every frame buffer is sized from it.  It
+ * may not be more than 65535, and shift's -mtu shouldn't be more than it.
+ * TXQLEN is the number of bytes of captured frames to hold while waiting to
+ * send them to shift, including while there's no connection to shift.  Frames
+ * captured while the queue is full are dropped.  THREADSTACK is the stack
+ * size, in bytes, for insert's threads, or 0 for the system default.
+ * PCAPBUFLEN is the size of pcap's kernel buffer, or 0 for pcap's default.
+ * TXTHREADS is the number of threads which hash (and, with indexed framing,
+ * encrypt) frames to send to shift, each with its own frame buffer.
+ * KSBUFLEN is the number of bytes of keystream per direction to work out
+ * ahead of time in idle moments, or 0 to work it out only as it's needed.
+ * DEDUPLEN is the most frames shift may keep in its dedup cache, at most
+ * 65535.  Insert keeps 36 bytes per frame to know what's in it.  0 turns off
+ * dedup.  FLOWS is the size of the flow table, of which at most three quarters
+ * is used before it's sent to shift, about 96 bytes per flow.  0 turns off
+ * flow export.  MAXSESSIONS is the most shifts which may be connected at once
+ * to a listening insert, at most 8.  Frames are captured and queued once for
+ * all of them, but each has its own frame buffers, keystream, and dedup
+ * cache.  STREAMBUFLEN is the number of bytes from shift each stream may hold
+ * for its remote host, which also limits how fast shift may send them. */
+#ifdef LOWMEM
+#ifndef MAXFRAMELEN
+#define MAXFRAMELEN 1518
+#endif /* #ifndef MAXFRAMELEN */
+#ifndef TXQLEN
+#define TXQLEN (32 * (MAXFRAMELEN + 32))
+#endif /* #ifndef TXQLEN */
+#ifndef THREADSTACK
+#define THREADSTACK (64 * 1024)
+#endif /* #ifndef THREADSTACK */
+#ifndef PCAPBUFLEN
+#define PCAPBUFLEN (128 * 1024)
+#endif /* #ifndef PCAPBUFLEN */
+#ifndef TXTHREADS
+#define TXTHREADS 1
+#endif /* #ifndef TXTHREADS */
+#ifndef KSBUFLEN
+#define KSBUFLEN 0
+#endif /* #ifndef KSBUFLEN */
+#ifndef DEDUPLEN
+#define DEDUPLEN 64
+#endif /* #ifndef DEDUPLEN */
+#ifndef FLOWS
+#define FLOWS 256
+#endif /* #ifndef FLOWS */
+#ifndef MAXSESSIONS
+#define MAXSESSIONS 1
+#endif /* #ifndef MAXSESSIONS */
+#ifndef STREAMBUFLEN
+#define STREAMBUFLEN (8 * 1024)
+#endif /* #ifndef STREAMBUFLEN */
+#else /* #ifdef LOWMEM */
+#ifndef MAXFRAMELEN
+#define MAXFRAMELEN 65535 /* Max size for two bytes */
+#endif /* #ifndef MAXFRAMELEN */
+#ifndef TXQLEN
+#define TXQLEN (1024 * 1024)
+#endif /* #ifndef TXQLEN */
+#ifndef THREADSTACK
+#define THREADSTACK 0
+#endif /* #ifndef THREADSTACK */
+#ifndef PCAPBUFLEN
+#define PCAPBUFLEN 0
+#endif /* #ifndef PCAPBUFLEN */
+#ifndef TXTHREADS
+#define TXTHREADS 4
+#endif /* #ifndef TXTHREADS */
+#ifndef KSBUFLEN
+#define KSBUFLEN (64 * 1024)
+#endif /* #ifndef KSBUFLEN */
+#ifndef DEDUPLEN
+#define DEDUPLEN 1024
+#endif /* #ifndef DEDUPLEN */
+#ifndef FLOWS
+#define FLOWS 4096
+#endif /* #ifndef FLOWS */
+#ifndef MAXSESSIONS
+#define MAXSESSIONS 4
+#endif /* #ifndef MAXSESSIONS */
+#ifndef STREAMBUFLEN
+#define STREAMBUFLEN (128 * 1024)
+#endif /* #ifndef STREAMBUFLEN */
+#endif /* #ifdef LOWMEM */
 /* Send/Receive timeout, in seconds.  If the connection is idle for more than
  * this amount of time, insert will close the connection. */
 #define TXRXTO 180
@@ -93,6 +284,46 @@
 /*******************************************
  * Nothing below here is user-configurable *
  *******************************************/
+/* Number of bytes per frame */
+#define SNAPLEN MAXFRAMELEN
+/* Size of an ethernet header.  Smaller frames aren't sent to shift. */
+#define ETHHDRLEN 14
+/* A record with this size is a truncated frame.  The real size and original
+ * length, TRUNCHDRLEN bytes, come before the frame. */
+#define TRUNCREC 2
+#define TRUNCHDRLEN 4
+/* A record with this size is a batch of flow records, with their size before
+ * them */
+#define FLOWREC 3
+/* A record with this size is a stream record, with its size before it */
+#define STREAMREC 4
+/* A record with this size is a frame from a channel other than 0, with its
+ * size before it.  The channel (1 byte) comes before the frame. */
+#define CHANREC 5
+/* A record with this size is a super-frame of merged TCP segments, with its
+ * size before it.  The segment size and number of segments (2 bytes each) and
+ * each segment's TCP checksum (2 bytes) come before the super-frame. */
+#define GSOREC 6
+#define GSOHDRLEN 4
+/* Most super-frames being built at once, each in a MAXFRAMELEN buffer */
+#define GROFLOWS 4
+/* Most interfaces in PCAPINT */
+#define MAXCHANNELS 8
+/* Size of a frame buffer, with room for an indexed framing header, the sizes,
+ * a channel, and the hash */
+#define FRAMEBUFLEN (12 + 2 + TRUNCHDRLEN + 1 + MAXFRAMELEN + DIGESTLEN)
+/* Size of the arena from which buffers are allocated: the send queue plus,
+ * for each session, a frame buffer for each sending thread and for
+ * receiving, the keystream rings (each block with its number), the dedup
+ * cache's digests and hash table, and the streams' buffers, and the flow table
+ * and its batch of records and super-frame buffers, plus some slop for
+ * alignment */
+#define ARENALEN (TXQLEN + MAXSESSIONS * ((TXTHREADS + 1) * \
+                        (FRAMEBUFLEN + 16) + 2 * (KSBUFLEN / 64) * (64 + 8) + \
+                        (DEDUPLEN + 1) * (DIGESTLEN + 8) + \
+                        STREAMS * STREAMBUFLEN) + \
+                FLOWS * 96 + (0 < FLOWS ? MAXFRAMELEN : 0) + \
+                (0 < GROSEGS ? GROFLOWS * MAXFRAMELEN : 0) + 128)
 /* Macros to stringify a define */
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
@@ -103,9 +334,21 @@
 extern uint8_t installname[INSTALLNAMELEN];
 #define KEYLEN 32 /* Max key length */
 extern uint8_t key[KEYLEN];
-extern int reterr; /* Error "returned" by the first tx/rx thread to error */
-extern pthread_mutex_t retmtx; /* Mutex to lock reterr */
 #define DIGESTLEN SHA224_DIGEST_SIZE /* Length of message digest (hash) */
+/* Options which may be agreed on, per session.  See the file named protocol. */
+#define OPT_INDEXED  0x00000001 /* Indexed framing */
+#define OPT_DEDUP    0x00000002 /* Dedup, with the cache size in the top half */
+#define OPT_TRUNC    0x00000004 /* Truncated frames */
+#define OPT_FLOWS    0x00000008 /* Flow records instead of frames */
+#define OPT_STREAMS  0x00000010 /* Forwarded TCP streams */
+#define OPT_CHANNELS 0x00000020 /* Frames from more than one interface */
+#define OPT_GRO      0x00000040 /* Merged TCP segments */
+#define DEDUPOPTLEN(o) (((o) >> 16) & 0xFFFF)
+/* Options insert supports, not counting the dedup cache size */
+#define OPTIONS (OPT_INDEXED | OPT_DEDUP | OPT_TRUNC | \
+                (0 < FLOWS ? OPT_FLOWS : 0) | \
+                (0 < STREAMS ? OPT_STREAMS : 0) | OPT_CHANNELS | \
+                (0 < GROSEGS ? OPT_GRO : 0))
 
 /*
  * Function prototypes
@@ -115,17 +358,23 @@ extern pthread_mutex_t retmtx; /* Mutex to lock reterr */
 extern char **environ;
 
 /* Set the environment variable specifed by ERRVAR to the absolute value of the
- * argument */
+ * argument.  It and clrerr may be called from any thread. */
 void seterr(int code);
 
+/* Clear the environment variable specified by ERRVAR */
+void clrerr(void);
+
 /* Wait for shift to connect */
 int peer_wait();
 
 /* Connect to shift */
 int peer_call();
 
-/* Safely reterr to r if it's not already set */
-void set_reterr(int r);
+/* Sleep before the nfail'th consecutive retry (starting at 0) */
+void backoff(int nfail);
+
+/* Start a thread with a THREADSTACK-sized stack */
+int start_thread(pthread_t *t, void *(*f)(void *), void *arg);
 
 
 #endif /* #ifdef HAVE_INSERT_H */
@@ -0,0 +1,276 @@
+/*
+ * keystream.c
+ * Keystream precomputed in the background
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* For SCHED_IDLE, on glibc */
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "arena.h"
+#include "crypto.h"
+#include "insert.h"
+#include "keystream.h"
+#include "retvals.h"
+#include "session.h"
+
+/* Number of blocks of keystream to keep ready per direction */
+#define KSBLOCKS (KSBUFLEN / 64)
+
+/* Slot in a ring for its nth block.  The ring's never used if KSBLOCKS is 0,
+ * but the divisor mustn't be 0 for it to compile cleanly. */
+#define KSSLOT(n) ((n) % (0 < KSBLOCKS ? KSBLOCKS : 1))
+
+/* One block of keystream */
+struct ksslot {
+        uint64_t block;      /* Stream block this is */
+        uint32_t ks[16];     /* Keystream, as from chacha20_block */
+};
+
+/* A ring of keystream blocks for one direction.  A filler thread makes
+ * blocks ahead of where the stream is and the thread using the stream takes
+ * them out.  Neither ever waits on the other: if the ring's empty, the block
+ * is made on the spot, and the filler skips past it. */
+struct ksring {
+        chacha20_ctx *ctx;         /* Stream being used, a session's txctx
+                                      or rxctx */
+        struct ksslot *slots;      /* KSBLOCKS slots */
+        atomic_size_t head;        /* Number of slots filled, ever */
+        size_t tail;               /* Number of slots used, ever */
+        atomic_uint_least64_t want; /* Next block the stream needs */
+        sem_t free;                /* Number of empty slots */
+        chacha20_ctx fill;         /* Filler's copy of the stream */
+        pthread_t thread;          /* Filler thread */
+        int running;               /* Nonzero if the filler's running */
+};
+
+static struct ksring rings[MAXSESSIONS][2]; /* Each session's send and
+                                               receive rings */
+
+/* Fill a ring with keystream forever */
+static void *ks_fill(void *r);
+/* Get the next block of keystream for r's stream into its keystream buffer */
+static void ks_next(struct ksring *r);
+/* The next block a stream will make */
+static uint64_t ks_counter(chacha20_ctx *ctx);
+
+/* Make the calling thread run only when nothing else wants to, or failing
+ * that, at the lowest priority it can */
+static void ks_idle(void);
+
+/* Allocate the keystream rings.  Must be called before ks_start. */
+int ks_init(void) {
+        struct ksring *r;
+        int i;
+
+        if (0 == KSBLOCKS) {
+                return 0;
+        }
+        for (i = 0; i < 2 * MAXSESSIONS; ++i) {
+                r = &rings[i / 2][i % 2];
+                if (NULL == (r->slots = arena_alloc(KSBLOCKS *
+                                                sizeof(struct ksslot)))) {
+                        return RET_ENOMEM;
+                }
+        }
+        return 0;
+}
+
+/* Start filling s's keystream rings from its txctx and rxctx in the
+ * background.  Does nothing with indexed framing, which doesn't use the
+ * streams in order, or if KSBUFLEN is 0. */
+void ks_start(struct session *s) {
+        struct ksring *r;
+        int i;
+
+        rings[s->n][0].ctx = &s->txctx;
+        rings[s->n][1].ctx = &s->rxctx;
+        if ((0 == KSBLOCKS) || (s->options & OPT_INDEXED)) {
+                return;
+        }
+        for (i = 0; i < 2; ++i) {
+                r = &rings[s->n][i];
+                atomic_store(&r->head, 0);
+                r->tail = 0;
+                atomic_store(&r->want, ks_counter(r->ctx));
+                r->fill = *r->ctx;
+                r->fill.available = 0;
+                if (0 != sem_init(&r->free, 0, KSBLOCKS)) {
+                        continue;
+                }
+                /* If there's no thread, the stream's used as usual */
+                if (0 != start_thread(&r->thread, ks_fill, r)) {
+                        sem_destroy(&r->free);
+                        continue;
+                }
+                r->running = 1;
+        }
+}
+
+/* Stop filling s's keystream rings.  Must be called before its streams are
+ * set up again. */
+void ks_stop(struct session *s) {
+        struct ksring *r;
+        int i;
+
+        for (i = 0; i < 2; ++i) {
+                r = &rings[s->n][i];
+                if (!r->running) {
+                        continue;
+                }
+                pthread_cancel(r->thread);
+                pthread_join(r->thread, NULL);
+                sem_destroy(&r->free);
+                r->running = 0;
+        }
+}
+
+/* If the background filler for ctx's direction is running, encrypt (or
+ * decrypt) the n bytes at b with ctx, one of s's streams, using keystream
+ * from the ring, and return 0.  Returns -1 if it's not running. */
+int ks_crypt(struct session *s, chacha20_ctx *ctx, uint8_t *b, size_t n) {
+        struct ksring *r;  /* Ring for ctx */
+        uint8_t *k;        /* Unused keystream */
+        size_t amount;     /* Bytes to xor from this block */
+        size_t i;
+
+        r = &rings[s->n][(&s->txctx == ctx) ? 0 : 1];
+        if (!r->running) {
+                return -1;
+        }
+
+        while (0 < n) {
+                /* Get another block if this one's used up */
+                if (0 == ctx->available) {
+                        ks_next(r);
+                }
+                k = (uint8_t *)ctx->keystream + sizeof(ctx->keystream) -
+                        ctx->available;
+                amount = MIN(n, ctx->available);
+                for (i = 0; i < amount; ++i) {
+                        b[i] ^= k[i];
+                }
+                b += amount;
+                n -= amount;
+                ctx->available -= amount;
+        }
+        return 0;
+}
+
+/* Get the next block of keystream for r's stream into its keystream buffer */
+static void ks_next(struct ksring *r) {
+        struct ksslot *s; /* Slot with a block in it */
+        uint64_t block;   /* Block needed */
+        int got;          /* Nonzero if the block was in the ring */
+
+        block = ks_counter(r->ctx);
+        got = 0;
+
+        /* Take blocks off the ring until we find the one we need, skipping
+         * any the filler made after we made them ourselves */
+        while (r->tail < atomic_load_explicit(&r->head,
+                                memory_order_acquire)) {
+                s = &r->slots[KSSLOT(r->tail)];
+                ++r->tail;
+                if (s->block == block) {
+                        memcpy(r->ctx->keystream, s->ks,
+                                        sizeof(r->ctx->keystream));
+                        got = 1;
+                }
+                sem_post(&r->free);
+                if (got) {
+                        break;
+                }
+        }
+
+        /* Make it ourselves if the filler's behind */
+        if (got) {
+                chacha20_counter_set(r->ctx, block + 1);
+        } else {
+                chacha20_block(r->ctx, r->ctx->keystream);
+        }
+        r->ctx->available = sizeof(r->ctx->keystream);
+        atomic_store_explicit(&r->want, block + 1, memory_order_release);
+}
+
+/* Fill a ring with keystream forever */
+static void *ks_fill(void *v) {
+        struct ksring *r; /* Ring to fill */
+        struct ksslot *s; /* Slot to fill */
+        size_t head;      /* Number of slots filled */
+        uint64_t want;    /* Next block the stream needs */
+
+        /* Only use otherwise-idle time */
+        ks_idle();
+
+        r = v;
+        head = 0;
+        for (;;) {
+                /* Wait for room */
+                sem_wait(&r->free);
+
+                /* Don't bother with blocks the stream's already past */
+                want = atomic_load_explicit(&r->want, memory_order_acquire);
+                if (ks_counter(&r->fill) < want) {
+                        chacha20_counter_set(&r->fill, want);
+                }
+
+                /* Make a block */
+                s = &r->slots[KSSLOT(head)];
+                s->block = ks_counter(&r->fill);
+                chacha20_block(&r->fill, s->ks);
+                atomic_store_explicit(&r->head, ++head,
+                                memory_order_release);
+        }
+
+        /* Shouldn't get here */
+        return NULL;
+}
+
+/* The next block a stream will make */
+static uint64_t ks_counter(chacha20_ctx *ctx) {
+        return ((uint64_t)ctx->schedule[13] << 32) | ctx->schedule[12];
+}
+
+/* Make the calling thread run only when nothing else wants to, or failing
+ * that, at the lowest priority it can */
+static void ks_idle(void) {
+        struct sched_param sp;
+        int policy;
+
+#ifdef SCHED_IDLE
+        memset(&sp, 0, sizeof(sp));
+        if (0 == pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp)) {
+                return;
+        }
+#endif /* #ifdef SCHED_IDLE */
+        if (0 != pthread_getschedparam(pthread_self(), &policy, &sp)) {
+                return;
+        }
+        if (-1 == (sp.sched_priority = sched_get_priority_min(policy))) {
+                return;
+        }
+        pthread_setschedparam(pthread_self(), policy, &sp);
+}
@@ -0,0 +1,49 @@
+/*
+ * keystream.h
+ * Keystream precomputed in the background
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_KEYSTREAM_H
+#define HAVE_KEYSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chacha20_simple.h"
+#include "session.h"
+
+/* Allocate the keystream rings.  Must be called before ks_start. */
+int ks_init(void);
+
+/* Start filling s's keystream rings from its txctx and rxctx in the
+ * background.  Does nothing with indexed framing, which doesn't use the
+ * streams in order, or if KSBUFLEN is 0. */
+void ks_start(struct session *s);
+
+/* Stop filling s's keystream rings.  Must be called before its streams are
+ * set up again. */
+void ks_stop(struct session *s);
+
+/* If the background filler for ctx's direction is running, encrypt (or
+ * decrypt) the n bytes at b with ctx, one of s's streams, using keystream
+ * from the ring, and return 0.  Returns -1 if it's not running. */
+int ks_crypt(struct session *s, chacha20_ctx *ctx, uint8_t *b, size_t n);
+
+#endif /* HAVE_KEYSTREAM_H */
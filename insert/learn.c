@@ -0,0 +1,449 @@
+/*
+ * learn.c
+ * Learn which frames shift can use
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "insert.h"
+#include "learn.h"
+
+/* Source addresses shift has used, least recently seen replaced first */
+#if 0 < LEARNMACS
+static struct {
+        uint8_t mac[MACLEN];
+        uint64_t seen;  /* When last seen, in frames learned from, 0 if unused */
+} macs[LEARNMACS];
+#endif /* #if 0 < LEARNMACS */
+static uint64_t nlearned = 0; /* Frames learned from */
+static uint64_t nreports = 0; /* Group joins and leaves snooped */
+
+/* Multicast groups shift has joined, by MAC address */
+#if 0 < MCGROUPS
+static struct {
+        uint8_t mac[MACLEN];
+        int used;       /* Nonzero if this slot is in use */
+} groups[MCGROUPS];
+#endif /* #if 0 < MCGROUPS */
+static pthread_mutex_t learn_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* Groups every host is in, which are never joined explicitly */
+static const uint8_t allhosts4[MACLEN] = {0x01, 0x00, 0x5E, 0x00, 0x00, 0x01};
+static const uint8_t allhosts6[MACLEN] = {0x33, 0x33, 0x00, 0x00, 0x00, 0x01};
+
+/* Groups which are never joined explicitly but which hosts need: IPv6
+ * solicited-node groups and IPv4 link-local groups (224.0.0.x), as filter
+ * expressions */
+#define LINKLOCALFILT " or (ether[0:2] = 0x3333 and ether[2] = 0xff)" \
+        " or (ether[0:4] = 0x01005e00 and ether[4] = 0)"
+
+/* Returns nonzero if mac is one of the groups in LINKLOCALFILT */
+static int link_local(const uint8_t *mac);
+
+/* Note the source address src.  Returns nonzero if it's new. */
+static int learn_mac(const uint8_t *src);
+
+/* Snoop IGMP and MLD in the n-byte frame at b.  Returns nonzero if the
+ * joined groups changed. */
+static int snoop(const uint8_t *b, size_t n);
+
+/* Snoop an IGMP message in the n bytes at m */
+static int snoop_igmp(const uint8_t *m, size_t n);
+
+/* Snoop an MLD message in the n bytes at m */
+static int snoop_mld(const uint8_t *m, size_t n);
+
+/* Join (if join is nonzero) or leave the group with MAC address mac.  Returns
+ * nonzero if that's a change. */
+static int group(const uint8_t *mac, int join);
+
+/* Append " or ether dst mac" to f, which has len bytes of room and holds *off
+ * bytes.  Returns -1 if there's not enough room. */
+static int add_dst(char *f, size_t len, size_t *off, const uint8_t *mac);
+
+/* Get the big-endian uint16_t at b */
+#define GET16(b) ((uint16_t)(((b)[0] << 8) | (b)[1]))
+
+int learn_frame(const uint8_t *b, size_t n) {
+        int changed;
+
+        if (2 * MACLEN > n) {
+                return 0;
+        }
+        changed = 0;
+        pthread_mutex_lock(&learn_mtx);
+        /* Only unicast addresses are learned */
+        if (0 == (b[MACLEN] & 0x01)) {
+                changed |= learn_mac(b + MACLEN);
+        }
+        /* Multicast groups are joined by sending to them */
+        if (b[0] & 0x01) {
+                changed |= snoop(b, n);
+        }
+        pthread_mutex_unlock(&learn_mtx);
+        return changed;
+}
+
+int learn_filter(char *f, size_t len) {
+        size_t off;  /* Length of f so far */
+        int ret;
+#if 0 < MCGROUPS || 0 < LEARNMACS
+        int i;
+#endif /* #if 0 < MCGROUPS || 0 < LEARNMACS */
+
+        ret = 0;
+        off = 0;
+        f[0] = '\0';
+        pthread_mutex_lock(&learn_mtx);
+
+        /* Nothing to go on until shift's sent something */
+        if (0 == LEARNMACS || 0 == nlearned) {
+                if (strlen(PCAPFILT) >= len) {
+                        ret = -1;
+                } else {
+                        strncpy(f, PCAPFILT, len);
+                }
+                goto out;
+        }
+
+        /* Narrow the configured filter, if there is one */
+        if ('\0' != PCAPFILT[0]) {
+                off = snprintf(f, len, "(%s) and (", PCAPFILT);
+        } else {
+                off = snprintf(f, len, "(");
+        }
+        if (off >= len) {
+                ret = -1;
+                goto out;
+        }
+
+        /* Broadcast, and the multicast groups shift's in */
+        off += snprintf(f + off, len - off, "ether broadcast%s",
+                        LINKLOCALFILT);
+        if ((off >= len) ||
+                        (-1 == add_dst(f, len, &off, allhosts4)) ||
+                        (-1 == add_dst(f, len, &off, allhosts6))) {
+                ret = -1;
+                goto out;
+        }
+#if 0 < MCGROUPS
+        /* Until shift's said which groups it's in, all of them */
+        if (0 == nreports) {
+                off += snprintf(f + off, len - off, " or ether multicast");
+                if (off >= len) {
+                        ret = -1;
+                        goto out;
+                }
+        }
+        for (i = 0; i < MCGROUPS; ++i) {
+                if (groups[i].used &&
+                                (-1 == add_dst(f, len, &off, groups[i].mac))) {
+                        ret = -1;
+                        goto out;
+                }
+        }
+#else /* #if 0 < MCGROUPS */
+        /* Without snooping, all of it */
+        off += snprintf(f + off, len - off, " or ether multicast");
+        if (off >= len) {
+                ret = -1;
+                goto out;
+        }
+#endif /* #if 0 < MCGROUPS */
+
+        /* And whatever's sent to shift's addresses */
+#if 0 < LEARNMACS
+        for (i = 0; i < LEARNMACS; ++i) {
+                if ((0 != macs[i].seen) &&
+                                (-1 == add_dst(f, len, &off, macs[i].mac))) {
+                        ret = -1;
+                        goto out;
+                }
+        }
+#endif /* #if 0 < LEARNMACS */
+        if (off + 1 >= len) {
+                ret = -1;
+                goto out;
+        }
+        f[off++] = ')';
+        f[off] = '\0';
+
+out:
+        pthread_mutex_unlock(&learn_mtx);
+        return ret;
+}
+
+int learn_joined(const uint8_t *mac) {
+        int ret;
+#if 0 < MCGROUPS
+        int i;
+#endif /* #if 0 < MCGROUPS */
+
+        if ((0 == memcmp(mac, allhosts4, MACLEN)) ||
+                        (0 == memcmp(mac, allhosts6, MACLEN)) ||
+                        link_local(mac)) {
+                return 1;
+        }
+        pthread_mutex_lock(&learn_mtx);
+        /* Until shift's said which groups it's in, it's in all of them */
+        ret = (0 == nreports);
+#if 0 < MCGROUPS
+        for (i = 0; !ret && i < MCGROUPS; ++i) {
+                if (groups[i].used && 0 == memcmp(mac, groups[i].mac, MACLEN)) {
+                        ret = 1;
+                        break;
+                }
+        }
+#endif /* #if 0 < MCGROUPS */
+        pthread_mutex_unlock(&learn_mtx);
+        return ret;
+}
+
+static int learn_mac(const uint8_t *src) {
+#if 0 < LEARNMACS
+        int i;
+        int old; /* Least recently seen */
+
+        ++nlearned;
+        old = 0;
+        for (i = 0; i < LEARNMACS; ++i) {
+                /* Already know it */
+                if ((0 != macs[i].seen) &&
+                                (0 == memcmp(src, macs[i].mac, MACLEN))) {
+                        macs[i].seen = nlearned;
+                        return 0;
+                }
+                if (macs[i].seen < macs[old].seen) {
+                        old = i;
+                }
+        }
+        memcpy(macs[old].mac, src, MACLEN);
+        macs[old].seen = nlearned;
+        return 1;
+#else /* #if 0 < LEARNMACS */
+        return 0;
+#endif /* #if 0 < LEARNMACS */
+}
+
+static int snoop(const uint8_t *b, size_t n) {
+        size_t off;   /* Offset of the IP header */
+        uint16_t et;  /* EtherType */
+        size_t hl;    /* IP header length */
+        uint8_t nh;   /* IPv6 next header */
+
+        /* Skip a VLAN tag */
+        off = 2 * MACLEN;
+        if (off + 2 > n) {
+                return 0;
+        }
+        et = GET16(b + off);
+        off += 2;
+        if (0x8100 == et) {
+                if (off + 4 > n) {
+                        return 0;
+                }
+                et = GET16(b + off + 2);
+                off += 4;
+        }
+
+        switch (et) {
+        case 0x0800: /* IPv4 */
+                if (off + 20 > n || 4 != (b[off] >> 4)) {
+                        return 0;
+                }
+                hl = (b[off] & 0x0F) * 4;
+                if (2 != b[off + 9] || 20 > hl || off + hl > n) {
+                        return 0;
+                }
+                return snoop_igmp(b + off + hl, n - off - hl);
+        case 0x86DD: /* IPv6 */
+                if (off + 40 > n || 6 != (b[off] >> 4)) {
+                        return 0;
+                }
+                /* MLD comes after a hop-by-hop header, for router alert */
+                nh = b[off + 6];
+                off += 40;
+                if (0 == nh) {
+                        if (off + 8 > n) {
+                                return 0;
+                        }
+                        nh = b[off];
+                        hl = (b[off + 1] + 1) * 8;
+                        if (off + hl > n) {
+                                return 0;
+                        }
+                        off += hl;
+                }
+                if (58 != nh) {
+                        return 0;
+                }
+                return snoop_mld(b + off, n - off);
+        }
+        return 0;
+}
+
+static int snoop_igmp(const uint8_t *m, size_t n) {
+        uint8_t mac[MACLEN];
+        size_t nrec;  /* Number of group records */
+        size_t nsrc;  /* Number of sources in a record */
+        size_t off;
+        int changed;
+
+        if (8 > n) {
+                return 0;
+        }
+        mac[0] = 0x01;
+        mac[1] = 0x00;
+        mac[2] = 0x5E;
+        switch (m[0]) {
+        case 0x12: /* v1 report */
+        case 0x16: /* v2 report */
+        case 0x17: /* v2 leave */
+                mac[3] = m[5] & 0x7F;
+                mac[4] = m[6];
+                mac[5] = m[7];
+                return group(mac, 0x17 != m[0]);
+        case 0x22: /* v3 report */
+                changed = 0;
+                nrec = GET16(m + 6);
+                off = 8;
+                for (; 0 < nrec && off + 8 <= n; --nrec) {
+                        nsrc = GET16(m + off + 2);
+                        mac[3] = m[off + 5] & 0x7F;
+                        mac[4] = m[off + 6];
+                        mac[5] = m[off + 7];
+                        /* Including no sources is leaving */
+                        switch (m[off]) {
+                        case 1: /* Mode is include */
+                        case 3: /* Change to include */
+                                changed |= group(mac, 0 != nsrc);
+                                break;
+                        case 2: /* Mode is exclude */
+                        case 4: /* Change to exclude */
+                        case 5: /* Allow new sources */
+                                changed |= group(mac, 1);
+                                break;
+                        }
+                        off += 8 + 4 * nsrc + 4 * m[off + 1];
+                }
+                return changed;
+        }
+        return 0;
+}
+
+static int snoop_mld(const uint8_t *m, size_t n) {
+        uint8_t mac[MACLEN];
+        size_t nrec;  /* Number of group records */
+        size_t nsrc;  /* Number of sources in a record */
+        size_t off;
+        int changed;
+
+        if (8 > n) {
+                return 0;
+        }
+        mac[0] = 0x33;
+        mac[1] = 0x33;
+        switch (m[0]) {
+        case 131: /* v1 report */
+        case 132: /* v1 done */
+                if (24 > n) {
+                        return 0;
+                }
+                memcpy(mac + 2, m + 20, 4);
+                return group(mac, 132 != m[0]);
+        case 143: /* v2 report */
+                changed = 0;
+                nrec = GET16(m + 6);
+                off = 8;
+                for (; 0 < nrec && off + 20 <= n; --nrec) {
+                        nsrc = GET16(m + off + 2);
+                        memcpy(mac + 2, m + off + 16, 4);
+                        switch (m[off]) {
+                        case 1: /* Mode is include */
+                        case 3: /* Change to include */
+                                changed |= group(mac, 0 != nsrc);
+                                break;
+                        case 2: /* Mode is exclude */
+                        case 4: /* Change to exclude */
+                        case 5: /* Allow new sources */
+                                changed |= group(mac, 1);
+                                break;
+                        }
+                        off += 20 + 16 * nsrc + 4 * m[off + 1];
+                }
+                return changed;
+        }
+        return 0;
+}
+
+static int group(const uint8_t *mac, int join) {
+#if 0 < MCGROUPS
+        int i;
+        int free;    /* Unused slot */
+        int first;   /* Nonzero if this is the first report, which stops
+                        every group being passed */
+
+        first = (0 == nreports++);
+        free = -1;
+        for (i = 0; i < MCGROUPS; ++i) {
+                if (!groups[i].used) {
+                        if (-1 == free) {
+                                free = i;
+                        }
+                        continue;
+                }
+                if (0 == memcmp(mac, groups[i].mac, MACLEN)) {
+                        if (join) {
+                                return first;
+                        }
+                        groups[i].used = 0;
+                        return 1;
+                }
+        }
+        /* Not in it, or no room to remember it */
+        if (!join || -1 == free) {
+                return first;
+        }
+        memcpy(groups[free].mac, mac, MACLEN);
+        groups[free].used = 1;
+        return 1;
+#else /* #if 0 < MCGROUPS */
+        return 0;
+#endif /* #if 0 < MCGROUPS */
+}
+
+static int link_local(const uint8_t *mac) {
+        return ((0x33 == mac[0]) && (0x33 == mac[1]) && (0xFF == mac[2])) ||
+                ((0x01 == mac[0]) && (0x00 == mac[1]) && (0x5E == mac[2]) &&
+                 (0x00 == mac[3]) && (0x00 == mac[4]));
+}
+
+static int add_dst(char *f, size_t len, size_t *off, const uint8_t *mac) {
+        *off += snprintf(f + *off, len - *off,
+                        " or ether dst %02x:%02x:%02x:%02x:%02x:%02x",
+                        mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+        if (*off >= len) {
+                return -1;
+        }
+        return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * learn.h
+ * Learn which frames shift can use
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_LEARN_H
+#define HAVE_LEARN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "insert.h"
+
+/* Length of a MAC address */
+#define MACLEN 6
+
+/* Space needed for a filter made by learn_filter */
+#define LEARNFILTLEN (sizeof(PCAPFILT) + 192 + \
+                (LEARNMACS + MCGROUPS + 2) * 32)
+
+/* Note the source address of the n-byte frame at b, which shift sent, and any
+ * multicast groups it joins or leaves.  Returns nonzero if the filter made by
+ * learn_filter would change. */
+int learn_frame(const uint8_t *b, size_t n);
+
+/* Put a capture filter in the len bytes at f which matches only the frames in
+ * PCAPFILT that shift can use.  Until something's been learned, that's just
+ * PCAPFILT.  Returns 0, or -1 if len is too small. */
+int learn_filter(char *f, size_t len);
+
+/* Returns nonzero if shift has joined the multicast group with the MAC
+ * address at mac.  Until shift's joined or left any group, it's taken to be
+ * in all of them, and it's always in the IPv6 solicited-node and IPv4
+ * link-local (224.0.0.x) groups. */
+int learn_joined(const uint8_t *mac);
+
+#endif /* HAVE_LEARN_H */
@@ -3,7 +3,7 @@
  * Functions dealing with the network
  * by J. Stuart McMurray
  * created 20150118
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -32,9 +32,13 @@
 #include "net.h"
 #include "retvals.h"
 
+/* Listening socket, kept open between connections so shift can reconnect
+ * without waiting on us to listen again */
+static int lfd = -1;
+
 /* Wait for shift to connect */
 int peer_wait(void) {
-        int lfd, cfd;                  /* Listen and child file descriptors. */
+        int cfd;                       /* Child file descriptor */
         struct sockaddr_storage caddr; /* Insert's address */
         socklen_t caddr_size;
         int yes;
@@ -42,6 +46,11 @@ int peer_wait(void) {
         struct addrinfo hints;
         struct addrinfo *servinfo;
         struct addrinfo *cur;
+        /* If we're already listening, just wait for the next connection */
+        if (-1 != lfd) {
+                goto ACCEPT;
+        }
+
         memset((void*)&hints, 0, sizeof(hints));
         /* Set flags in hints to only give addresses on interfaces */
         hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICHOST | AI_NUMERICSERV |
@@ -79,11 +88,12 @@ int peer_wait(void) {
                         continue;
                 }
                 /* Try to listen */
-                if (-1 == listen(lfd, 0)) { /* Only one client allowed */
+                if (-1 == listen(lfd, MAXSESSIONS)) { /* A few shifts */
                         close(lfd);
                         lfd = -1;
                         continue;
                 }
+                break;
         }
         /* Free the memory allocated by getaddrinfo */
         freeaddrinfo(servinfo);
@@ -94,13 +104,13 @@ int peer_wait(void) {
         }
         
         /* Wait for a client */
+ACCEPT:
         caddr_size = (socklen_t)sizeof(caddr);
         if (-1 == (cfd = accept(lfd, (struct sockaddr*)&caddr, &caddr_size))) {
                 return RET_ERR_ACC;
         }
         
-        /* Stop listening and return the connected file descriptor */
-        close(lfd);
+        /* Return the connected file descriptor, but keep listening */
         return cfd;
 }
 
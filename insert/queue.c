@@ -0,0 +1,708 @@
+/*
+ * queue.c
+ * Bounded queues of captured frames waiting to be sent to shift
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "ack.h"
+#include "arena.h"
+#include "fq.h"
+#include "insert.h"
+#include "queue.h"
+#include "retvals.h"
+
+/* Frames are stored once, in a ring of bytes in the order they're queued,
+ * each after a header, and go on the queues of every session they're for.
+ * They're taken out of order, so the space for a frame is only reused once
+ * every session's taken it and every frame queued before it is gone, too. */
+struct txent {
+        uint64_t qseq;  /* Order in which it was queued */
+        uint64_t t;     /* When it was queued, in ms */
+        uint32_t next[MAXSESSIONS]; /* Offset of the next in each session's
+                                       queue, or ENT_END */
+        uint16_t n;     /* Size of the frame */
+        uint16_t orig;  /* Original length */
+        uint8_t refs;   /* Sessions which haven't taken it yet */
+};
+#define ENT_END 0xFFFFFFFF /* Last in its queue */
+
+/* Session mask for frames for every session */
+#define TXQ_ALL (~0U)
+
+static uint8_t *txq;        /* Ring buffer */
+static size_t txq_head;     /* Offset of the first used byte */
+static size_t txq_used;     /* Number of bytes in use */
+static pthread_mutex_t txq_mtx;
+uint64_t txq_drops = 0;     /* Frames dropped for lack of space */
+static uint64_t txq_puts;   /* Number of frames ever queued */
+uint64_t txq_count;         /* Number of frames queued */
+uint64_t txq_thinned = 0;   /* ACKs replaced by newer ones */
+uint64_t txq_codel = 0;     /* Frames dropped for waiting too long */
+uint64_t txq_prio = 0;      /* Frames sent ahead of the rest */
+uint64_t txq_sojourn = 0;   /* How long the last frame waited, in ms */
+uint64_t txq_sojourn_max = 0;
+
+/* Each flow's queue of frames, with its deficit round robin and CoDel
+ * state.  The last one is for frames which skip the line. */
+#define NFQ (0 < FQFLOWS ? FQFLOWS : 1)
+#define PRIOQ NFQ
+struct fq {
+        uint32_t head;          /* Offset of the first frame, or ENT_END */
+        uint32_t tail;          /* Offset of the last frame */
+        size_t bytes;           /* Bytes of frames queued */
+        int32_t deficit;        /* Bytes it may send this round */
+        int listed;             /* Nonzero if it's on newq or oldq */
+        int link;               /* Next queue on the same list, or -1 */
+        uint64_t first_above;   /* When it'll have been over target long
+                                   enough to drop, or 0 */
+        uint64_t drop_next;     /* When to drop next */
+        uint32_t count;         /* Drops since dropping started */
+        uint32_t lastcount;     /* Drops the last time */
+        int dropping;           /* Nonzero while dropping */
+};
+
+/* A list of queues with frames in them */
+struct fqlist {
+        int head;
+        int tail;
+};
+
+/* Each session's queues.  New queues (i.e. sparse flows) get their turn
+ * before old ones. */
+static struct txslot {
+        int n;                  /* Which slot this is */
+        struct fq fqs[NFQ + 1];
+        struct fqlist newq;
+        struct fqlist oldq;
+        uint64_t seq;           /* Sequence number of the next frame */
+        uint64_t count;         /* Number of frames queued */
+        pthread_cond_t cond;    /* Signalled when a frame's queued */
+} slots[MAXSESSIONS];
+static unsigned int attached;   /* Slots with a session */
+
+#if 0 < ACKTHIN
+/* The last pure ACK queued for each of a few TCP flows, by a hash of the
+ * flow.  One's still queued in every session until its n is set to 0 when
+ * it's first taken. */
+static struct {
+        uint8_t key[ACKKEYLEN];
+        uint64_t seq;   /* Order in which it was queued */
+        size_t off;     /* Offset of the frame in the ring */
+        uint16_t n;     /* Size of the frame, 0 if unused */
+        uint32_t ack;   /* Acknowledgement number */
+        unsigned int mask; /* Sessions it was queued for */
+} acks[ACKTHIN];
+
+/* Replace a queued ACK for the same flow as the n-byte frame at b with it, if
+ * it's a newer pure ACK of the same size queued for the same sessions, mask.
+ * Returns nonzero if it was.  Either way, the ACK's flow is put in key and
+ * its number in ack, and the slot in acks is returned in slot, or -1 if it's
+ * not a pure ACK.  txq_mtx must be held. */
+static int ack_replace(const uint8_t *b, uint16_t n, unsigned int mask,
+                uint8_t *key, uint32_t *ack, int *slot);
+#endif /* #if 0 < ACKTHIN */
+
+/* Choose the next frame to send to s's session, put its header in h and its
+ * offset in off, and take it off its queue.  Returns 0 if there's nothing
+ * left to send, which may happen if the rest is dropped.  txq_mtx must be
+ * held. */
+static int fq_next(struct txslot *s, struct txent *h, size_t *off);
+
+/* Take the next frame to send from q, one of s's queues, dropping frames
+ * which have been waiting too long, and put its header in h and its offset
+ * in off.  Returns 0 if the queue's empty. */
+static int codel_pop(struct txslot *s, struct fq *q, uint64_t now,
+                struct txent *h, size_t *off);
+
+/* Take the frame at the head of q, one of s's queues, and set ok to nonzero
+ * if it's been over CODELTARGET for long enough to be dropped.  Returns 0 if
+ * q's empty. */
+static int codel_dequeue(struct txslot *s, struct fq *q, uint64_t now,
+                struct txent *h, size_t *off, int *ok);
+
+/* When to drop next, count drops after t */
+static uint64_t codel_next(uint64_t t, uint32_t count);
+
+/* Take the frame at the head of q, one of s's queues, putting its header in h
+ * and its offset in off */
+static void fq_pop(struct txslot *s, struct fq *q, struct txent *h,
+                size_t *off);
+
+/* Note that a session's taken the frame at off, with header h, and free up
+ * whatever space can be */
+static void txq_take(const struct txent *h, size_t off);
+
+/* Add s's queue i to the end of l */
+static void list_push(struct txslot *s, struct fqlist *l, int i);
+/* Remove the first queue from l, one of s's lists */
+static void list_pop(struct txslot *s, struct fqlist *l);
+/* Empty s's queues and lists.  Frames on them must've been taken. */
+static void slot_reset(struct txslot *s);
+
+/* Copy n bytes from b into the ring starting at off */
+static void ring_write(size_t off, const uint8_t *b, size_t n);
+/* Copy n bytes from the ring starting at off into b */
+static void ring_read(size_t off, uint8_t *b, size_t n);
+/* Unlock txq_mtx, for use as a cleanup handler */
+static void txq_unlock(void *unused);
+/* Milliseconds since some point */
+static uint64_t now_ms(void);
+/* Queue the n bytes at b, after the pn bytes at pre, as txq_put does, for
+ * the sessions in mask, or TXQ_ALL for every session.  The queue's worked out
+ * from the frame at b. */
+static int txq_putv(unsigned int mask, const uint8_t *pre, uint16_t pn,
+                const uint8_t *b, uint16_t n, uint16_t orig);
+
+/* Allocate the queue.  Must be called before any other txq_ function. */
+int txq_init(void) {
+        int i;
+
+        if (NULL == (txq = arena_alloc(TXQLEN))) {
+                return RET_ENOMEM;
+        }
+        txq_head = 0;
+        txq_used = 0;
+        txq_count = 0;
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                slots[i].n = i;
+                slot_reset(&slots[i]);
+                pthread_cond_init(&slots[i].cond, NULL);
+        }
+        pthread_mutex_init(&txq_mtx, NULL);
+        return 0;
+}
+
+/* Start queueing frames for the session in slot */
+void txq_attach(int slot) {
+        pthread_mutex_lock(&txq_mtx);
+        attached |= 1U << slot;
+        pthread_mutex_unlock(&txq_mtx);
+}
+
+/* Stop queueing frames for the session in slot.  If it's the last session
+ * and it's in slot 0, its frames are held for the next session, which will
+ * also be in slot 0, otherwise they're dropped. */
+void txq_detach(int slot) {
+        struct txslot *s;
+        struct txent h;
+        size_t off;
+        int i;
+
+        pthread_mutex_lock(&txq_mtx);
+        attached &= ~(1U << slot);
+        if ((0 != slot) || (0 != attached)) {
+                s = &slots[slot];
+                for (i = 0; i <= NFQ; ++i) {
+                        while (ENT_END != s->fqs[i].head) {
+                                fq_pop(s, &s->fqs[i], &h, &off);
+                                txq_take(&h, off);
+                        }
+                }
+                slot_reset(s);
+        }
+        pthread_mutex_unlock(&txq_mtx);
+}
+
+/* Queue the n bytes at b, which were orig bytes long before being truncated
+ * (or just n), for every session.  Records which aren't frames have their
+ * record size, less than ETHHDRLEN, as orig.  If there's not enough room, the
+ * frame is dropped and RET_ERR_QFULL is returned. */
+int txq_put(const uint8_t *b, uint16_t n, uint16_t orig) {
+        return txq_putv(TXQ_ALL, NULL, 0, b, n, orig);
+}
+
+/* Queue the n bytes at b, as txq_put does, but only for the session in slot.
+ * If there's no session in slot any more, it's quietly thrown away. */
+int txq_put_one(int slot, const uint8_t *b, uint16_t n, uint16_t orig) {
+        return txq_putv(1U << slot, NULL, 0, b, n, orig);
+}
+
+/* Queue the n-byte frame at b, captured on channel chan, as a channel
+ * record.  n must be no more than MAXFRAMELEN.  If the frame and channel are
+ * too big for the record's size, which can only happen if MAXFRAMELEN is
+ * 65535, the frame is dropped, counted in txq_drops, and RET_ERR_CSZL is
+ * returned.  If there's not enough room, the frame is dropped and
+ * RET_ERR_QFULL is returned. */
+int txq_put_chan(uint8_t chan, const uint8_t *b, uint16_t n) {
+        if (0xFFFF == n) {
+                pthread_mutex_lock(&txq_mtx);
+                ++txq_drops;
+                pthread_mutex_unlock(&txq_mtx);
+                return RET_ERR_CSZL;
+        }
+        return txq_putv(TXQ_ALL, &chan, sizeof(chan), b, n, CHANREC);
+}
+
+/* Queue the n-byte super-frame at b, after its hn-byte GSO header at hdr, as
+ * a GSO record.  hn + n must be no more than MAXFRAMELEN.  If there's not
+ * enough room, the super-frame is dropped and RET_ERR_QFULL is returned. */
+int txq_put_gso(const uint8_t *hdr, uint16_t hn, const uint8_t *b,
+                uint16_t n) {
+        return txq_putv(TXQ_ALL, hdr, hn, b, n, GSOREC);
+}
+
+static int txq_putv(unsigned int mask, const uint8_t *pre, uint16_t pn,
+                const uint8_t *b, uint16_t n, uint16_t orig) {
+        size_t tail;    /* Offset of the first free byte */
+        struct txent h; /* Header for the frame */
+        struct txslot *s; /* Session it goes to */
+        struct fq *q;   /* Queue it goes in */
+        int qi;         /* Which queue, in each session */
+        uint32_t hash;  /* Hash of its flow */
+        uint32_t at;    /* Offset of the frame, for the previous one */
+        int i;
+#if 0 < ACKTHIN
+        uint8_t key[ACKKEYLEN];
+        uint32_t ack;
+        int slot;
+#endif /* #if 0 < ACKTHIN */
+
+        /* Work out where it goes before taking the lock */
+        if (fq_class(b, n, (0 != pn) ? n : orig, &hash)) {
+                qi = PRIOQ;
+        } else {
+                qi = hash % NFQ;
+        }
+
+        pthread_mutex_lock(&txq_mtx);
+
+        /* Frames for everyone are held in slot 0 while there's no one.
+         * Frames for one session are no use once it's gone. */
+        if (TXQ_ALL == mask) {
+                mask = (0 != attached) ? attached : 1;
+        } else if (0 == (mask &= attached)) {
+                pthread_mutex_unlock(&txq_mtx);
+                return 0;
+        }
+
+#if 0 < ACKTHIN
+        /* A newer ACK makes an older one still in the queue redundant */
+        slot = -1;
+        if ((n == orig) && ack_replace(b, n, mask, key, &ack, &slot)) {
+                pthread_mutex_unlock(&txq_mtx);
+                return 0;
+        }
+#endif /* #if 0 < ACKTHIN */
+
+        /* Drop the frame if it won't fit */
+        if (TXQLEN - txq_used < sizeof(h) + pn + n) {
+                ++txq_drops;
+                pthread_mutex_unlock(&txq_mtx);
+                return RET_ERR_QFULL;
+        }
+
+        /* Header, then frame, stored once */
+        tail = (txq_head + txq_used) % TXQLEN;
+        memset(&h, 0, sizeof(h));
+        h.qseq = txq_puts;
+        h.t = now_ms();
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                h.next[i] = ENT_END;
+                if (mask & (1U << i)) {
+                        ++h.refs;
+                }
+        }
+        h.n = pn + n;
+        h.orig = orig;
+        ring_write(tail, (uint8_t *)&h, sizeof(h));
+        if (0 != pn) {
+                ring_write((tail + sizeof(h)) % TXQLEN, pre, pn);
+        }
+        ring_write((tail + sizeof(h) + pn) % TXQLEN, b, n);
+        txq_used += sizeof(h) + pn + n;
+
+        /* Put it on the end of its queue in each session, and give the queue
+         * a turn if it hasn't got one coming */
+        at = tail;
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                if (!(mask & (1U << i))) {
+                        continue;
+                }
+                s = &slots[i];
+                q = &s->fqs[qi];
+                if (ENT_END == q->head) {
+                        q->head = tail;
+                } else {
+                        ring_write((q->tail + offsetof(struct txent, next) +
+                                                i * sizeof(at)) % TXQLEN,
+                                        (uint8_t *)&at, sizeof(at));
+                }
+                q->tail = tail;
+                q->bytes += pn + n;
+                if ((PRIOQ != qi) && !q->listed) {
+                        list_push(s, &s->newq, qi);
+                        q->deficit = FQQUANTUM;
+                        q->listed = 1;
+                }
+                ++s->count;
+
+                /* Wake up the sender */
+                pthread_cond_signal(&s->cond);
+        }
+#if 0 < ACKTHIN
+        if (-1 != slot) {
+                memcpy(acks[slot].key, key, ACKKEYLEN);
+                acks[slot].seq = txq_puts;
+                acks[slot].off = (tail + sizeof(h)) % TXQLEN;
+                acks[slot].n = n;
+                acks[slot].ack = ack;
+                acks[slot].mask = mask;
+        }
+#endif /* #if 0 < ACKTHIN */
+        ++txq_puts;
+        ++txq_count;
+
+        pthread_mutex_unlock(&txq_mtx);
+        return 0;
+}
+
+/* Block until a frame is queued for the session in slot, then copy it to b,
+ * which must have room for MAXFRAMELEN + 1 bytes (a frame and its channel),
+ * and put its original length in orig, its sequence number in seq, and the
+ * order in which it was queued in qseq.  Frames are numbered in the order
+ * the session takes them off the queue, which isn't the order they were put
+ * on.  Returns the size of the frame.  This is a cancellation point. */
+uint16_t txq_get(int slot, uint8_t *b, uint16_t *orig, uint64_t *seq,
+                uint64_t *qseq) {
+        struct txslot *s; /* Session's queues */
+        struct txent h;   /* Frame's header */
+        size_t off;       /* Frame's offset */
+
+        s = &slots[slot];
+        pthread_mutex_lock(&txq_mtx);
+        pthread_cleanup_push(txq_unlock, NULL);
+
+        /* Wait for a frame which isn't dropped */
+        do {
+                while (0 == s->count) {
+                        pthread_cond_wait(&s->cond, &txq_mtx);
+                }
+        } while (!fq_next(s, &h, &off));
+
+        /* Copy it out */
+        ring_read((off + sizeof(h)) % TXQLEN, b, h.n);
+        txq_take(&h, off);
+        *orig = h.orig;
+        *seq = s->seq++;
+        *qseq = h.qseq;
+        txq_sojourn = now_ms() - h.t;
+        if (txq_sojourn > txq_sojourn_max) {
+                txq_sojourn_max = txq_sojourn;
+        }
+
+        pthread_cleanup_pop(1);
+        return h.n;
+}
+
+/* The sequence number the next frame the session in slot takes off the queue
+ * will have */
+uint64_t txq_next(int slot) {
+        uint64_t seq;
+
+        pthread_mutex_lock(&txq_mtx);
+        seq = slots[slot].seq;
+        pthread_mutex_unlock(&txq_mtx);
+        return seq;
+}
+
+/* The queue order the next frame put on the queue will have */
+uint64_t txq_end(void) {
+        uint64_t seq;
+
+        pthread_mutex_lock(&txq_mtx);
+        seq = txq_puts;
+        pthread_mutex_unlock(&txq_mtx);
+        return seq;
+}
+
+static int fq_next(struct txslot *s, struct txent *h, size_t *off) {
+        struct fqlist *l;       /* List the queue's on */
+        struct fq *q;           /* Queue to send from */
+        int i;
+        uint64_t now;
+
+        /* Some frames skip the line */
+        if (ENT_END != s->fqs[PRIOQ].head) {
+                fq_pop(s, &s->fqs[PRIOQ], h, off);
+                ++txq_prio;
+                return 1;
+        }
+
+        /* The rest take turns, new queues first */
+        now = now_ms();
+        for (;;) {
+                l = (-1 != s->newq.head) ? &s->newq : &s->oldq;
+                if (-1 == (i = l->head)) {
+                        return 0;
+                }
+                q = &s->fqs[i];
+
+                /* A queue which has had its turn goes to the back */
+                if (0 >= q->deficit) {
+                        q->deficit += FQQUANTUM;
+                        list_pop(s, l);
+                        list_push(s, &s->oldq, i);
+                        continue;
+                }
+
+                /* An empty new queue goes to the back of the old ones, so a
+                 * flow can't stay new by sending a bit at a time */
+                if (!codel_pop(s, q, now, h, off)) {
+                        list_pop(s, l);
+                        if ((&s->newq == l) && (-1 != s->oldq.head)) {
+                                list_push(s, &s->oldq, i);
+                        } else {
+                                q->listed = 0;
+                        }
+                        continue;
+                }
+                q->deficit -= h->n;
+                return 1;
+        }
+}
+
+static int codel_pop(struct txslot *s, struct fq *q, uint64_t now,
+                struct txent *h, size_t *off) {
+        int ok;         /* Nonzero if h may be dropped */
+        int got;        /* Nonzero if there's a frame after a drop */
+        uint32_t delta; /* Drops since last time */
+
+        if (!codel_dequeue(s, q, now, h, off, &ok)) {
+                q->dropping = 0;
+                return 0;
+        }
+
+        /* Still dropping, until the queue's short again */
+        if (q->dropping) {
+                if (!ok) {
+                        q->dropping = 0;
+                }
+                while (q->dropping && now >= q->drop_next) {
+                        txq_take(h, *off);
+                        ++txq_codel;
+                        ++q->count;
+                        if (!codel_dequeue(s, q, now, h, off, &ok)) {
+                                q->dropping = 0;
+                                return 0;
+                        }
+                        if (!ok) {
+                                q->dropping = 0;
+                        } else {
+                                q->drop_next = codel_next(q->drop_next,
+                                                q->count);
+                        }
+                }
+                return 1;
+        }
+
+        /* Start dropping, picking up about where we left off if it wasn't
+         * long ago */
+        if (ok) {
+                txq_take(h, *off);
+                ++txq_codel;
+                got = codel_dequeue(s, q, now, h, off, &ok);
+                q->dropping = 1;
+                delta = q->count - q->lastcount;
+                if ((1 < delta) && ((int64_t)(now - q->drop_next) <
+                                        16 * CODELINTERVAL)) {
+                        q->count = delta;
+                } else {
+                        q->count = 1;
+                }
+                q->drop_next = codel_next(now, q->count);
+                q->lastcount = q->count;
+                return got;
+        }
+        return 1;
+}
+
+static int codel_dequeue(struct txslot *s, struct fq *q, uint64_t now,
+                struct txent *h, size_t *off, int *ok) {
+        *ok = 0;
+        if (ENT_END == q->head) {
+                q->first_above = 0;
+                return 0;
+        }
+        fq_pop(s, q, h, off);
+
+        /* Flow and stream records aren't dropped, and don't count.  Channel
+         * records and super-frames are frames like any other. */
+        if ((FLOWREC == h->orig) || (STREAMREC == h->orig)) {
+                return 1;
+        }
+        if ((0 == CODELTARGET) || (now - h->t < CODELTARGET) ||
+                        (FQQUANTUM >= q->bytes)) {
+                q->first_above = 0;
+        } else if (0 == q->first_above) {
+                q->first_above = now + CODELINTERVAL;
+        } else if (now >= q->first_above) {
+                *ok = 1;
+        }
+        return 1;
+}
+
+static uint64_t codel_next(uint64_t t, uint32_t count) {
+        uint64_t r; /* Square root of count */
+
+        for (r = 1; (r + 1) * (r + 1) <= count; ++r) {
+        }
+        return t + CODELINTERVAL / r;
+}
+
+static void fq_pop(struct txslot *s, struct fq *q, struct txent *h,
+                size_t *off) {
+        *off = q->head;
+        ring_read(*off, (uint8_t *)h, sizeof(*h));
+        q->head = h->next[s->n];
+        if (ENT_END == q->head) {
+                q->tail = ENT_END;
+        }
+        q->bytes -= h->n;
+        --s->count;
+}
+
+static void txq_take(const struct txent *h, size_t off) {
+        struct txent first; /* First frame in the ring */
+        uint8_t refs;       /* Sessions still to take it */
+        size_t roff;        /* Offset of refs */
+#if 0 < ACKTHIN
+        int i;
+
+        /* It's no longer an ACK which can be replaced */
+        for (i = 0; i < ACKTHIN; ++i) {
+                if ((0 != acks[i].n) && (h->qseq == acks[i].seq)) {
+                        acks[i].n = 0;
+                }
+        }
+#endif /* #if 0 < ACKTHIN */
+
+        /* Other sessions may have taken it since h was read */
+        roff = (off + offsetof(struct txent, refs)) % TXQLEN;
+        ring_read(roff, &refs, sizeof(refs));
+        --refs;
+        ring_write(roff, &refs, sizeof(refs));
+        if (0 != refs) {
+                return;
+        }
+        --txq_count;
+
+        /* Free up the space used by taken frames at the start of the ring */
+        while (0 != txq_used) {
+                ring_read(txq_head, (uint8_t *)&first, sizeof(first));
+                if (0 != first.refs) {
+                        break;
+                }
+                txq_head = (txq_head + sizeof(first) + first.n) % TXQLEN;
+                txq_used -= sizeof(first) + first.n;
+        }
+}
+
+static void list_push(struct txslot *s, struct fqlist *l, int i) {
+        s->fqs[i].link = -1;
+        if (-1 == l->head) {
+                l->head = i;
+        } else {
+                s->fqs[l->tail].link = i;
+        }
+        l->tail = i;
+}
+
+static void list_pop(struct txslot *s, struct fqlist *l) {
+        l->head = s->fqs[l->head].link;
+        if (-1 == l->head) {
+                l->tail = -1;
+        }
+}
+
+static void slot_reset(struct txslot *s) {
+        int i;
+
+        memset(s->fqs, 0, sizeof(s->fqs));
+        for (i = 0; i <= NFQ; ++i) {
+                s->fqs[i].head = s->fqs[i].tail = ENT_END;
+                s->fqs[i].link = -1;
+        }
+        s->newq.head = s->newq.tail = s->oldq.head = s->oldq.tail = -1;
+        s->count = 0;
+}
+
+#if 0 < ACKTHIN
+static int ack_replace(const uint8_t *b, uint16_t n, unsigned int mask,
+                uint8_t *key, uint32_t *ack, int *slot) {
+        uint32_t h; /* FNV-1a hash of the flow */
+        size_t i;
+
+        if (!ack_pure(b, n, key, ack)) {
+                return 0;
+        }
+        h = 2166136261U;
+        for (i = 0; i < ACKKEYLEN; ++i) {
+                h = (h ^ key[i]) * 16777619U;
+        }
+        *slot = h % ACKTHIN;
+
+        /* Only a newer ACK for the same flow, for which the old one is still
+         * queued for the same sessions, will do.  Duplicate ACKs mean
+         * something. */
+        if ((0 == acks[*slot].n) || (n != acks[*slot].n) ||
+                        (mask != acks[*slot].mask) ||
+                        (0 != memcmp(key, acks[*slot].key, ACKKEYLEN)) ||
+                        (0 >= (int32_t)(*ack - acks[*slot].ack))) {
+                return 0;
+        }
+        ring_write(acks[*slot].off, b, n);
+        acks[*slot].ack = *ack;
+        ++txq_thinned;
+        return 1;
+}
+#endif /* #if 0 < ACKTHIN */
+
+/* Copy n bytes from b into the ring starting at off */
+static void ring_write(size_t off, const uint8_t *b, size_t n) {
+        size_t first; /* Bytes before the end of the ring */
+        first = TXQLEN - off < n ? TXQLEN - off : n;
+        memcpy(txq + off, b, first);
+        memcpy(txq, b + first, n - first);
+}
+
+/* Copy n bytes from the ring starting at off into b */
+static void ring_read(size_t off, uint8_t *b, size_t n) {
+        size_t first; /* Bytes before the end of the ring */
+        first = TXQLEN - off < n ? TXQLEN - off : n;
+        memcpy(b, txq + off, first);
+        memcpy(b + first, txq, n - first);
+}
+
+/* Unlock txq_mtx, for use as a cleanup handler */
+static void txq_unlock(void *unused) {
+        pthread_mutex_unlock(&txq_mtx);
+}
+
+/* Milliseconds since some point */
+static uint64_t now_ms(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
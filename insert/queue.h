@@ -0,0 +1,100 @@
+/*
+ * queue.h
+ * Bounded queues of captured frames waiting to be sent to shift
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_QUEUE_H
+#define HAVE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of frames dropped because the queue was full */
+extern uint64_t txq_drops;
+
+/* Number of TCP ACKs which took the place of older ones in the queue */
+extern uint64_t txq_thinned;
+
+/* Number of frames queued right now, for any session */
+extern uint64_t txq_count;
+
+/* Number of frames dropped by CoDel for waiting too long */
+extern uint64_t txq_codel;
+
+/* Number of frames sent ahead of the rest (ARP, ICMP, DNS, and so on) */
+extern uint64_t txq_prio;
+
+/* How long the last frame taken off the queue waited, and the longest any
+ * frame's waited, in milliseconds */
+extern uint64_t txq_sojourn;
+extern uint64_t txq_sojourn_max;
+
+/* Allocate the queue.  Must be called before any other txq_ function. */
+int txq_init(void);
+
+/* Start queueing frames for the session in slot */
+void txq_attach(int slot);
+
+/* Stop queueing frames for the session in slot.  If it's the last session
+ * and it's in slot 0, its frames are held for the next session, which will
+ * also be in slot 0, otherwise they're dropped. */
+void txq_detach(int slot);
+
+/* Queue the n bytes at b, which were orig bytes long before being truncated
+ * (or just n), for every session.  Records which aren't frames have their
+ * record size, less than ETHHDRLEN, as orig.  If there's not enough room, the
+ * frame is dropped and RET_ERR_QFULL is returned. */
+int txq_put(const uint8_t *b, uint16_t n, uint16_t orig);
+
+/* Queue the n bytes at b, as txq_put does, but only for the session in slot.
+ * If there's no session in slot any more, it's quietly thrown away. */
+int txq_put_one(int slot, const uint8_t *b, uint16_t n, uint16_t orig);
+
+/* Queue the n-byte frame at b, captured on channel chan, as a channel
+ * record.  n must be no more than MAXFRAMELEN.  If the frame and channel are
+ * too big for the record's size, which can only happen if MAXFRAMELEN is
+ * 65535, the frame is dropped, counted in txq_drops, and RET_ERR_CSZL is
+ * returned.  If there's not enough room, the frame is dropped and
+ * RET_ERR_QFULL is returned. */
+int txq_put_chan(uint8_t chan, const uint8_t *b, uint16_t n);
+
+/* Queue the n-byte super-frame at b, after its hn-byte GSO header at hdr, as
+ * a GSO record.  hn + n must be no more than MAXFRAMELEN.  If there's not
+ * enough room, the super-frame is dropped and RET_ERR_QFULL is returned. */
+int txq_put_gso(const uint8_t *hdr, uint16_t hn, const uint8_t *b,
+                uint16_t n);
+
+/* Block until a frame is queued for the session in slot, then copy it to b,
+ * which must have room for MAXFRAMELEN + 1 bytes (a frame and its channel),
+ * and put its original length in orig, its sequence number in seq, and the
+ * order in which it was queued in qseq.  Frames are numbered in the order
+ * the session takes them off the queue, which isn't the order they were put
+ * on.  Returns the size of the frame.  This is a cancellation point. */
+uint16_t txq_get(int slot, uint8_t *b, uint16_t *orig, uint64_t *seq,
+                uint64_t *qseq);
+
+/* The sequence number the next frame the session in slot takes off the queue
+ * will have */
+uint64_t txq_next(int slot);
+
+/* The queue order the next frame put on the queue will have */
+uint64_t txq_end(void);
+
+#endif /* HAVE_QUEUE_H */
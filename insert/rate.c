@@ -0,0 +1,287 @@
+/*
+ * rate.c
+ * Limit how fast insert sends to shift
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "insert.h"
+#include "rate.h"
+#include "retvals.h"
+#include "session.h"
+
+uint64_t rate_waited = 0;
+
+/* A token bucket, kept as the time by which everything sent so far would've
+ * been sent at the rate (i.e. GCRA) */
+struct bucket {
+        uint64_t rate;  /* Bytes per second, or 0 for no limit */
+        uint64_t burst; /* Bytes which may be sent at once */
+        uint64_t tat;   /* When the bucket's empty, in microseconds */
+        uint64_t rem;   /* Part of a microsecond not yet in tat, in
+                           1/rate microseconds */
+};
+
+/* The rate at different times of the day */
+#define RATESCHEDMAX 24
+static struct {
+        int min;        /* Minute of the day it starts */
+        uint64_t rate;
+} sched[RATESCHEDMAX];
+static int nsched = 0;
+
+static pthread_mutex_t rate_mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t rate_base;      /* RATE */
+static uint64_t rate_now;       /* Rate in use */
+static uint64_t rate_checked;   /* When the schedule was last checked, in
+                                   microseconds */
+static int rate_fds[MAXSESSIONS]; /* Each session's socket to shift, or -1 */
+static int rate_paced = 0;      /* Nonzero if the kernel's pacing the only
+                                   session */
+static struct bucket total;     /* Everything */
+static struct bucket classes[RATE_OTHER]; /* Each kind with a share */
+
+/* Percent of the rate each kind may use */
+static const int shares[RATE_OTHER] = {RATEFRAMES, RATESTREAMS};
+
+/* Work out the rate for the time of day */
+static uint64_t rate_sched(void);
+
+/* Set the buckets (and the kernel's pacing) for rate r, which is now */
+static void rate_set(uint64_t r, uint64_t now);
+
+/* Take n bytes from b, and return how long to wait before sending them, in
+ * microseconds */
+static uint64_t bucket_take(struct bucket *b, uint64_t now, size_t n);
+
+/* Microseconds since some point */
+static uint64_t now_us(void);
+
+int rate_init(void) {
+        const char *p;
+        char *end;
+        long hhmm;
+        int i;
+
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                rate_fds[i] = -1;
+        }
+
+        end = NULL;
+        rate_base = strtoull(RATE, &end, 0);
+        if ('\0' != *end) {
+                return RET_INV_RATE;
+        }
+
+        /* HHMM=rate, separated by commas */
+        for (p = RATESCHED; '\0' != *p; p = end) {
+                if (RATESCHEDMAX == nsched) {
+                        return RET_INV_RATE;
+                }
+                hhmm = strtol(p, &end, 10);
+                if ((end == p) || ('=' != *end) || (0 > hhmm) ||
+                                (2359 < hhmm) || (59 < hhmm % 100)) {
+                        return RET_INV_RATE;
+                }
+                sched[nsched].min = (hhmm / 100) * 60 + hhmm % 100;
+                p = end + 1;
+                sched[nsched].rate = strtoull(p, &end, 10);
+                if (end == p) {
+                        return RET_INV_RATE;
+                }
+                if (',' == *end) {
+                        ++end;
+                } else if ('\0' != *end) {
+                        return RET_INV_RATE;
+                }
+                ++nsched;
+        }
+
+        rate_set(rate_sched(), now_us());
+        return 0;
+}
+
+void rate_start(struct session *s) {
+        uint64_t now;
+
+        pthread_mutex_lock(&rate_mtx);
+        rate_fds[s->n] = s->fd;
+        now = now_us();
+        rate_checked = now;
+        rate_set(rate_sched(), now);
+        pthread_mutex_unlock(&rate_mtx);
+}
+
+void rate_stop(struct session *s) {
+        pthread_mutex_lock(&rate_mtx);
+        rate_fds[s->n] = -1;
+        rate_set(rate_now, now_us());
+        pthread_mutex_unlock(&rate_mtx);
+}
+
+void rate_wait(int class, size_t n) {
+        uint64_t now;
+        uint64_t wait;  /* Microseconds to wait */
+        uint64_t w;
+        uint64_t r;
+        struct timespec ts;
+
+        pthread_mutex_lock(&rate_mtx);
+        now = now_us();
+
+        /* See if it's time for a different rate, every second or so */
+        if (0 != nsched && now - rate_checked >= 1000000) {
+                rate_checked = now;
+                if ((r = rate_sched()) != rate_now) {
+                        rate_set(r, now);
+                }
+        }
+
+        /* The kernel takes care of the total, if it can */
+        wait = 0;
+        if (!rate_paced) {
+                wait = bucket_take(&total, now, n);
+        }
+        if (RATE_OTHER > class &&
+                        (w = bucket_take(&classes[class], now, n)) > wait) {
+                wait = w;
+        }
+        rate_waited += wait;
+        pthread_mutex_unlock(&rate_mtx);
+
+        if (0 == wait) {
+                return;
+        }
+        ts.tv_sec = wait / 1000000;
+        ts.tv_nsec = (wait % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+}
+
+static uint64_t rate_sched(void) {
+        time_t t;
+        struct tm tm;
+        int min;
+        int i;
+        int best;       /* Latest entry which has started */
+        int last;       /* Latest entry, which carries over from yesterday */
+
+        if (0 == nsched) {
+                return rate_base;
+        }
+        t = time(NULL);
+        if (NULL == localtime_r(&t, &tm)) {
+                return rate_base;
+        }
+        min = tm.tm_hour * 60 + tm.tm_min;
+        best = last = -1;
+        for (i = 0; i < nsched; ++i) {
+                if ((sched[i].min <= min) &&
+                                (-1 == best || sched[i].min > sched[best].min)) {
+                        best = i;
+                }
+                if (-1 == last || sched[i].min > sched[last].min) {
+                        last = i;
+                }
+        }
+        return sched[-1 == best ? last : best].rate;
+}
+
+static void rate_set(uint64_t r, uint64_t now) {
+        int i;
+#ifdef SO_MAX_PACING_RATE
+        unsigned int pr; /* Pacing rate, ~0U for none */
+        unsigned int nopr; /* No pacing rate */
+        int nfds;        /* Sessions */
+#endif /* #ifdef SO_MAX_PACING_RATE */
+
+        rate_now = r;
+        total.rate = r;
+        total.burst = RATEBURST;
+        total.tat = now;
+        total.rem = 0;
+        for (i = 0; i < RATE_OTHER; ++i) {
+                classes[i].rate = 0;
+                if ((0 != r) && (100 > shares[i])) {
+                        /* A tiny share of a tiny rate is still a limit */
+                        if (0 == (classes[i].rate = r * shares[i] / 100)) {
+                                classes[i].rate = 1;
+                        }
+                }
+                classes[i].burst = RATEBURST * shares[i] / 100;
+                classes[i].tat = now;
+                classes[i].rem = 0;
+        }
+
+        /* Let the kernel do the pacing, if it can and there's only one
+         * session.  Several sessions share the total in userspace. */
+        rate_paced = 0;
+#ifdef SO_MAX_PACING_RATE
+        nfds = 0;
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                if (-1 != rate_fds[i]) {
+                        ++nfds;
+                }
+        }
+        pr = (0 == r || UINT_MAX <= r) ? ~0U : (unsigned int)r;
+        nopr = ~0U;
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                if (-1 == rate_fds[i]) {
+                        continue;
+                }
+                rate_paced = (0 == setsockopt(rate_fds[i], SOL_SOCKET,
+                                        SO_MAX_PACING_RATE,
+                                        (1 == nfds) ? &pr : &nopr,
+                                        sizeof(pr))) && (1 == nfds);
+        }
+#endif /* #ifdef SO_MAX_PACING_RATE */
+}
+
+static uint64_t bucket_take(struct bucket *b, uint64_t now, size_t n) {
+        uint64_t tau; /* How far ahead the bucket may get */
+
+        if (0 == b->rate) {
+                return 0;
+        }
+        if (b->tat < now) {
+                b->tat = now;
+                b->rem = 0;
+        }
+        /* Carry what's left of a microsecond to the next take, or small
+         * records at high rates would be free */
+        b->rem += (uint64_t)n * 1000000;
+        b->tat += b->rem / b->rate;
+        b->rem %= b->rate;
+        tau = b->burst * 1000000 / b->rate;
+        return (b->tat > now + tau) ? b->tat - now - tau : 0;
+}
+
+static uint64_t now_us(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,55 @@
+/*
+ * rate.h
+ * Limit how fast insert sends to shift
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_RATE_H
+#define HAVE_RATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "session.h"
+
+/* Kinds of traffic with their own share of the rate */
+#define RATE_FRAMES  0 /* Captured frames */
+#define RATE_STREAMS 1 /* Stream records */
+#define RATE_OTHER   2 /* Anything else, which only counts towards the total */
+
+/* Total time spent waiting to send, in microseconds */
+extern uint64_t rate_waited;
+
+/* Work out the rate and schedule from RATE and RATESCHED.  Must be called
+ * before any other rate_ function. */
+int rate_init(void);
+
+/* Get ready for the session s, letting the kernel pace it if it can and it's
+ * the only one.  Must be called before the session's insert_to_shift threads
+ * are started.  Sessions share the rate. */
+void rate_start(struct session *s);
+
+/* Stop pacing the session s, once its insert_to_shift threads are done */
+void rate_stop(struct session *s);
+
+/* Wait until n bytes of traffic of kind class (RATE_ above) may be sent.
+ * This is a cancellation point. */
+void rate_wait(int class, size_t n);
+
+#endif /* HAVE_RATE_H */
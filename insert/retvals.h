@@ -3,7 +3,7 @@
  * Return values for insert.c
  * by J. Stuart McMurray
  * created 20150117
- * last modified 20150222
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -57,5 +57,13 @@
 #define RET_ERR_CSZS  -28 /* Captured packet size too small */
 #define RET_ERR_CSZL  -29 /* Captured packet size too large */
 #define RET_ERR_CAP   -30 /* Error sniffing packets */
+#define RET_ERR_QFULL -31 /* Send queue full, frame dropped */
+#define RET_ERR_RAND  -32 /* Unable to get random bytes from the kernel */
+#define RET_ERR_RXSZ  -33 /* Frame from shift larger than MAXFRAMELEN */
+#define RET_ERR_THR   -34 /* Unable to start a thread */
+#define RET_ERR_RIDX  -35 /* Bad indexed framing header from shift */
+#define RET_ERR_STRM  -36 /* Bad stream record from shift */
+#define RET_INV_RATE  -37 /* Unable to parse RATE or RATESCHED */
+#define RET_ERR_SESS  -38 /* Too many shifts connected at once */
 
 #endif /* #ifndef HAVE_RETVALS_H */
@@ -3,7 +3,7 @@
  * Code to receive data from insert
  * by J. Stuart McMurray
  * created 20150212
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -26,35 +26,76 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "cap.h"
 #include "comm.h"
 #include "crypto.h"
 #include "insert.h"
 #include "retvals.h"
+#include "session.h"
 #include "sha2.h"
+#include "stream.h"
 
-/* Handle a keepalive packet from fd (after the initial 0x00).  Returns 0 on
- * success.  */
-int handle_keepalive(int fd);
+/* Handle a keepalive packet from s's shift (after the initial 0x00).
+ * Returns 0 on success.  */
+int handle_keepalive(struct session *s, size_t *n);
 
-/* Get data from shift (as fd) and put it on the wire. */
-void shift_to_insert(int fd, pcap_t *p) {
+/* Read an indexed framing header from s's shift, get rxdecrypt ready for the
+ * record and put the record's size in n.  Returns 0 on success. */
+static int recv_index(struct session *s, size_t *n);
+
+/* With indexed framing, the lowest block the next record may use, for each
+ * session */
+static uint64_t rxnext[MAXSESSIONS];
+
+/* Receive buffers, with room for the sizes and a channel, for each
+ * session */
+static uint8_t *rxbufs[MAXSESSIONS];
+
+/* Allocate the receive buffers */
+int rx_init(void) {
+        int i;
+
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                if (NULL == (rxbufs[i] = arena_alloc(2 * sizeof(uint16_t) +
+                                                1 + MAXFRAMELEN))) {
+                        return RET_ENOMEM;
+                }
+        }
+        return 0;
+}
+
+/* Get data from s's shift and put it on the wire. */
+void shift_to_insert(struct session *s) {
         uint16_t sizeh;                 /* Size in host byte order */
-        uint8_t buf[sizeof(sizeh) + UINT16_MAX]; /* Read buffer */
+        uint8_t *buf;                   /* Read buffer */
         uint8_t comphash[DIGESTLEN];    /* Message digest */
         uint8_t rxhash[DIGESTLEN];      /* Digest, as sent by shift */
-        int i;                          /* Index variable */
         int ret;                        /* Return value */
+        size_t reclen;                  /* Indexed framing record size */
+        size_t kalen;                   /* Size of a keepalive */
+        size_t hl;                      /* Size of the sizes */
+        uint16_t rectype;               /* Record size, for sized records */
+        uint8_t *frame;                 /* Frame to inject */
+        int chan;                       /* Channel to inject it on */
 
         sizeh = 0;
-        memset(buf, 0, sizeof(buf));
+        reclen = 0;
+        rxnext[s->n] = DATABLOCK;
+        buf = rxbufs[s->n];
         memset(comphash, 0, sizeof(comphash));
         memset(rxhash, 0, sizeof(rxhash));
-        i = 0;
         ret = 0;
 
         for (;;) {
+                /* With indexed framing, find out where the record is */
+                if ((s->options & OPT_INDEXED) &&
+                                (0 != (ret = recv_index(s, &reclen)))) {
+                        break;
+                }
+
                 /* Pull a size off the wire */
-                if (0 != (ret = recv_enc(fd, (uint8_t*)buf, sizeof(sizeh)))) {
+                if (0 != (ret = recv_enc(s, (uint8_t*)buf, sizeof(sizeh)))) {
                         break;
                 }
 
@@ -63,26 +104,58 @@ void shift_to_insert(int fd, pcap_t *p) {
 
                 /* If the size is 0, it's a keepalive */
                 if (0 == sizeh) {
-                        if (0 != (ret = handle_keepalive(fd))) {
-                                return;
+                        if (0 != (ret = handle_keepalive(s, &kalen))) {
+                                break;
+                        }
+                        if ((s->options & OPT_INDEXED) &&
+                                        (sizeof(sizeh) + kalen != reclen)) {
+                                ret = RET_ERR_RIDX;
+                                break;
                         }
                         /* Process the next packet */
                         continue;
                 }
 
+                /* Stream and channel records have their real size next */
+                hl = sizeof(sizeh);
+                rectype = 0;
+                if (((s->options & OPT_STREAMS) && (STREAMREC == sizeh)) ||
+                                ((s->options & OPT_CHANNELS) &&
+                                 (CHANREC == sizeh))) {
+                        rectype = sizeh;
+                        if (0 != (ret = recv_enc(s, buf + hl,
+                                                        sizeof(sizeh)))) {
+                                break;
+                        }
+                        sizeh = (buf[hl] << 8) | buf[hl + 1];
+                        hl += sizeof(sizeh);
+                }
+
+                /* Make sure we've room for it.  A channel record's size
+                 * includes its channel. */
+                if (MAXFRAMELEN + (CHANREC == rectype ? 1 : 0) < sizeh) {
+                        ret = RET_ERR_RXSZ;
+                        break;
+                }
+                /* And that it's the size the header said */
+                if ((s->options & OPT_INDEXED) && (hl + sizeh + DIGESTLEN !=
+                                        reclen)) {
+                        ret = RET_ERR_RIDX;
+                        break;
+                }
                 /* Read that many bytes of data */
-                if (0 != (ret = recv_enc(fd, buf+sizeof(sizeh), sizeh))) {
+                if (0 != (ret = recv_enc(s, buf + hl, sizeh))) {
                         break;
                 }
 
                 /* Read the hash, as sent by shift */
-                if (0 != (ret = recv_enc(fd, rxhash, DIGESTLEN))) {
+                if (0 != (ret = recv_enc(s, rxhash, DIGESTLEN))) {
                         break;
                 }
 
                 /* Get the hash of the data */
                 /* Possible pitfall size_t -> unsigned int typecast */
-                sha224(buf, (unsigned int)sizeh+(unsigned int)sizeof(sizeh), comphash);
+                sha224(buf, (unsigned int)sizeh+(unsigned int)hl, comphash);
                 /* TODO: Make sure sizeof(unsigned int) >= 2 bytes */
 
                 /* Make sure the two are the same */
@@ -91,29 +164,50 @@ void shift_to_insert(int fd, pcap_t *p) {
                         break;
                 }
 
+                /* Stream records go to the stream */
+                if (STREAMREC == rectype) {
+                        if (0 != (ret = stream_record(s, buf + hl, sizeh))) {
+                                break;
+                        }
+                        continue;
+                }
+
+                /* Channel records start with the channel.  The frame's size
+                 * is written over the channel and the end of the record's
+                 * size so the frame can be hashed the way cap_is_echo hashes
+                 * it if it's captured. */
+                frame = buf + hl;
+                chan = 0;
+                if (CHANREC == rectype) {
+                        if (ETHHDRLEN + 1 > sizeh) {
+                                continue;
+                        }
+                        chan = *frame++;
+                        --sizeh;
+                        frame[-2] = (sizeh >> 8) & 0xFF;
+                        frame[-1] = sizeh & 0xFF;
+                        sha224(frame - 2, sizeh + 2, comphash);
+                }
+
                 /* Send it out on the wire */
-                if ((ret = pcap_inject(p, buf+sizeof(sizeh), sizeh)) !=
-                                sizeh) {
+                if ((ret = cap_inject(chan, frame, sizeh,
+                                                comphash)) != sizeh) {
                         printf("Only injected %i/%i bytes\n", ret, sizeh);
                 }
         }
-        /* TODO: Handle the interface going down */
-        /* TODO: Break from the pcap read loop */
-        
         /* If we're here, something failed (or shift disconnected) */
-        set_reterr(ret);
+        set_reterr(s, ret);
 }
 
-/* Handle a keepalive packet from fd (after the initial 0x00).  Returns 0 on
- * success.  */
-int handle_keepalive(int fd) {
+/* Handle a keepalive packet from s's shift (after the initial 0x00).
+ * Returns 0 on success.  */
+int handle_keepalive(struct session *s, size_t *n) {
         uint16_t junksizen;      /* Number of junk bytes to read in NBO */
         uint16_t junksizeh;      /* Number of junk bytes to read in HBO */
-        uint8_t buf[UINT16_MAX]; /* Receive buffer */
         int ret;                 /* Return value */
 
         /* Read the size of the junk data */
-        if (0 != (ret = recv_enc(fd, (uint8_t*)&junksizen,
+        if (0 != (ret = recv_enc(s, (uint8_t*)&junksizen,
                                         sizeof(uint16_t)))) {
                 return ret;
         }
@@ -122,9 +216,42 @@ int handle_keepalive(int fd) {
         junksizeh = ntohs(junksizen);
 
         /* Read (and discard) that many bytes of data */
-        if (0 != (ret = recv_enc(fd, buf, junksizeh))) {
+        if (0 != (ret = recv_skip(s, junksizeh, 1))) {
+                return ret;
+        }
+
+        *n = sizeof(junksizen) + junksizeh;
+        return 0;
+}
+
+/* Read an indexed framing header from s's shift, get rxdecrypt ready for the
+ * record and put the record's size in n.  Returns 0 on success. */
+static int recv_index(struct session *s, size_t *n) {
+        uint8_t hdr[INDEXHDRLEN]; /* Header */
+        uint64_t block;           /* First block of the record */
+        int ret;                  /* Return value */
+        int i;
+
+        if (0 != (ret = recv_all(s->fd, hdr, sizeof(hdr)))) {
                 return ret;
         }
+        rxhdecrypt(s, hdr, sizeof(hdr));
+        block = 0;
+        for (i = 0; i < 8; ++i) {
+                block = (block << 8) | hdr[i];
+        }
+        *n = 0;
+        for (i = 0; i < 4; ++i) {
+                *n = (*n << 8) | hdr[8 + i];
+        }
 
+        /* Blocks may never be used twice, nor may records wander into the
+         * header blocks */
+        if ((block < rxnext[s->n]) || (HDRBLOCK <= block) ||
+                        (HDRBLOCK <= block + NBLOCKS(*n))) {
+                return RET_ERR_RIDX;
+        }
+        rxnext[s->n] = block + NBLOCKS(*n);
+        rxseek(s, block);
         return 0;
 }
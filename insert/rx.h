@@ -3,7 +3,7 @@
  * Code to receive data from insert
  * by J. Stuart McMurray
  * created 20150212
- * last modified 20150215
+ * last modified 20261018
  *
  * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -24,9 +24,12 @@
 #ifndef HAVE_RX_H
 #define HAVE_RX_H
 
-#include <pcap.h>
+#include "session.h"
 
-/* Get data from shift (as fd) and put it on the wire. */
-void shift_to_insert(int fd, pcap_t *p);
+/* Allocate the receive buffers */
+int rx_init(void);
+
+/* Get data from s's shift and put it on the wire. */
+void shift_to_insert(struct session *s);
 
 #endif /* HAVE_RX_H */
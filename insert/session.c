@@ -0,0 +1,158 @@
+/*
+ * session.c
+ * Sessions with several shifts at once
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "insert.h"
+#include "queue.h"
+#include "session.h"
+
+static struct session sessions[MAXSESSIONS];
+static pthread_mutex_t sess_mtx;
+static unsigned int sess_mask; /* Slots of attached sessions */
+
+/* Options of the attached sessions, or of the last ones, for capturing */
+static atomic_uint_least32_t opts_any; /* Any session has */
+static atomic_uint_least32_t opts_all; /* Every session has */
+
+/* Work out opts_any and opts_all.  sess_mtx must be held. */
+static void sess_options(void);
+
+void sess_init(void) {
+        int i;
+
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                sessions[i].n = i;
+                pthread_mutex_init(&sessions[i].retmtx, NULL);
+        }
+        pthread_mutex_init(&sess_mtx, NULL);
+        atomic_store(&opts_any, 0);
+        atomic_store(&opts_all, 0);
+}
+
+struct session *sess_new(int fd) {
+        struct session *s;
+        int i;
+
+        pthread_mutex_lock(&sess_mtx);
+
+        /* Free up the slots of sessions which are over */
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                if (!sessions[i].used || !sessions[i].done) {
+                        continue;
+                }
+                if (sessions[i].threaded) {
+                        pthread_join(sessions[i].t, NULL);
+                }
+                sessions[i].used = 0;
+        }
+
+        /* Take the first free one */
+        s = NULL;
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                if (!sessions[i].used) {
+                        s = &sessions[i];
+                        break;
+                }
+        }
+        if (NULL != s) {
+                s->fd = fd;
+                s->options = 0;
+                s->reterr = 0;
+                s->threaded = 0;
+                s->done = 0;
+                s->used = 1;
+        }
+
+        pthread_mutex_unlock(&sess_mtx);
+        return s;
+}
+
+void sess_attach(struct session *s) {
+        pthread_mutex_lock(&sess_mtx);
+        sess_mask |= 1U << s->n;
+        sess_options();
+        txq_attach(s->n);
+        pthread_mutex_unlock(&sess_mtx);
+}
+
+void sess_detach(struct session *s) {
+        pthread_mutex_lock(&sess_mtx);
+        sess_mask &= ~(1U << s->n);
+        sess_options();
+        txq_detach(s->n);
+        pthread_mutex_unlock(&sess_mtx);
+}
+
+void sess_done(struct session *s) {
+        pthread_mutex_lock(&sess_mtx);
+        s->done = 1;
+        pthread_mutex_unlock(&sess_mtx);
+}
+
+int sess_any(uint32_t o) {
+        return 0 != (atomic_load(&opts_any) & o);
+}
+
+int sess_all(uint32_t o) {
+        return o == (atomic_load(&opts_all) & o);
+}
+
+/* Safely set s's reterr to r if it's not already set */
+void set_reterr(struct session *s, int r) {
+        /* If it's already set, give up */
+        if (0 != s->reterr) {
+                return;
+        }
+        /* Lock reterr */
+        pthread_mutex_lock(&s->retmtx);
+        /* Change it if it's still 0 */
+        if (0 == s->reterr) {
+                s->reterr = r;
+        }
+        /* Unlock reterr */
+        pthread_mutex_unlock(&s->retmtx);
+}
+
+static void sess_options(void) {
+        uint32_t any;
+        uint32_t all;
+        int i;
+
+        /* The last session to go leaves its options in place */
+        if (0 == sess_mask) {
+                return;
+        }
+        any = 0;
+        all = ~(uint32_t)0;
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                if (sess_mask & (1U << i)) {
+                        any |= sessions[i].options;
+                        all &= sessions[i].options;
+                }
+        }
+        atomic_store(&opts_any, any);
+        atomic_store(&opts_all, all);
+}
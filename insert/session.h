@@ -0,0 +1,82 @@
+/*
+ * session.h
+ * Sessions with several shifts at once
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_SESSION_H
+#define HAVE_SESSION_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "chacha20_simple.h"
+
+/* Everything about a connection to one shift.  Modules with big buffers
+ * keep their own per-session state in arrays indexed by n. */
+struct session {
+        int n;                  /* Slot, from 0 to MAXSESSIONS-1 */
+        int fd;                 /* Socket to shift */
+        uint32_t options;       /* Options agreed on in the handshake */
+        int reterr;             /* Error "returned" by the first tx/rx
+                                   thread to error */
+        pthread_mutex_t retmtx; /* Mutex to lock reterr */
+        chacha20_ctx txctx;     /* Send crypto stream */
+        chacha20_ctx rxctx;     /* Receive crypto stream */
+        chacha20_ctx txbase;    /* txctx, for seeking in indexed framing */
+        chacha20_ctx rxbase;    /* rxctx, for seeking in indexed framing */
+        chacha20_ctx txhctx;    /* Send record header stream */
+        chacha20_ctx rxhctx;    /* Receive record header stream */
+        pthread_t t;            /* Thread running the session, if threaded */
+        int threaded;           /* Nonzero if t needs joining */
+        int used;               /* Nonzero if the slot's in use */
+        int done;               /* Nonzero once the session's over */
+};
+
+/* Set up the session slots.  Must be called before any other sess_
+ * function. */
+void sess_init(void);
+
+/* Take a free slot for a session with shift on fd, freeing the slots of
+ * sessions which are over.  The lowest free slot is used, so a lone session
+ * is always in slot 0.  Returns NULL if every slot's in use. */
+struct session *sess_new(int fd);
+
+/* Start sending s frames, once its options are known, and work out which
+ * options capturing has to cater for */
+void sess_attach(struct session *s);
+
+/* Stop sending s frames */
+void sess_detach(struct session *s);
+
+/* Mark s as over, so its slot may be reused */
+void sess_done(struct session *s);
+
+/* Returns nonzero if any session has any of the options in o.  With no
+ * sessions, the last ones count. */
+int sess_any(uint32_t o);
+
+/* Returns nonzero if every session has all of the options in o.  With no
+ * sessions, the last ones count. */
+int sess_all(uint32_t o);
+
+/* Safely set s's reterr to r if it's not already set */
+void set_reterr(struct session *s, int r);
+
+#endif /* HAVE_SESSION_H */
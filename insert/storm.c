@@ -0,0 +1,151 @@
+/*
+ * storm.c
+ * Rate-limit broadcast and multicast chatter
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "insert.h"
+#include "learn.h"
+#include "storm.h"
+
+uint64_t storm_drops[NSTORM];
+uint64_t storm_unjoined = 0;
+
+/* A token costs this many credits.  A bucket gets a class's frames per second
+ * worth of credits every microsecond. */
+#define TOKEN 1000000ULL
+
+/* Token buckets, one per class */
+static struct {
+        uint64_t credits;  /* Credits in the bucket */
+        uint64_t last;     /* When credits were last added, in us, 0 if never */
+} buckets[NSTORM];
+
+/* Work out the class of the broadcast or multicast n-byte frame at b */
+static enum storm_class classify(const uint8_t *b, size_t n);
+
+/* Get the big-endian uint16_t at b */
+#define GET16(b) ((uint16_t)(((b)[0] << 8) | (b)[1]))
+
+int storm_pass(const uint8_t *b, size_t n, const struct timeval *ts) {
+        enum storm_class c;
+        uint64_t now;   /* Capture time, in us */
+        uint64_t pps;   /* Class's frames per second */
+
+        /* Unicast is always fine */
+        if (MACLEN > n || 0 == (b[0] & 0x01)) {
+                return 1;
+        }
+
+        /* Don't bother shift with groups it's not in */
+        if ((0 < MCGROUPS) &&
+                        (((0x01 == b[0]) && (0x00 == b[1]) &&
+                          (0x5E == b[2])) ||
+                         ((0x33 == b[0]) && (0x33 == b[1]))) &&
+                        !learn_joined(b)) {
+                ++storm_unjoined;
+                return 0;
+        }
+
+        if (0 == STORMPPS) {
+                return 1;
+        }
+        c = classify(b, n);
+        pps = (STORM_ARP == c) ? ARPPPS : STORMPPS;
+
+        /* Top up the bucket.  If the clock's gone backwards, it's not
+         * topped up until it's caught up. */
+        now = (uint64_t)ts->tv_sec * 1000000 + ts->tv_usec;
+        if (0 == buckets[c].last) {
+                buckets[c].credits = STORMBURST * TOKEN;
+                buckets[c].last = now;
+        } else if (now > buckets[c].last) {
+                buckets[c].credits += (now - buckets[c].last) * pps;
+                if (STORMBURST * TOKEN < buckets[c].credits) {
+                        buckets[c].credits = STORMBURST * TOKEN;
+                }
+                buckets[c].last = now;
+        }
+
+        /* Spend a token, if there is one */
+        if (TOKEN > buckets[c].credits) {
+                ++storm_drops[c];
+                return 0;
+        }
+        buckets[c].credits -= TOKEN;
+        return 1;
+}
+
+static enum storm_class classify(const uint8_t *b, size_t n) {
+        static const uint8_t bcast[MACLEN] =
+                {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        static const struct {
+                uint8_t mac[MACLEN];
+                enum storm_class c;
+        } groups[] = {
+                {{0x01, 0x00, 0x5E, 0x00, 0x00, 0xFB}, STORM_MDNS},
+                {{0x33, 0x33, 0x00, 0x00, 0x00, 0xFB}, STORM_MDNS},
+                {{0x01, 0x00, 0x5E, 0x7F, 0xFF, 0xFA}, STORM_SSDP},
+                {{0x33, 0x33, 0x00, 0x00, 0x00, 0x0C}, STORM_SSDP},
+                {{0x01, 0x00, 0x5E, 0x00, 0x00, 0xFC}, STORM_LLMNR},
+                {{0x33, 0x33, 0x00, 0x01, 0x00, 0x03}, STORM_LLMNR},
+        };
+        size_t i;
+        size_t hl;      /* IPv4 header length */
+        uint16_t port;  /* UDP destination port */
+
+        /* EtherType */
+        if (2 * MACLEN + 2 <= n && 0x0806 == GET16(b + 2 * MACLEN)) {
+                return STORM_ARP;
+        }
+
+        /* Broadcasts, and which are NetBIOS */
+        if (0 == memcmp(b, bcast, MACLEN)) {
+                if (2 * MACLEN + 2 + 20 + 4 > n ||
+                                0x0800 != GET16(b + 2 * MACLEN) ||
+                                17 != b[2 * MACLEN + 2 + 9]) {
+                        return STORM_BCAST;
+                }
+                hl = (b[2 * MACLEN + 2] & 0x0F) * 4;
+                if (2 * MACLEN + 2 + hl + 4 > n) {
+                        return STORM_BCAST;
+                }
+                port = GET16(b + 2 * MACLEN + 2 + hl + 2);
+                if (137 == port || 138 == port) {
+                        return STORM_NETBIOS;
+                }
+                return STORM_BCAST;
+        }
+
+        /* Link-layer protocols */
+        if (0x01 == b[0] && 0x80 == b[1] && 0xC2 == b[2]) {
+                return STORM_LINK;
+        }
+
+        /* Well-known chatty groups */
+        for (i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i) {
+                if (0 == memcmp(b, groups[i].mac, MACLEN)) {
+                        return groups[i].c;
+                }
+        }
+        return STORM_MCAST;
+}
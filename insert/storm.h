@@ -0,0 +1,55 @@
+/*
+ * storm.h
+ * Rate-limit broadcast and multicast chatter
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_STORM_H
+#define HAVE_STORM_H
+
+#include <sys/time.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Classes of broadcast and multicast frames, each with its own limit */
+enum storm_class {
+        STORM_ARP,      /* ARP */
+        STORM_LINK,     /* STP, LLDP, and other 01:80:C2 frames */
+        STORM_MDNS,     /* Multicast DNS */
+        STORM_SSDP,     /* SSDP */
+        STORM_LLMNR,    /* LLMNR */
+        STORM_NETBIOS,  /* NetBIOS name and datagram broadcasts */
+        STORM_BCAST,    /* Other broadcasts */
+        STORM_MCAST,    /* Other multicast */
+        NSTORM
+};
+
+/* Frames dropped, per class */
+extern uint64_t storm_drops[NSTORM];
+
+/* Multicast frames dropped because shift hasn't joined the group */
+extern uint64_t storm_unjoined;
+
+/* Returns nonzero if the n-byte frame at b, captured at ts, should be sent to
+ * shift.  Unicast frames always should.  Must only be called from the capture
+ * thread. */
+int storm_pass(const uint8_t *b, size_t n, const struct timeval *ts);
+
+#endif /* HAVE_STORM_H */
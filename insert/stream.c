@@ -0,0 +1,512 @@
+/*
+ * stream.c
+ * Proxy TCP connections forwarded by shift
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "comm.h"
+#include "insert.h"
+#include "queue.h"
+#include "retvals.h"
+#include "session.h"
+#include "stream.h"
+
+uint64_t stream_opened = 0;
+
+/* Each stream has a thread which connects to the remote host and reads from
+ * it, and one which writes to it.  Bytes from shift are put in the stream's
+ * buffer by the receiving thread, so a slow remote host only holds up its own
+ * stream.  Shift's told how much room there is with window records, and tells
+ * us how much it'll take the same way. */
+struct stream {
+        int fd;                       /* Socket, or -1 if the slot's free */
+        uint16_t id;                  /* Shift's ID for the stream */
+        int sess;                     /* Slot of the session it's for */
+        int state;                    /* ST_ below */
+        int shutwr;                   /* Nonzero once shift's done sending */
+        int broken;                   /* Nonzero once bytes from shift are
+                                         thrown away */
+        int retired;                  /* Nonzero once shift's reused the ID */
+        int done;                     /* Nonzero once the reader's done */
+        int wdone;                    /* Nonzero once the writer's done */
+        pthread_t t;                  /* Thread reading from fd */
+        pthread_t wt;                 /* Thread writing to fd */
+        uint8_t *buf;                 /* STREAMBUFLEN bytes from shift, in a
+                                         ring */
+        size_t head;                  /* Offset of the first unwritten byte */
+        size_t len;                   /* Number of unwritten bytes */
+        uint32_t credit;              /* Bytes shift will still take */
+        struct sockaddr_storage addr; /* Where to connect */
+        socklen_t addrlen;
+};
+#define ST_CONNECTING 0
+#define ST_OPEN       1
+#define ST_FAILED     2
+
+#define NSTREAMS (0 < STREAMS ? STREAMS : 1)
+static struct stream streams[MAXSESSIONS][NSTREAMS]; /* Each session's */
+static pthread_mutex_t st_mtx;
+static pthread_cond_t st_cond;
+static uint64_t st_seq0[MAXSESSIONS]; /* Queue order of each session's first
+                                         record */
+
+/* Most bytes read from a remote host at once, so a record fits in a frame */
+#define STREAMCHUNK (MAXFRAMELEN - STREAMHDRLEN < 8192 ? \
+                MAXFRAMELEN - STREAMHDRLEN : 8192)
+
+/* How long writing to a remote host may block, or shift may go without
+ * having room for more, in seconds, before the stream's given up on */
+#define STREAMSNDTO 10
+
+/* How long to wait for room in the send queue, in microseconds.  Stream bytes
+ * aren't dropped like frames. */
+#define STREAMWAIT 10000
+
+/* Connect to the remote host, and send what it sends to shift */
+static void *stream_thread(void *arg);
+
+/* Write what shift sends to the remote host, once it's connected */
+static void *stream_writer(void *arg);
+
+/* Wait for shift to have room for bytes from stream s, and return how many
+ * may be read, up to STREAMCHUNK.  Returns 0 if the stream's been given up
+ * on. */
+static size_t stream_credit(struct stream *s);
+
+/* Tell shift it may send n more bytes for the session in slot sess's stream
+ * id */
+static void stream_grant(int sess, uint16_t id, uint32_t n);
+
+/* Unlock st_mtx, for use as a cleanup handler */
+static void st_unlock(void *unused);
+
+/* Find the session in slot sess's stream with the given id, or return NULL */
+static struct stream *stream_find(int sess, uint16_t id);
+
+/* Queue a record of type op for the session in slot sess's stream id.  b
+ * must have STREAMHDRLEN bytes free before the n bytes of data. */
+static void stream_put(int sess, uint16_t id, uint8_t op, uint8_t *b,
+                size_t n);
+
+/* Start the session in slot sess's stream id to the port and address in the
+ * n bytes at b */
+static void stream_open(int sess, uint16_t id, const uint8_t *b, size_t n);
+
+/* Free the slots of the session in slot sess's streams which are done both
+ * ways */
+static void stream_reap(int sess);
+
+/* Free the slot of stream s */
+static void stream_free(struct stream *s);
+
+int stream_init(void) {
+        int i, j;
+
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                for (j = 0; j < NSTREAMS; ++j) {
+                        streams[i][j].fd = -1;
+                        streams[i][j].sess = i;
+                }
+                for (j = 0; j < STREAMS; ++j) {
+                        if (NULL == (streams[i][j].buf =
+                                                arena_alloc(STREAMBUFLEN))) {
+                                return RET_ENOMEM;
+                        }
+                }
+        }
+        pthread_mutex_init(&st_mtx, NULL);
+        pthread_cond_init(&st_cond, NULL);
+        return 0;
+}
+
+void stream_start(struct session *s) {
+        st_seq0[s->n] = txq_end();
+}
+
+int stream_current(struct session *s, uint64_t qseq) {
+        return qseq >= st_seq0[s->n];
+}
+
+int stream_record(struct session *ss, uint8_t *b, size_t n) {
+        struct stream *s;
+        uint16_t id;
+        uint8_t op;
+        size_t off;     /* Where the bytes go in the buffer */
+        size_t m;       /* Bytes which go before the buffer wraps */
+        int ret;
+
+        if (STREAMHDRLEN > n) {
+                return RET_ERR_STRM;
+        }
+        id = (b[0] << 8) | b[1];
+        op = b[2];
+        b += STREAMHDRLEN;
+        n -= STREAMHDRLEN;
+
+        if (STREAM_OPEN == op) {
+                /* Shift only reuses an ID once it's had our close.  The old
+                 * stream keeps its slot until its threads are done. */
+                if (NULL != (s = stream_find(ss->n, id))) {
+                        if (!s->shutwr) {
+                                return RET_ERR_STRM;
+                        }
+                        s->retired = 1;
+                }
+                stream_open(ss->n, id, b, n);
+                return 0;
+        }
+
+        /* Streams we've given up on are ignored until shift notices */
+        if (NULL == (s = stream_find(ss->n, id))) {
+                return 0;
+        }
+
+        ret = 0;
+        pthread_mutex_lock(&st_mtx);
+        switch (op) {
+        case STREAM_DATA:
+                if (s->broken || (ST_FAILED == s->state)) {
+                        break;
+                }
+                /* Shift sent more than it was allowed */
+                if (STREAMBUFLEN - s->len < n) {
+                        s->broken = 1;
+                        shutdown(s->fd, SHUT_RDWR);
+                        pthread_cond_broadcast(&st_cond);
+                        break;
+                }
+                off = (s->head + s->len) % STREAMBUFLEN;
+                m = (STREAMBUFLEN - off < n) ? STREAMBUFLEN - off : n;
+                memcpy(s->buf + off, b, m);
+                memcpy(s->buf, b + m, n - m);
+                s->len += n;
+                pthread_cond_broadcast(&st_cond);
+                break;
+        case STREAM_WINDOW:
+                if (4 != n) {
+                        ret = RET_ERR_STRM;
+                        break;
+                }
+                s->credit += ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+                        ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+                pthread_cond_broadcast(&st_cond);
+                break;
+        case STREAM_CLOSE:
+                s->shutwr = 1;
+                pthread_cond_broadcast(&st_cond);
+                break;
+        default:
+                ret = RET_ERR_STRM;
+                break;
+        }
+        pthread_mutex_unlock(&st_mtx);
+
+        if (STREAM_CLOSE == op) {
+                stream_reap(ss->n);
+        }
+        return ret;
+}
+
+void stream_stop(struct session *ss) {
+        struct stream *s;
+
+        for (s = streams[ss->n]; s < streams[ss->n] + NSTREAMS; ++s) {
+                if (-1 == s->fd) {
+                        continue;
+                }
+                pthread_cancel(s->t);
+                pthread_cancel(s->wt);
+                stream_free(s);
+        }
+}
+
+static void *stream_thread(void *arg) {
+        struct stream *s;
+        uint8_t buf[STREAMHDRLEN + STREAMCHUNK];
+        struct timeval t;
+        ssize_t n;
+        size_t m;
+        int state;
+
+        s = (struct stream *)arg;
+
+        /* Try to connect, and let the writer know how it went.  If shift
+         * sent more than the buffer holds in the meantime, it's too late. */
+        state = ST_FAILED;
+        if (0 == connect(s->fd, (struct sockaddr *)&s->addr, s->addrlen)) {
+                state = ST_OPEN;
+                memset(&t, 0, sizeof(t));
+                t.tv_sec = STREAMSNDTO;
+                setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+        }
+        pthread_mutex_lock(&st_mtx);
+        if (s->broken) {
+                state = ST_FAILED;
+        }
+        s->state = state;
+        pthread_cond_broadcast(&st_cond);
+        pthread_mutex_unlock(&st_mtx);
+
+        /* Send shift what the remote host sends until it's done */
+        if (ST_OPEN == state) {
+                while ((0 != (m = stream_credit(s))) && (0 < (n = recv(s->fd,
+                                                        buf + STREAMHDRLEN,
+                                                        m, 0)))) {
+                        pthread_mutex_lock(&st_mtx);
+                        s->credit -= n;
+                        pthread_mutex_unlock(&st_mtx);
+                        stream_put(s->sess, s->id, STREAM_DATA, buf, n);
+                }
+        }
+        stream_put(s->sess, s->id, STREAM_CLOSE, buf, 0);
+
+        pthread_mutex_lock(&st_mtx);
+        s->done = 1;
+        pthread_mutex_unlock(&st_mtx);
+        return NULL;
+}
+
+static void *stream_writer(void *arg) {
+        struct stream *s;
+        uint8_t *b;     /* Bytes to write */
+        size_t n;       /* Number of them */
+        int ret;
+
+        s = (struct stream *)arg;
+        pthread_mutex_lock(&st_mtx);
+        for (;;) {
+                /* Wait for the connection, and something to do */
+                pthread_cleanup_push(st_unlock, NULL);
+                while ((ST_CONNECTING == s->state) || ((0 == s->len) &&
+                                        !s->shutwr && !s->broken)) {
+                        pthread_cond_wait(&st_cond, &st_mtx);
+                }
+                pthread_cleanup_pop(0);
+
+                /* Nothing more goes to a stream which didn't connect or
+                 * which has been given up on */
+                if ((ST_OPEN != s->state) || s->broken) {
+                        break;
+                }
+
+                /* Pass on shift's close once everything's written */
+                if (0 == s->len) {
+                        shutdown(s->fd, SHUT_WR);
+                        break;
+                }
+
+                /* Write as much as there is before the buffer wraps */
+                b = s->buf + s->head;
+                n = (STREAMBUFLEN - s->head < s->len) ?
+                        STREAMBUFLEN - s->head : s->len;
+                pthread_mutex_unlock(&st_mtx);
+                ret = send_all(s->fd, b, n);
+                pthread_mutex_lock(&st_mtx);
+                if (0 != ret) {
+                        s->broken = 1;
+                        shutdown(s->fd, SHUT_RDWR);
+                        break;
+                }
+                s->head = (s->head + n) % STREAMBUFLEN;
+                s->len -= n;
+
+                /* Let shift fill the room back up */
+                pthread_mutex_unlock(&st_mtx);
+                stream_grant(s->sess, s->id, n);
+                pthread_mutex_lock(&st_mtx);
+        }
+        s->wdone = 1;
+        pthread_mutex_unlock(&st_mtx);
+        return NULL;
+}
+
+static size_t stream_credit(struct stream *s) {
+        struct timespec ts;
+        size_t n;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += STREAMSNDTO;
+        pthread_mutex_lock(&st_mtx);
+        pthread_cleanup_push(st_unlock, NULL);
+        while ((0 == s->credit) && !s->broken) {
+                /* If shift's not taking any more, give up */
+                if (ETIMEDOUT == pthread_cond_timedwait(&st_cond, &st_mtx,
+                                        &ts)) {
+                        s->broken = 1;
+                        shutdown(s->fd, SHUT_RDWR);
+                        pthread_cond_broadcast(&st_cond);
+                }
+        }
+        n = 0;
+        if (!s->broken) {
+                n = (STREAMCHUNK < s->credit) ? STREAMCHUNK : s->credit;
+        }
+        pthread_cleanup_pop(1);
+        return n;
+}
+
+static void stream_grant(int sess, uint16_t id, uint32_t n) {
+        uint8_t b[STREAMHDRLEN + 4];
+
+        b[STREAMHDRLEN]     = (n >> 24) & 0xFF;
+        b[STREAMHDRLEN + 1] = (n >> 16) & 0xFF;
+        b[STREAMHDRLEN + 2] = (n >> 8) & 0xFF;
+        b[STREAMHDRLEN + 3] = n & 0xFF;
+        stream_put(sess, id, STREAM_WINDOW, b, 4);
+}
+
+static void st_unlock(void *unused) {
+        (void)unused;
+        pthread_mutex_unlock(&st_mtx);
+}
+
+static struct stream *stream_find(int sess, uint16_t id) {
+        int i;
+
+        for (i = 0; i < STREAMS; ++i) {
+                if ((-1 != streams[sess][i].fd) &&
+                                !streams[sess][i].retired &&
+                                (id == streams[sess][i].id)) {
+                        return &streams[sess][i];
+                }
+        }
+        return NULL;
+}
+
+static void stream_put(int sess, uint16_t id, uint8_t op, uint8_t *b,
+                size_t n) {
+        b[0] = (id >> 8) & 0xFF;
+        b[1] = id & 0xFF;
+        b[2] = op;
+        while (RET_ERR_QFULL == txq_put_one(sess, b, STREAMHDRLEN + n,
+                                STREAMREC)) {
+                usleep(STREAMWAIT);
+        }
+}
+
+static void stream_open(int sess, uint16_t id, const uint8_t *b, size_t n) {
+        struct stream *s;
+        struct sockaddr_in *sin;
+        struct sockaddr_in6 *sin6;
+        uint8_t hdr[STREAMHDRLEN];
+        int i;
+
+        /* Find a free slot */
+        stream_reap(sess);
+        s = NULL;
+        for (i = 0; i < STREAMS; ++i) {
+                if (-1 == streams[sess][i].fd) {
+                        s = &streams[sess][i];
+                        break;
+                }
+        }
+        if (NULL == s) {
+                goto FAIL;
+        }
+
+        /* Work out where to connect */
+        memset(&s->addr, 0, sizeof(s->addr));
+        if (2 + 4 == n) {
+                sin = (struct sockaddr_in *)&s->addr;
+                sin->sin_family = AF_INET;
+                memcpy(&sin->sin_port, b, 2);
+                memcpy(&sin->sin_addr, b + 2, 4);
+                s->addrlen = sizeof(*sin);
+        } else if (2 + 16 == n) {
+                sin6 = (struct sockaddr_in6 *)&s->addr;
+                sin6->sin6_family = AF_INET6;
+                memcpy(&sin6->sin6_port, b, 2);
+                memcpy(&sin6->sin6_addr, b + 2, 16);
+                s->addrlen = sizeof(*sin6);
+        } else {
+                goto FAIL;
+        }
+
+        /* The thread does the connecting */
+        if (-1 == (s->fd = socket(s->addr.ss_family, SOCK_STREAM, 0))) {
+                goto FAIL;
+        }
+        s->id = id;
+        s->state = ST_CONNECTING;
+        s->shutwr = 0;
+        s->broken = 0;
+        s->retired = 0;
+        s->done = 0;
+        s->wdone = 0;
+        s->head = 0;
+        s->len = 0;
+        s->credit = 0;
+        if (0 != start_thread(&s->wt, stream_writer, s)) {
+                close(s->fd);
+                s->fd = -1;
+                goto FAIL;
+        }
+        if (0 != start_thread(&s->t, stream_thread, s)) {
+                pthread_mutex_lock(&st_mtx);
+                s->state = ST_FAILED;
+                pthread_cond_broadcast(&st_cond);
+                pthread_mutex_unlock(&st_mtx);
+                pthread_join(s->wt, NULL);
+                close(s->fd);
+                s->fd = -1;
+                goto FAIL;
+        }
+        ++stream_opened;
+
+        /* Shift may send as much as the buffer holds */
+        stream_grant(sess, id, STREAMBUFLEN);
+        return;
+
+FAIL:
+        stream_put(sess, id, STREAM_CLOSE, hdr, 0);
+}
+
+static void stream_reap(int sess) {
+        struct stream *s;
+        int reap;
+
+        for (s = streams[sess]; s < streams[sess] + STREAMS; ++s) {
+                pthread_mutex_lock(&st_mtx);
+                reap = (-1 != s->fd) && s->done && s->wdone && s->shutwr;
+                pthread_mutex_unlock(&st_mtx);
+                if (reap) {
+                        stream_free(s);
+                }
+        }
+}
+
+static void stream_free(struct stream *s) {
+        pthread_join(s->t, NULL);
+        pthread_join(s->wt, NULL);
+        close(s->fd);
+        s->fd = -1;
+}
@@ -0,0 +1,64 @@
+/*
+ * stream.h
+ * Proxy TCP connections forwarded by shift
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HAVE_STREAM_H
+#define HAVE_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "session.h"
+
+/* A stream record starts with the stream's ID (2 bytes) and what it is (1
+ * byte), followed by the data for STREAM_DATA, the port (2 bytes) and IPv4
+ * or IPv6 address to connect to for STREAM_OPEN, or the number of bytes (4
+ * bytes) the other end may send for STREAM_WINDOW. */
+#define STREAMHDRLEN 3
+#define STREAM_OPEN   1 /* Connect to a remote host */
+#define STREAM_DATA   2 /* Bytes for the other end */
+#define STREAM_CLOSE  3 /* No more bytes from this end */
+#define STREAM_WINDOW 4 /* Room for more bytes from the other end */
+
+/* Number of streams opened */
+extern uint64_t stream_opened;
+
+/* Initialize the stream table and allocate the streams' buffers.  Must be
+ * called before any other stream_ function. */
+int stream_init(void);
+
+/* Get ready for the new session s.  Must be called before the session's
+ * records are sent. */
+void stream_start(struct session *s);
+
+/* Returns nonzero if the stream record queued with order qseq (see txq_get)
+ * was queued in the session s.  Records queued in an earlier session aren't
+ * sent. */
+int stream_current(struct session *s, uint64_t qseq);
+
+/* Handle the n-byte stream record at b from s's shift.  Returns 0 unless the
+ * record's no good. */
+int stream_record(struct session *s, uint8_t *b, size_t n);
+
+/* Close every one of s's streams, at the end of the session */
+void stream_stop(struct session *s);
+
+#endif /* HAVE_STREAM_H */
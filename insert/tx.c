@@ -3,7 +3,7 @@
  * Code for thread to send data to insert
  * by J. Stuart McMurray
  * created 20150212
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -20,126 +20,392 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/socket.h>
+
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+#include "arena.h"
+#include "cap.h"
 #include "comm.h"
+#include "crypto.h"
+#include "dedup.h"
+#include "flow.h"
+#include "gro.h"
 #include "insert.h"
+#include "queue.h"
+#include "rate.h"
 #include "retvals.h"
+#include "session.h"
 #include "sha2.h"
+#include "storm.h"
+#include "stream.h"
 #include "tx.h"
 
-/* Mutex to prevent concurrent sends */
-pthread_mutex_t txmutex;
-int txmutex_init = 0;
+/* What handle_packet needs to know about where a frame was captured */
+struct capctx {
+        pcap_t *p; /* Pcap handle */
+        int chan;  /* Channel, from 0 */
+};
 
+/* Flows and the storm buckets are shared by every channel's capture thread */
+static pthread_mutex_t cap_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-/* Get data from pcap, send to shift */
-void *insert_to_shift(void *data) {
-        struct its_data id;    /* Input data, pulled from the void* */
-        struct handle_data hd; /* Data for handle_frame */
-        int ret;               /* Return value */
-        int hret;              /* Return value from handler */
-
-        memset(&hd, 0, sizeof(hd));
-        ret = 0;
-        hret = 0;
-
-        /* Make sure the mutex is initialized */
-        if (!txmutex_init) {
-                pthread_mutex_init(&txmutex, NULL);
-                txmutex_init = 1;
-        }
+/* Capture frames forever on the channel in arg, cast from an int, queueing
+ * them to be sent to shift.  The capture is restarted if it fails. */
+void *capture(void *arg) {
+        struct capctx c; /* Handle and channel */
+        int nfail;       /* Number of consecutive failures */
+        int ret;         /* Return value */
 
-        /* Get a copy of the input data */
-        memcpy(&id, data, sizeof(id));
+        c.chan = (int)(intptr_t)arg;
+        nfail = 0;
+        for (;;) {
+                /* Start pcap going */
+                if (0 != (ret = pcap_setup(&c.p, c.chan))) {
+                        seterr(ret);
+                        backoff(nfail++);
+                        continue;
+                }
+                nfail = 0;
+                cap_set_handle(c.chan, c.p);
 
-        /* Data for handle_frame */
-        hd.p = id.p;
-        hd.fd = id.fd;
-        hd.ret = &hret;
-
-        /* Capture frames until an error occurs */
-        ret = pcap_loop(id.p, 0, handle_packet, (u_char*)&hd);
-        switch (ret) {
-                case -2: /* Explicit loop break */
-                        set_reterr(hret);
-                        return NULL;
-                        break;
-                case -1:
-                        set_reterr(RET_ERR_CAP);
-                        return NULL;
-                        break;
-                default:
-                        printf("Unknown pcap_loop return: %i\n", ret);
-                        set_reterr(RET_ERR_CAP);
-                        return NULL;
-                        break;
+                /* Capture frames a batch at a time until an error occurs,
+                 * stopping now and then to change the filter.  Super-frames
+                 * are queued at the end of each batch. */
+                while ((0 <= (ret = pcap_dispatch(c.p, -1, handle_packet,
+                                                        (u_char *)&c))) ||
+                                (-2 == ret)) {
+                        if (0 == c.chan) {
+                                gro_flush();
+                        }
+                        /* Frames shift sent may have made the filter stale
+                         * even if none were captured */
+                        cap_poll(c.chan, c.p);
+                        if ((-2 == ret) &&
+                                        (0 != (ret = cap_refilter(c.chan,
+                                                                  c.p)))) {
+                                seterr(ret);
+                        }
+                }
+                if (0 == c.chan) {
+                        gro_flush();
+                }
+                if (-1 != ret) {
+                        printf("Unknown pcap_dispatch return: %i\n", ret);
+                }
+                seterr(RET_ERR_CAP);
+
+                /* Start over */
+                cap_set_handle(c.chan, NULL);
+                pcap_close(c.p);
+                backoff(nfail++);
         }
 
         /* Shouldn't get here */
         return NULL;
 }
 
-/* Callback function for pcap_loop */
+/* Callback function for pcap_dispatch.  Queues the frame to be sent to every
+ * shift, or counts it if any of them wants flows. */
 void handle_packet(u_char *user, const struct pcap_pkthdr *header,
         const u_char *data) {
+        struct capctx *c; /* Handle and channel */
+        uint32_t len;     /* Bytes of the frame to send */
+        int pass;         /* Nonzero if the storm control lets it through */
 
-        uint8_t databuf[UINT16_MAX+sizeof(uint16_t)];
-                                   /* Buffer to hold the data */
-        uint8_t txhash[DIGESTLEN]; /* Hash of the data */
-        uint16_t len;              /* Size of the data */
-        struct handle_data hd;     /* User data passed in */
-        int ret;                   /* Return value */
+        c = (struct capctx *)user;
 
-        memset(txhash, 0, sizeof(txhash));
-        len = 0;
-        memcpy(&hd, user, sizeof(hd));
+        /* In flow mode, frames are counted, and only queued if another
+         * session wants them */
+        if (sess_any(OPT_FLOWS)) {
+                cap_poll(c->chan, c->p);
+                if (ETHHDRLEN <= header->caplen) {
+                        pthread_mutex_lock(&cap_mtx);
+                        flow_add(data, header->caplen, header->len,
+                                        &header->ts);
+                        pthread_mutex_unlock(&cap_mtx);
+                }
+                if (sess_all(OPT_FLOWS)) {
+                        return;
+                }
+        }
 
-        /* Make sure we captured the entire frame */
-        if (header->len != header->caplen) {
-                *hd.ret = RET_ERR_CSZS;
-                goto BREAK;
+        /* Make sure we captured the entire frame, unless it's to be cut
+         * down and a shift's happy with that.  Shifts which aren't don't
+         * get it. */
+        len = cap_keep(c->chan, header, data);
+        if ((header->len != len) && !sess_any(OPT_TRUNC)) {
+                seterr(RET_ERR_CSZS);
+                return;
         }
 
         /* Make sure frame isn't too large */
-        if (UINT16_MAX < header->len) {
-                *hd.ret = RET_ERR_CSZL;  
-                goto BREAK;
+        if (MAXFRAMELEN < len) {
+                seterr(RET_ERR_CSZL);
+                return;
         }
 
-        /* Copy the size to a buffer */
-        len = htons(header->len);
-        memcpy(databuf, &len, sizeof(len));
+        /* Or too small to be a frame.  Sizes that small mean other things
+         * to shift. */
+        if (ETHHDRLEN > len) {
+                return;
+        }
+
+        /* Swap in a new filter, if shift's been up to anything new */
+        cap_poll(c->chan, c->p);
+
+        /* Don't send shift back what it just sent us */
+        if (cap_is_echo(data, len)) {
+                return;
+        }
+
+        /* Keep background chatter from hogging the link */
+        pthread_mutex_lock(&cap_mtx);
+        pass = storm_pass(data, len, &header->ts);
+        pthread_mutex_unlock(&cap_mtx);
+        if (!pass) {
+                return;
+        }
+
+        /* Queue it up.  If the queue's full, it's dropped.  Frames from
+         * other channels go with their channel in the record. */
+        if (0 != c->chan) {
+                txq_put_chan(c->chan, data, len);
+                return;
+        }
+
+        /* Runs of TCP segments are merged, if every shift takes
+         * super-frames.  Anything else from a flow being merged goes after
+         * its super-frame. */
+        if (sess_all(OPT_GRO) && (header->len == len)) {
+                if (gro_add(data, len)) {
+                        return;
+                }
+        } else {
+                gro_flush();
+        }
+        txq_put(data, len, 0xFFFF < header->len ? 0xFFFF : header->len);
+}
+
+/* Send buffers, one per sending thread per session */
+static uint8_t *txbufs[MAXSESSIONS][TXTHREADS];
 
-        /* Copy the data to a buffer */
-        memcpy(databuf+sizeof(len), data, header->len);
+/* Frames are hashed (and encrypted, with indexed framing) by several threads
+ * at once, but sent in the order they were taken off the session's queue */
+static struct txorder {
+        uint64_t txnext;        /* Sequence number of the next frame to
+                                   send */
+        uint64_t txseq0;        /* Sequence number of the session's first */
+        uint64_t ddnext;        /* Sequence number of the next frame to
+                                   dedup */
+        pthread_mutex_t mtx;
+        pthread_cond_t cond;
+} txo[MAXSESSIONS];
 
-        /* Calculate hash */
-        sha224(databuf, header->len+sizeof(len), txhash);
+/* Blocks used to encrypt each record in indexed framing.  Every record gets
+ * room for the largest frame, so a record's block can be worked out from its
+ * sequence number alone. */
+#define RECBLOCKS NBLOCKS(sizeof(uint16_t) + TRUNCHDRLEN + MAXFRAMELEN + \
+                DIGESTLEN)
 
-        /* Lock the send lock */
-        pthread_mutex_lock(&txmutex);
+/* Where frames go in the send buffers.  A record is built backwards from the
+ * frame: the size (and for truncated frames, the real size and original
+ * length, and for other records, their size) and, with indexed framing, the
+ * header. */
+#define FRAMEOFF (INDEXHDRLEN + sizeof(uint16_t) + TRUNCHDRLEN)
 
+/* Unlock the txorder at o's mutex, for use as a cleanup handler */
+static void txo_unlock(void *o);
 
+/* Put n at b in network byte order */
+static void put16(uint8_t *b, uint16_t n);
 
-        /* Send the bits.  We're boned if anything else is sending */
-        if ((0 != (ret = send_enc(hd.fd, databuf, header->len+sizeof(len)))) ||
-                        (0 != (ret = send_enc(hd.fd, txhash,
-                                              sizeof(txhash))))) {
-                *hd.ret = ret;
-                goto BREAK;
+/* Allocate the send buffers */
+int tx_init(void) {
+        int i, j;
+
+        for (i = 0; i < MAXSESSIONS; ++i) {
+                for (j = 0; j < TXTHREADS; ++j) {
+                        if (NULL == (txbufs[i][j] =
+                                                arena_alloc(FRAMEBUFLEN))) {
+                                return RET_ENOMEM;
+                        }
+                }
+                pthread_mutex_init(&txo[i].mtx, NULL);
+                pthread_cond_init(&txo[i].cond, NULL);
         }
+        return 0;
+}
+
+/* Get ready for the new session s.  Must be called before the session's
+ * insert_to_shift threads are started. */
+void tx_start(struct session *s) {
+        struct txorder *o;
+
+        o = &txo[s->n];
+        o->txseq0 = o->txnext = o->ddnext = txq_next(s->n);
+        dedup_start(s);
+        stream_start(s);
+}
+
+/* Send queued frames to a shift.  TXTHREADS of these run at once per
+ * session. */
+void *insert_to_shift(void *data) {
+        struct its_data id;        /* Input data, pulled from the void* */
+        struct session *s;         /* Session to send to */
+        struct txorder *o;         /* Session's send order */
+        uint8_t *hdr;              /* Indexed framing header */
+        uint8_t *databuf;          /* Record: size, data, and hash */
+        uint8_t *frame;            /* Frame, in the record */
+        uint16_t len;              /* Size of the data */
+        uint16_t orig;             /* Size of the frame before truncation */
+        size_t reclen;             /* Size of the data, size, and hash */
+        int trunc;                 /* Nonzero for a truncated frame */
+        int rec;                   /* Nonzero for a record not a frame */
+        int skip;                  /* Nonzero if the record's not sent */
+        uint64_t seq;              /* Frame's sequence number */
+        uint64_t qseq;             /* Order in which it was queued */
+        uint64_t block;            /* Frame's first block */
+        int i;
+        int ret;                   /* Return value */
+
+        /* Get a copy of the input data */
+        memcpy(&id, data, sizeof(id));
+        s = id.s;
+        o = &txo[s->n];
+        frame = txbufs[s->n][id.n] + FRAMEOFF;
 
-        pthread_mutex_unlock(&txmutex);
+        for (;;) {
+                /* Wait for a frame */
+                len = txq_get(s->n, frame, &orig, &seq, &qseq);
 
+                /* Flow records counted for another session which wanted
+                 * them aren't any use to one which doesn't, and a session
+                 * which wants flow records doesn't want frames at all.
+                 * Stream records only make sense in the session they were
+                 * queued in, and truncated frames and super-frames only to a
+                 * session which asked for them. */
+                rec = (ETHHDRLEN > orig);
+                trunc = !rec && (orig != len);
+                if (FLOWREC == orig) {
+                        skip = !(s->options & OPT_FLOWS);
+                } else if (STREAMREC == orig) {
+                        skip = !(s->options & OPT_STREAMS) ||
+                                !stream_current(s, qseq);
+                } else if (CHANREC == orig) {
+                        skip = !(s->options & OPT_CHANNELS) ||
+                                (s->options & OPT_FLOWS);
+                } else if (GSOREC == orig) {
+                        skip = !(s->options & OPT_GRO) ||
+                                (s->options & OPT_FLOWS);
+                } else {
+                        skip = (s->options & OPT_FLOWS) ||
+                                (trunc && !(s->options & OPT_TRUNC));
+                }
 
-        /* Return success */
-        *hd.ret = 0;
-        return;
+                /* Prepend the size, and for a truncated frame, the real
+                 * size and the original length, or for other records, their
+                 * size */
+                if (rec) {
+                        databuf = frame - sizeof(len) - sizeof(len);
+                        put16(databuf, orig);
+                        put16(databuf + sizeof(len), len);
+                } else if (trunc) {
+                        databuf = frame - sizeof(len) - TRUNCHDRLEN;
+                        put16(databuf, TRUNCREC);
+                        put16(databuf + sizeof(len), len);
+                        put16(databuf + sizeof(len) + sizeof(len), orig);
+                } else {
+                        databuf = frame - sizeof(len);
+                        put16(databuf, len);
+                }
+                hdr = databuf - INDEXHDRLEN;
+
+                /* Append the hash */
+                reclen = (frame - databuf) + len;
+                sha224(databuf, reclen, databuf + reclen);
+                reclen += DIGESTLEN;
+
+                /* If shift has it cached, just send the hash.  The cache has
+                 * to be kept in the order frames are sent.  Truncated frames
+                 * and other records aren't cached. */
+                if (s->options & OPT_DEDUP) {
+                        pthread_mutex_lock(&o->mtx);
+                        pthread_cleanup_push(txo_unlock, o);
+                        while (seq != o->ddnext) {
+                                pthread_cond_wait(&o->cond, &o->mtx);
+                        }
+                        if (!trunc && !rec && !skip &&
+                                        dedup_check(s, frame + len)) {
+                                put16(databuf, DEDUPREF);
+                                memmove(frame, frame + len, DIGESTLEN);
+                                reclen = sizeof(len) + DIGESTLEN;
+                        }
+                        ++o->ddnext;
+                        pthread_cond_broadcast(&o->cond);
+                        pthread_cleanup_pop(1);
+                }
+
+                /* Don't send faster than we've been told to */
+                if (!skip) {
+                        rate_wait((!rec || CHANREC == orig ||
+                                                GSOREC == orig) ? RATE_FRAMES :
+                                        (STREAMREC == orig ? RATE_STREAMS :
+                                         RATE_OTHER), reclen);
+                }
+
+                /* With indexed framing, the record can be encrypted now */
+                if (s->options & OPT_INDEXED) {
+                        block = DATABLOCK + (seq - o->txseq0) * RECBLOCKS;
+                        txencrypt_at(s, databuf, reclen, block);
+                        for (i = 0; i < 8; ++i) {
+                                hdr[i] = (block >> (8 * (7 - i))) & 0xFF;
+                        }
+                        for (i = 0; i < 4; ++i) {
+                                hdr[8 + i] = (reclen >> (8 * (3 - i))) &
+                                        0xFF;
+                        }
+                }
+
+                /* Wait for our turn, and send the bits */
+                pthread_mutex_lock(&o->mtx);
+                pthread_cleanup_push(txo_unlock, o);
+                while (seq != o->txnext) {
+                        pthread_cond_wait(&o->cond, &o->mtx);
+                }
+                if (skip) {
+                        ret = 0;
+                } else if (s->options & OPT_INDEXED) {
+                        txhencrypt(s, hdr, INDEXHDRLEN);
+                        ret = send_all(s->fd, hdr, INDEXHDRLEN + reclen);
+                } else {
+                        ret = send_enc_inplace(s, databuf, reclen);
+                }
+                ++o->txnext;
+                pthread_cond_broadcast(&o->cond);
+                pthread_cleanup_pop(1);
+                if (0 != ret) {
+                        break;
+                }
+        }
+
+        /* Something bad happened, make sure the receive side notices */
+        set_reterr(s, ret);
+        shutdown(s->fd, SHUT_RDWR);
+        return NULL;
+}
+
+/* Put n at b in network byte order */
+static void put16(uint8_t *b, uint16_t n) {
+        b[0] = (n >> 8) & 0xFF;
+        b[1] = n & 0xFF;
+}
 
-        /* Something bad happened, stop the capture */
-BREAK:
-        pcap_breakloop(hd.p);
-        return;
+/* Unlock the txorder at o's mutex, for use as a cleanup handler */
+static void txo_unlock(void *o) {
+        pthread_mutex_unlock(&((struct txorder *)o)->mtx);
 }
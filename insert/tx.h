@@ -3,7 +3,7 @@
  * Code for thread to send data to insert
  * by J. Stuart McMurray
  * created 20150212
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2015 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -25,26 +25,30 @@
 
 #include <pcap.h>
 
+#include "session.h"
+
 /* Struct to pass data to insert_to_shift */
 struct its_data {
-        pcap_t *p; /* Pcap handle */
-        int fd;    /* File Descriptor for shift */
+        struct session *s; /* Session with shift */
+        int n;             /* Which thread this is, from 0 to TXTHREADS-1 */
 };
 
-/* Data to pass to handle_packet */
-struct handle_data {
-        pcap_t *p; /* Pcap handle */
-        int fd;    /* File descriptor for shift */
-        int *ret;  /* Return value from failed packet handle */
-};
+/* Capture frames forever on the channel in arg, cast from an int, queueing
+ * them to be sent to shift.  The capture is restarted if it fails. */
+extern void *capture(void *arg);
+
+/* Allocate the send buffers */
+extern int tx_init(void);
 
-/* Mutex to prevent multiple sends */
-extern pthread_mutex_t txmutex;
+/* Get ready for the new session s.  Must be called before the session's
+ * insert_to_shift threads are started. */
+extern void tx_start(struct session *s);
 
-/* Get data from pcap, send to shift */
+/* Send queued frames to a shift.  TXTHREADS of these run at once per
+ * session. */
 extern void *insert_to_shift(void *data);
 
-/* Callback function for pcap_loop */
+/* Callback function for pcap_dispatch */
 extern void handle_packet(u_char *user, const struct pcap_pkthdr *header,
         const u_char *data);
 
@@ -0,0 +1,110 @@
+package main
+
+/*
+ * chacha.go
+ * ChaCha20 keystream which can start at any block
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"encoding/binary"
+)
+
+/* Size of a ChaCha20 block */
+const chachaBlockLen = 64
+
+/* chachaStream is a ChaCha20 keystream (with a 64-bit nonce and counter, as
+in insert's chacha20_simple.c) which may start from any block.  It implements
+cipher.Stream. */
+type chachaStream struct {
+	state [16]uint32           /* Constants, key, counter, nonce */
+	buf   [chachaBlockLen]byte /* Current block of keystream */
+	off   int                  /* Bytes of buf already used */
+}
+
+/* newChaChaAt returns a keystream for key and nonce starting at block */
+func newChaChaAt(key [keyLen]byte, nonce [nonceLen]byte,
+	block uint64) *chachaStream {
+	s := &chachaStream{off: chachaBlockLen}
+	s.state[0] = 0x61707865 /* expand 32-byte k */
+	s.state[1] = 0x3320646e
+	s.state[2] = 0x79622d32
+	s.state[3] = 0x6b206574
+	for i := 0; i < 8; i++ {
+		s.state[4+i] = binary.LittleEndian.Uint32(key[4*i:])
+	}
+	s.state[12] = uint32(block)
+	s.state[13] = uint32(block >> 32)
+	s.state[14] = binary.LittleEndian.Uint32(nonce[0:])
+	s.state[15] = binary.LittleEndian.Uint32(nonce[4:])
+	return s
+}
+
+/* XORKeyStream xors src with the keystream into dst */
+func (s *chachaStream) XORKeyStream(dst, src []byte) {
+	for i := range src {
+		if chachaBlockLen == s.off {
+			s.next()
+		}
+		dst[i] = src[i] ^ s.buf[s.off]
+		s.off++
+	}
+}
+
+/* Make the next block of keystream and move the counter along */
+func (s *chachaStream) next() {
+	x := s.state
+	for i := 0; i < 10; i++ {
+		quarterRound(&x, 0, 4, 8, 12)
+		quarterRound(&x, 1, 5, 9, 13)
+		quarterRound(&x, 2, 6, 10, 14)
+		quarterRound(&x, 3, 7, 11, 15)
+		quarterRound(&x, 0, 5, 10, 15)
+		quarterRound(&x, 1, 6, 11, 12)
+		quarterRound(&x, 2, 7, 8, 13)
+		quarterRound(&x, 3, 4, 9, 14)
+	}
+	for i := range x {
+		binary.LittleEndian.PutUint32(s.buf[4*i:], x[i]+s.state[i])
+	}
+	s.off = 0
+
+	/* 64-bit counter */
+	s.state[12]++
+	if 0 == s.state[12] {
+		s.state[13]++
+	}
+}
+
+/* The ChaCha quarter round */
+func quarterRound(x *[16]uint32, a, b, c, d int) {
+	x[a] += x[b]
+	x[d] = rotl(x[d]^x[a], 16)
+	x[c] += x[d]
+	x[b] = rotl(x[b]^x[c], 12)
+	x[a] += x[b]
+	x[d] = rotl(x[d]^x[a], 8)
+	x[c] += x[d]
+	x[b] = rotl(x[b]^x[c], 7)
+}
+
+/* Rotate v left by n bits */
+func rotl(v uint32, n uint) uint32 {
+	return (v << n) | (v >> (32 - n))
+}
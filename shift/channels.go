@@ -0,0 +1,132 @@
+package main
+
+/*
+ * channels.go
+ * Tunnel devices for insert's other interfaces
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"crypto/sha256"
+	"encoding/binary"
+	"log"
+)
+
+/* A record with this size is a frame on a channel other than 0, which starts
+with its real size.  The channel comes before the frame. */
+const (
+	chanRec    = 5
+	chanHdrLen = 1
+)
+
+/* A frame read from one of the devices of a Channels */
+type chanFrame struct {
+	ch byte
+	f  Frame
+}
+
+/* Channels holds a tunnel device for each of insert's channels after the
+first, for the life of the program.  Channel 0 is the usual tunnel device. */
+type Channels struct {
+	tuns   []Tunnel       /* Channel n's device is tuns[n-1] */
+	fchans []chan Frame   /* Frames read from each device */
+	out    chan chanFrame /* Frames read from all of them */
+}
+
+/* NewChannels makes n tunnel devices, for channels 1 to n.  Frames read from
+them are held or dropped while there's no session (i.e. active is 0) as they
+are for channel 0. */
+func NewChannels(n int, hold bool, holdQ int, active *int32) (*Channels,
+	error) {
+	c := &Channels{out: make(chan chanFrame)}
+	for i := 1; i <= n; i++ {
+		tun, tunname, err := MakeTun()
+		if nil != err {
+			return nil, err
+		}
+		trackTun(tun)
+		log.Printf("Channel %v tunnel device: %v", i, tunname)
+		fchan := make(chan Frame, holdQ)
+		go holdFrames(tun, fchan, hold, active)
+		go c.merge(byte(i), fchan)
+		c.tuns = append(c.tuns, tun)
+		c.fchans = append(c.fchans, fchan)
+	}
+	return c, nil
+}
+
+/* Pass frames from fchan, for channel ch, to out */
+func (c *Channels) merge(ch byte, fchan chan Frame) {
+	for f := range fchan {
+		c.out <- chanFrame{ch: ch, f: f}
+	}
+	log.Printf("Channel %v closed", ch)
+}
+
+/* Out returns the channel of frames to send to insert.  A nil Channels' is
+nil, which blocks forever. */
+func (c *Channels) Out() chan chanFrame {
+	if nil == c {
+		return nil
+	}
+	return c.out
+}
+
+/* Tun returns channel ch's tunnel device, or nil if there isn't one */
+func (c *Channels) Tun(ch byte) Tunnel {
+	if nil == c || 0 == ch || len(c.tuns) < int(ch) {
+		return nil
+	}
+	return c.tuns[ch-1]
+}
+
+/* Deliver writes the frame in the channel record b from insert to its
+channel's device.  Frames for channels we don't have are dropped. */
+func (c *Channels) Deliver(b []byte) error {
+	if chanHdrLen > len(b) {
+		return nil
+	}
+	tun := c.Tun(b[0])
+	if nil == tun {
+		debug("Dropping frame for unknown channel %v", b[0])
+		return nil
+	}
+	return tun.Write(Frame(b[chanHdrLen:]))
+}
+
+/* Drain throws away any frames held for the channels */
+func (c *Channels) Drain() {
+	if nil == c {
+		return
+	}
+	for _, fchan := range c.fchans {
+		drainFrames(fchan)
+	}
+}
+
+/* Marshall returns the channel record for cf */
+func (cf chanFrame) Marshall() []byte {
+	rec := make([]byte, 4, 4+chanHdrLen+len(cf.f)+sha256.Size224)
+	binary.BigEndian.PutUint16(rec, chanRec)
+	binary.BigEndian.PutUint16(rec[2:], uint16(chanHdrLen+len(cf.f)))
+	rec = append(rec, cf.ch)
+	rec = append(rec, cf.f...)
+	sum := sha256.Sum224(rec)
+	return append(rec, sum[:]...)
+}
@@ -5,7 +5,7 @@ package main
  * Functions to communicate with insert
  * by J. Stuart McMurray
  * created 20150115
- * last modified 20150226
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -23,8 +23,12 @@ package main
  */
 
 import (
+	"crypto/cipher"
+	"crypto/rand"
 	"crypto/subtle"
+	"encoding/binary"
 	"fmt"
+	"github.com/codahale/chacha20"
 	"net"
 	"strconv"
 	"sync"
@@ -38,56 +42,186 @@ type Insert struct {
 	sim sync.Mutex /* Shift to Insert Send Lock */
 	isc *Cryptor   /* Insert to Shift Cryptor */
 	ism sync.Mutex /* Insert to Shift Receive Lock */
+
+	Options uint32 /* Options agreed on in the pipelined handshake */
+
+	resumed *TicketJar /* Set until a resumed handshake is finished */
+
+	indexed bool          /* True for indexed framing */
+	sich    cipher.Stream /* Shift to Insert record header stream */
+	isch    cipher.Stream /* Insert to Shift record header stream */
+	rxBlock uint64        /* Lowest block the next received record may use */
+
+	dedup   *DedupCache /* Frames insert may refer back to, or nil */
+	flows   *FlowLog    /* Where to write flow records, or nil */
+	fwd     *Forwarder  /* Forwarded connections, or nil */
+	streams *StreamMux  /* The session's forwarded connections, or nil */
+	pmtu    int         /* Largest IP packet insert's network takes, or 0 */
+	neigh   *NeighCache /* Known MAC addresses on insert's network, or nil */
+	chans   *Channels   /* Devices for channels after 0, or nil */
+}
+
+/* Options which may be asked for in the pipelined handshake.  See the file
+named protocol. */
+const (
+	OptIndexed  uint32 = 0x00000001 /* Indexed framing */
+	OptDedup    uint32 = 0x00000002 /* Dedup, see DedupOption */
+	OptTrunc    uint32 = 0x00000004 /* Truncated frames */
+	OptFlows    uint32 = 0x00000008 /* Flow records instead of frames */
+	OptStreams  uint32 = 0x00000010 /* Forwarded TCP streams */
+	OptChannels uint32 = 0x00000020 /* Frames from more than one interface */
+	OptGRO      uint32 = 0x00000040 /* Merged TCP segments */
+)
+
+/* A record with this size is a truncated frame, which starts with its real
+size and original length */
+const (
+	truncRec    = 2
+	truncHdrLen = 4
+)
+
+/* DedupOption returns the options to ask for a dedup cache of n frames, which
+must be no more than 65535 */
+func DedupOption(n int) uint32 {
+	return OptDedup | uint32(n)<<16
+}
+
+/* Size of the dedup cache in options o */
+func dedupLen(o uint32) int {
+	return int(o >> 16)
+}
+
+/* HandshakeParams holds what's needed to handshake with an insert */
+type HandshakeParams struct {
+	Junk    []byte       /* Initial junk to send */
+	Key     [keyLen]byte /* Encryption key */
+	Offset  int64        /* Time offset in seconds */
+	Name    string       /* Insert's install name */
+	NameLen uint         /* Length of chunk of data in which to put name */
+
+	Pipelined bool        /* Use the pipelined handshake */
+	Options   uint32      /* Options to ask for in the pipelined handshake */
+	Tickets   *TicketJar  /* Resumption tickets, or nil to not resume */
+	Skew      *SkewMemo   /* Time offsets for the pipelined handshake */
+	Flows     *FlowLog    /* Where to write flow records, with OptFlows */
+	Forwards  *Forwarder  /* Forwarded connections, with OptStreams */
+	PMTU      int         /* Largest IP packet insert's network takes, or 0 */
+	Neigh     *NeighCache /* Known MAC addresses on insert's network */
+	Chans     *Channels   /* Devices for channels after 0, with OptChannels */
+}
+
+/* Length of the options and ticket sent by insert in the pipelined
+handshake */
+const (
+	optionsLen = 4
+	ticketLen  = nonceLen + keyLen
+)
+
+/* How long to wait for insert to answer a resumed handshake */
+const resumeTimeout = 30 * time.Second
+
+/* Connector makes connections to insert, or accepts them from insert.  When
+listening, the listener is kept open between connections so that insert can
+reconnect without waiting on us. */
+type Connector struct {
+	tnet    string           /* Network, tcp, tcp4, or tcp6 */
+	addr    *net.TCPAddr     /* Address to which to connect or listen */
+	connect bool             /* True to connect, false to listen */
+	l       *net.TCPListener /* Listener, if listening */
 }
 
-/* Connect to Insert at addr (or optionally listening on addr if listen is
-true),  forcing IPv4 if force is 4, IPv6 is force is 6, or maintaining the
-default is force is 0, and handshake using the given junk, key, time offset,
-and name.  The returned Insert will be ready for two-way communications. */
-func NewInsert(
+/* NewConnector returns a Connector which will connect to addr (or listen on
+addr if connect is false), forcing IPv4 if force is 4, IPv6 is force is 6, or
+maintaining the default is force is 0. */
+func NewConnector(
 	addr string, /* Connect/listen address */
 	connect bool, /* True to connect, false to listen */
 	force int, /* Fore 4 for IPv4, 6 for IPv6, 0 for no forcing */
-	junk []byte, /* Initial junk to send */
-	key [keyLen]byte, /* Encryption key */
-	offset int64, /* Time offset in seconds */
-	name string, /* Insert's install name */
-	nLen uint, /* Length of chunk of data in which to put name */
-) (*Insert, error) {
-	/* Struct to return */
-	in := &Insert{}
+) (*Connector, error) {
+	/* Work out the network and address */
+	tnet, tcpAddr, err := resolveAddr(addr, force)
+	if nil != err {
+		return nil, err
+	}
+	cn := &Connector{tnet: tnet, addr: tcpAddr, connect: connect}
 
-	/* Work out whether to force IPv4 or IPv6 */
-	tnet := "tcp"
-	switch force {
-	case 0:
-		break
-	case 4:
-		tnet = "tcp4"
-	case 6:
-		tnet = "tcp6"
-	default:
-		return nil, fmt.Errorf("cannot is no IPv%v as it doesn't "+
-			"exist", force)
+	/* Start listening, if we're to listen */
+	if !connect {
+		debug("Listening on %v address %v", tnet, tcpAddr)
+		if cn.l, err = net.ListenTCP(tnet, tcpAddr); nil != err {
+			return nil, err
+		}
 	}
+	return cn, nil
+}
 
-	/* Make sure the address is a valid address */
-	tcpAddr, err := net.ResolveTCPAddr(tnet, addr)
+/* Conn makes a connection to insert, or waits for insert to connect */
+func (cn *Connector) Conn() (net.Conn, error) {
+	if cn.connect {
+		/* Try to connect to the client */
+		debug("Attempting a %v connection to %v", cn.tnet, cn.addr)
+		return net.DialTCP(cn.tnet, nil, cn.addr)
+	}
+	/* Get a connection */
+	return cn.l.Accept()
+}
+
+/* NewInsert makes a connection with Conn and handshakes with the given
+parameters.  The returned Insert will be ready for two-way communications. */
+func (cn *Connector) NewInsert(hp *HandshakeParams) (*Insert, error) {
+	c, err := cn.Conn()
 	if nil != err {
-		return nil, fmt.Errorf("resolving %v: %v", err)
+		return nil, err
+	}
+	return NewInsertFromConn(c, hp)
+}
+
+/* Addr returns the address on which the Connector is listening, or to which
+it connects */
+func (cn *Connector) Addr() net.Addr {
+	if nil != cn.l {
+		return cn.l.Addr()
 	}
+	return cn.addr
+}
 
-	/* Try to connect to Insert */
-	c, err := makeConnection(tnet, tcpAddr, connect)
+/* Close stops listening, if the Connector is listening */
+func (cn *Connector) Close() error {
+	if nil != cn.l {
+		return cn.l.Close()
+	}
+	return nil
+}
+
+/* Handshake with an insert on an already-established connection.  The
+connection will be closed on error. */
+func NewInsertFromConn(c net.Conn, hp *HandshakeParams) (*Insert, error) {
+	var (
+		in  *Insert
+		err error
+	)
+	if hp.Pipelined {
+		in, err = pipelinedHandshake(c, hp)
+	} else {
+		in, err = plainHandshake(c, hp)
+	}
 	if nil != err {
+		c.Close()
 		return nil, err
 	}
-	in.c = c
+	return in, nil
+}
+
+/* Handshake with an insert using the original handshake, which takes a round
+trip for the nonce and another for the name */
+func plainHandshake(c net.Conn, hp *HandshakeParams) (*Insert, error) {
+	/* Struct to return */
+	in := &Insert{c: c, pmtu: hp.PMTU, neigh: hp.Neigh}
 
 	/* Send Junk */
 	debug("Sending %v bytes of junk: %v",
-		len(junk), strconv.QuoteToASCII(string(junk)))
-	if err := in.sendAll(junk); nil != err {
+		len(hp.Junk), strconv.QuoteToASCII(string(hp.Junk)))
+	if err := in.sendAll(hp.Junk); nil != err {
 		return nil, err
 	}
 
@@ -96,7 +230,7 @@ func NewInsert(
 	if nil != err {
 		return nil, err
 	}
-	nonceTime := time.Now().Unix() + offset
+	nonceTime := time.Now().Unix() + hp.Offset
 	debug("Got nonce %02X for target time %v", nonce, nonceTime)
 
 	/* Make the nonce an array */
@@ -106,13 +240,13 @@ func NewInsert(
 	}
 
 	/* Make the cryptors */
-	in.sic, in.isc, err = NewCryptorPair(key, narr, nonceTime)
+	in.sic, in.isc, err = NewCryptorPair(hp.Key, narr, nonceTime)
 	if nil != err {
 		return nil, err
 	}
 
 	/* Exchange names */
-	if err := in.exchangeNames(name, nLen); nil != err {
+	if err := in.exchangeNames(hp.Name, hp.NameLen); nil != err {
 		return nil, err
 	}
 
@@ -120,24 +254,198 @@ func NewInsert(
 	return in, nil
 }
 
-/* Make a connection with the peer */
-func makeConnection(tnet string,
-	addr *net.TCPAddr,
-	connect bool) (net.Conn, error) {
-	/* Listen or connect, as appropriate */
-	if connect {
-		/* Try to connect to the client */
-		debug("Attempting a %v connection to %v", tnet, addr)
-		return net.DialTCP(tnet, nil, addr)
+/* Handshake with an insert using the pipelined handshake.  If there's a
+ticket for the insert, the session is resumed without waiting for insert at
+all, and the rest of the handshake is finished by FinishHandshake.  Otherwise,
+the junk, our nonce, and the encrypted name and options are sent all at once,
+and insert's nonce, the name, the agreed options, and a ticket are read
+back. */
+func pipelinedHandshake(c net.Conn, hp *HandshakeParams) (*Insert, error) {
+	in := &Insert{
+		c:     c,
+		flows: hp.Flows,
+		fwd:   hp.Forwards,
+		pmtu:  hp.PMTU,
+		neigh: hp.Neigh,
+		chans: hp.Chans,
+	}
+
+	/* Resume a session if we can */
+	if t, ok := hp.Tickets.Take(c.RemoteAddr()); ok {
+		debug("Resuming session with ticket %02X", t.ID)
+		var err error
+		in.sic, in.isc, err = NewCryptorPair(t.Secret, t.ID, 0)
+		if nil != err {
+				return nil, err
+		}
+		/* Insert will use the options from the ticket's session */
+		in.setOptions(t.Options)
+		if err := in.sendAll(append(append([]byte{}, hp.Junk...),
+			t.ID[:]...)); nil != err {
+			return nil, err
+		}
+		in.resumed = hp.Tickets
+		verbose("Resumed session")
+		return in, nil
+	}
+
+	/* Our half of the nonce */
+	var snonce [nonceLen]byte
+	if _, err := rand.Read(snonce[:]); nil != err {
+		return nil, err
 	}
-	/* Try to listen on the port */
-	debug("Listening on %v address %v", tnet, addr)
-	l, err := net.ListenTCP(tnet, addr)
+
+	/* The name and options are encrypted with a stream made from our half
+	of the nonce, so it doesn't matter what time insert thinks it is */
+	hnonce := snonce
+	hnonce[0] = (hnonce[0] & 0xFC) | 0x01
+	hs, err := chacha20.New(hp.Key[:], hnonce[:])
 	if nil != err {
 		return nil, err
 	}
-	/* Get a connection */
-	return l.Accept()
+	name := paddedName(hp.Name, hp.NameLen)
+	hello := make([]byte, len(name)+optionsLen)
+	copy(hello, name)
+	binary.BigEndian.PutUint32(hello[len(name):], hp.Options)
+	hs.XORKeyStream(hello, hello)
+
+	/* Send it all at once */
+	debug("Sending %v bytes of junk, nonce %02X, and name %v",
+		len(hp.Junk), snonce, strconv.QuoteToASCII(hp.Name))
+	flight := make([]byte, 0, len(hp.Junk)+len(snonce)+len(hello))
+	flight = append(flight, hp.Junk...)
+	flight = append(flight, snonce[:]...)
+	flight = append(flight, hello...)
+	if err := in.sendAll(flight); nil != err {
+		return nil, err
+	}
+
+	/* Get insert's half of the nonce */
+	inonce, err := in.recvAll(nonceLen)
+	if nil != err {
+		return nil, err
+	}
+	now := time.Now().Unix()
+	debug("Got nonce %02X at %v", inonce, now)
+	var narr [nonceLen]byte
+	for i := range narr {
+		narr[i] = inonce[i] ^ snonce[i]
+	}
+
+	/* Insert will have sent the name back encrypted with its idea of the
+	time, so find the time offset which makes it decrypt properly */
+	ename, err := in.recvAll(hp.NameLen)
+	if nil != err {
+		return nil, fmt.Errorf("receiving name: %v", err)
+	}
+	skew := hp.Skew
+	if nil == skew {
+		skew = NewSkewMemo(hp.Offset, 0)
+	}
+	in.sic, in.isc, _, err = skew.Search(c.RemoteAddr(), hp.Key, narr,
+		now, name, ename)
+	if nil != err {
+		return nil, err
+	}
+	verbose("Got name: %v", strconv.QuoteToASCII(hp.Name))
+
+	/* Get the options and ticket */
+	o, err := in.recvOptions(hp.Tickets)
+	if nil != err {
+		return nil, err
+	}
+	if 0 != o&0xFFFF&^hp.Options || dedupLen(o) > dedupLen(hp.Options) {
+		return nil, fmt.Errorf("insert agreed to options %08X, but "+
+			"only %08X were asked for", o, hp.Options)
+	}
+	in.setOptions(o)
+	return in, nil
+}
+
+/* Set the agreed options, and get ready to use them */
+func (in *Insert) setOptions(o uint32) {
+	in.Options = o
+	if 0 != o&OptIndexed {
+		in.indexed = true
+		in.sich = in.sic.At(hdrBlock)
+		in.isch = in.isc.At(hdrBlock)
+		in.rxBlock = dataBlock
+	}
+	if 0 != o&OptDedup && 0 < dedupLen(o) {
+		in.dedup = NewDedupCache(dedupLen(o))
+	}
+	debug("Options: %08X", o)
+}
+
+/* Indexed returns true if the session uses indexed framing */
+func (in *Insert) Indexed() bool {
+	return in.indexed
+}
+
+/* FinishHandshake reads the rest of a resumed handshake from insert.  It
+should be called before any frames are read.  It does nothing if the session
+wasn't resumed. */
+func (in *Insert) FinishHandshake() error {
+	if nil == in.resumed {
+		return nil
+	}
+	/* If insert didn't know the ticket, it'll wait for a name which
+	isn't coming */
+	in.c.SetReadDeadline(time.Now().Add(resumeTimeout))
+	o, err := in.recvOptions(in.resumed)
+	if nil != err {
+		return fmt.Errorf("resuming session: %v", err)
+	}
+	if o != in.Options {
+		return fmt.Errorf("resumed session has options %08X, not "+
+			"%08X", o, in.Options)
+	}
+	in.c.SetReadDeadline(time.Time{})
+	in.resumed = nil
+	return nil
+}
+
+/* Receive the agreed options and a new ticket, which is put in j */
+func (in *Insert) recvOptions(j *TicketJar) (uint32, error) {
+	b, err := in.RecvEnc(optionsLen + ticketLen)
+	if nil != err {
+		return 0, fmt.Errorf("receiving options and ticket: %v", err)
+	}
+	o := binary.BigEndian.Uint32(b)
+	var (
+		id     [nonceLen]byte
+		secret [keyLen]byte
+	)
+	copy(id[:], b[optionsLen:])
+	copy(secret[:], b[optionsLen+nonceLen:])
+	j.Put(in.RemoteAddr(), id, secret, o)
+	debug("Ticket: %02X", id)
+	return o, nil
+}
+
+/* Work out the network ("tcp", "tcp4", or "tcp6") to use and resolve addr
+with it, forcing IPv4 if force is 4, IPv6 if force is 6 */
+func resolveAddr(addr string, force int) (string, *net.TCPAddr, error) {
+	/* Work out whether to force IPv4 or IPv6 */
+	tnet := "tcp"
+	switch force {
+	case 0:
+		break
+	case 4:
+		tnet = "tcp4"
+	case 6:
+		tnet = "tcp6"
+	default:
+		return "", nil, fmt.Errorf("cannot is no IPv%v as it doesn't "+
+			"exist", force)
+	}
+
+	/* Make sure the address is a valid address */
+	tcpAddr, err := net.ResolveTCPAddr(tnet, addr)
+	if nil != err {
+		return "", nil, fmt.Errorf("resolving %v: %v", addr, err)
+	}
+	return tnet, tcpAddr, nil
 }
 
 /* Send/Receive the name with which insert was installed.  Closes the
@@ -145,9 +453,7 @@ connection on error. */
 func (in *Insert) exchangeNames(name string, nlen uint) error {
 
 	/* Null-pad our name out to insertNameLen bytes */
-	txnamelong := []byte(name)
-	txnamelong = append(txnamelong, make([]byte,
-		nlen-uint(len(txnamelong)))...)
+	txnamelong := paddedName(name, nlen)
 
 	/* Work out how many null-padded bytes there are */
 	txnameshort, txnulls := trimTrailingNulls(txnamelong)
@@ -166,19 +472,30 @@ func (in *Insert) exchangeNames(name string, nlen uint) error {
 	if nil != err {
 		return fmt.Errorf("receiving name: %v", err)
 	}
-	rxnameshort, rxnulls := trimTrailingNulls(rxnamelong)
+	rxnameshort, _ := trimTrailingNulls(rxnamelong)
 	verbose("Got name: %v", strconv.QuoteToASCII(string(rxnameshort)))
 
 	/* Make sure the two match */
-	if 1 != subtle.ConstantTimeCompare(txnamelong, rxnamelong) {
-		return fmt.Errorf("Received name (%v with %v trailing nulls) "+
-			"is different than expected (%v with %v trailing "+
-			"nulls)",
-			strconv.QuoteToASCII(string(rxnameshort)), rxnulls,
-			strconv.QuoteToASCII(string(txnameshort)), txnulls)
-	}
+	return checkName(txnamelong, rxnamelong)
+}
 
-	return nil
+/* Null-pad name out to nlen bytes */
+func paddedName(name string, nlen uint) []byte {
+	b := []byte(name)
+	return append(b, make([]byte, nlen-uint(len(b)))...)
+}
+
+/* Make sure the name received from insert, rx, is the one sent, tx */
+func checkName(tx, rx []byte) error {
+	if 1 == subtle.ConstantTimeCompare(tx, rx) {
+		return nil
+	}
+	txshort, txnulls := trimTrailingNulls(tx)
+	rxshort, rxnulls := trimTrailingNulls(rx)
+	return fmt.Errorf("Received name (%v with %v trailing nulls) "+
+		"is different than expected (%v with %v trailing nulls)",
+		strconv.QuoteToASCII(string(rxshort)), rxnulls,
+		strconv.QuoteToASCII(string(txshort)), txnulls)
 }
 
 /* Send all the bytes to insert */
@@ -293,3 +610,8 @@ func trimTrailingNulls(b []byte) ([]byte, int) {
 func (in *Insert) RemoteAddr() net.Addr {
 	return in.c.RemoteAddr()
 }
+
+/* Close the connection to insert */
+func (in *Insert) Close() error {
+	return in.c.Close()
+}
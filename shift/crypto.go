@@ -5,7 +5,7 @@ package main
  * Encrypt/decrypt functions
  * by J. Stuart McMurray
  * created 20150115
- * last modified 20150217
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -34,9 +34,26 @@ const (
 	keyLen   = chacha20.KeySize
 )
 
+/* Indexed framing.  Each record is preceded by a header, encrypted in order
+from block hdrBlock of the stream, holding the block from which the record
+itself is encrypted and the record's size.  Records are encrypted from block
+dataBlock onwards, leaving the blocks below for the handshake. */
+const (
+	hdrBlock    = uint64(1) << 63
+	dataBlock   = uint64(1) << 32
+	indexHdrLen = 8 + 4 /* Block and size */
+)
+
+/* Number of stream blocks needed for n bytes */
+func nBlocks(n int) uint64 {
+	return (uint64(n) + chachaBlockLen - 1) / chachaBlockLen
+}
+
 /* Our own idea of a Stream */
 type Cryptor struct {
 	cipher.Stream
+	key   [keyLen]byte   /* Key, for At */
+	nonce [nonceLen]byte /* Nonce (with the time), for At */
 }
 
 /* Generate the two crypt.Streams given the key, the nonce sent by insert, and
@@ -45,6 +62,18 @@ func NewCryptorPair(key [keyLen]byte, nonce [nonceLen]byte, when int64) (
 	stoi *Cryptor, /* Shift to Insert stream */
 	itos *Cryptor, /* Insert to Shift stream */
 	err error) {
+	stoi, itos, err = newCryptorPair(key, nonce, when)
+	if nil == err {
+		debug("Made keystreams from nonce %02X and time %v", nonce, when)
+	}
+	return
+}
+
+/* NewCryptorPair, but quietly, for trying lots of times */
+func newCryptorPair(key [keyLen]byte, nonce [nonceLen]byte, when int64) (
+	stoi *Cryptor, /* Shift to Insert stream */
+	itos *Cryptor, /* Insert to Shift stream */
+	err error) {
 
 	/* Generate the time-adjusted nonce */
 	timedNonce := make([]byte, 8)
@@ -56,7 +85,6 @@ func NewCryptorPair(key [keyLen]byte, nonce [nonceLen]byte, when int64) (
 		}
 		timedNonce[i] = n ^ byte((when>>(8*uint(i)))&0xFF)
 	}
-	debug("Time-adjusted nonce: %02X", timedNonce)
 
 	/* Make the cryptors */
 	timedNonce[0] &= 0xFC
@@ -64,17 +92,25 @@ func NewCryptorPair(key [keyLen]byte, nonce [nonceLen]byte, when int64) (
 	if nil != err {
 		return nil, nil, err
 	}
-	stoi = &Cryptor{s}
+	stoi = &Cryptor{Stream: s, key: key}
+	copy(stoi.nonce[:], timedNonce)
 	timedNonce[0] |= 0x03
 	i, err := chacha20.New(key[:], timedNonce)
 	if nil != err {
 		return nil, nil, err
 	}
-	itos = &Cryptor{i}
+	itos = &Cryptor{Stream: i, key: key}
+	copy(itos.nonce[:], timedNonce)
 	/* TODO: Make sure key is 32 bytes long early */
 	return
 }
 
+/* At returns a new stream which starts at the given block of c's stream, for
+indexed framing.  c itself is left alone. */
+func (c *Cryptor) At(block uint64) cipher.Stream {
+	return newChaChaAt(c.key, c.nonce, block)
+}
+
 /* Encrypt/Decrypt data */
 func (c *Cryptor) Crypt(d []byte) []byte {
 	o := make([]byte, len(d))
@@ -0,0 +1,86 @@
+package main
+
+/*
+ * dedup.go
+ * Cache of frames insert may refer back to
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"container/list"
+	"crypto/sha256"
+)
+
+/* Size of a record which refers to a cached frame */
+const dedupRef = 1
+
+/* DedupCache holds the frames most recently received from insert, by their
+checksums, in the same least-recently-used order insert keeps them in.  It's
+only used by rx's writer, so it's not locked. */
+type DedupCache struct {
+	max int                                    /* Most frames to hold */
+	l   *list.List                             /* Most recent first */
+	m   map[[sha256.Size224]byte]*list.Element /* Frames, by checksum */
+}
+
+/* A cached frame */
+type dedupEnt struct {
+	sum [sha256.Size224]byte
+	f   Frame
+}
+
+/* NewDedupCache makes a cache which holds up to max frames */
+func NewDedupCache(max int) *DedupCache {
+	return &DedupCache{
+		max: max,
+		l:   list.New(),
+		m:   make(map[[sha256.Size224]byte]*list.Element),
+	}
+}
+
+/* Add puts f, with checksum sum, in the cache as the most recently used,
+dropping the least recently used if the cache is full */
+func (c *DedupCache) Add(sum []byte, f Frame) {
+	var k [sha256.Size224]byte
+	copy(k[:], sum)
+	if e, ok := c.m[k]; ok {
+		e.Value.(*dedupEnt).f = f
+		c.l.MoveToFront(e)
+		return
+	}
+	if c.l.Len() >= c.max {
+		e := c.l.Back()
+		delete(c.m, e.Value.(*dedupEnt).sum)
+		c.l.Remove(e)
+	}
+	c.m[k] = c.l.PushFront(&dedupEnt{sum: k, f: f})
+}
+
+/* Get returns the frame with checksum sum and makes it the most recently
+used, or returns false if it's not in the cache */
+func (c *DedupCache) Get(sum []byte) (Frame, bool) {
+	var k [sha256.Size224]byte
+	copy(k[:], sum)
+	e, ok := c.m[k]
+	if !ok {
+		return nil, false
+	}
+	c.l.MoveToFront(e)
+	return e.Value.(*dedupEnt).f, true
+}
@@ -0,0 +1,100 @@
+package main
+
+/*
+ * flows.go
+ * Write flow records sent by insert
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"net"
+	"sync"
+)
+
+/* A record with this size is a batch of flow records, which starts with its
+real size */
+const flowRec = 3
+
+/* Size of a flow record.  See the file named protocol. */
+const flowRecLen = 80
+
+/* Errors which may be returned */
+var ErrorBadFlows = fmt.Errorf("flow records not a multiple of %v bytes",
+	flowRecLen)
+
+/* FlowLog writes flow records from any number of inserts, one per line, as
+IPFIX information element names and values */
+type FlowLog struct {
+	l sync.Mutex
+	w *bufio.Writer
+}
+
+/* NewFlowLog returns a FlowLog which writes to w */
+func NewFlowLog(w io.Writer) *FlowLog {
+	return &FlowLog{w: bufio.NewWriter(w)}
+}
+
+/* Write logs the batch of flow records b, from the insert at from */
+func (f *FlowLog) Write(from net.Addr, b []byte) error {
+	if 0 != len(b)%flowRecLen {
+		return ErrorBadFlows
+	}
+	f.l.Lock()
+	defer f.l.Unlock()
+	for ; 0 != len(b); b = b[flowRecLen:] {
+		r := b[:flowRecLen]
+		fmt.Fprintf(f.w, "exporter=%v flowStartMilliseconds=%v "+
+			"flowEndMilliseconds=%v destinationMacAddress=%v "+
+			"sourceMacAddress=%v ethernetType=0x%04X",
+			from,
+			binary.BigEndian.Uint64(r[64:]),
+			binary.BigEndian.Uint64(r[72:]),
+			net.HardwareAddr(r[0:6]),
+			net.HardwareAddr(r[6:12]),
+			binary.BigEndian.Uint16(r[12:]),
+		)
+		/* Only IP flows have the rest of the key */
+		switch r[15] {
+		case 4:
+			fmt.Fprintf(f.w, " protocolIdentifier=%v "+
+				"sourceIPv4Address=%v "+
+				"destinationIPv4Address=%v",
+				r[14], net.IP(r[16:20]), net.IP(r[32:36]))
+		case 6:
+			fmt.Fprintf(f.w, " protocolIdentifier=%v "+
+				"sourceIPv6Address=%v "+
+				"destinationIPv6Address=%v",
+				r[14], net.IP(r[16:32]), net.IP(r[32:48]))
+		}
+		if 0 != r[15] {
+			fmt.Fprintf(f.w, " sourceTransportPort=%v "+
+				"destinationTransportPort=%v",
+				binary.BigEndian.Uint16(r[48:]),
+				binary.BigEndian.Uint16(r[50:]))
+		}
+		fmt.Fprintf(f.w, " packetDeltaCount=%v octetDeltaCount=%v\n",
+			binary.BigEndian.Uint32(r[52:]),
+			binary.BigEndian.Uint64(r[56:]))
+	}
+	return f.w.Flush()
+}
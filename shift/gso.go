@@ -0,0 +1,122 @@
+package main
+
+/*
+ * gso.go
+ * Split up super-frames of TCP segments merged by insert
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"encoding/binary"
+	"fmt"
+)
+
+/* A record with this size is a super-frame of TCP segments merged by insert,
+which starts with its real size.  The segment size and number of segments (2
+bytes each) and each segment's TCP checksum come before the super-frame. */
+const (
+	gsoRec     = 6
+	gsoHdrLen  = 4
+	tcpFlagPSH = 0x08
+)
+
+/* ErrorBadGSO is returned for a super-frame which can't be split up */
+var ErrorBadGSO = fmt.Errorf("malformed super-frame")
+
+/* resegment splits the super-frame in the GSO record b back into the TCP
+segments insert captured, none of which may be bigger than maxLen.  There's no
+writing a super-frame to OpenBSD's tun device for the kernel to split up, so
+each segment is written on its own.  The segments' TCP checksums are the ones
+insert captured, and IPv4 header checksums are worked out again. */
+func resegment(b []byte, maxLen int) ([]Frame, error) {
+	if gsoHdrLen > len(b) {
+		return nil, ErrorBadGSO
+	}
+	mss := int(binary.BigEndian.Uint16(b))
+	nseg := int(binary.BigEndian.Uint16(b[2:]))
+	if 0 == mss || 2 > nseg || gsoHdrLen+2*nseg > len(b) {
+		return nil, ErrorBadGSO
+	}
+	sums := b[gsoHdrLen : gsoHdrLen+2*nseg]
+	f := b[gsoHdrLen+2*nseg:]
+
+	/* Insert only merges untagged IPv4 without options and IPv6 without
+	extension headers */
+	et, off := frameType(f)
+	v6 := 0x86DD == et
+	tcp := off + ipv4HdrLen
+	if v6 {
+		tcp = off + ipv6HdrLen
+	}
+	if 14 != off || tcp+tcpHdrLen > len(f) ||
+		(!v6 && (0x0800 != et || 0x45 != f[off])) ||
+		(v6 && 6 != f[off]>>4) {
+		return nil, ErrorBadGSO
+	}
+	hl := tcp + int(f[tcp+12]>>4)*4
+	if tcp+tcpHdrLen > hl || hl > len(f) {
+		return nil, ErrorBadGSO
+	}
+
+	/* Every segment but the last is full */
+	payload := f[hl:]
+	if len(payload) <= (nseg-1)*mss || len(payload) > nseg*mss {
+		return nil, ErrorBadGSO
+	}
+	if maxLen < hl+mss {
+		return nil, ErrorRXTooBig
+	}
+
+	seq := binary.BigEndian.Uint32(f[tcp+4:])
+	id := binary.BigEndian.Uint16(f[off+4:])
+	buf := make([]byte, nseg*hl+len(payload))
+	segs := make([]Frame, nseg)
+	for i := range segs {
+		p := payload[i*mss:]
+		if mss < len(p) {
+			p = p[:mss]
+		}
+		s := buf[:hl+len(p)]
+		buf = buf[len(s):]
+		copy(s, f[:hl])
+		copy(s[hl:], p)
+
+		/* Fix up the IP header */
+		if v6 {
+			binary.BigEndian.PutUint16(s[off+4:],
+				uint16(len(s)-off-ipv6HdrLen))
+		} else {
+			binary.BigEndian.PutUint16(s[off+2:], uint16(len(s)-off))
+			binary.BigEndian.PutUint16(s[off+4:], id+uint16(i))
+			binary.BigEndian.PutUint16(s[off+10:], 0)
+			binary.BigEndian.PutUint16(s[off+10:],
+				csum(0, s[off:off+ipv4HdrLen]))
+		}
+
+		/* And the TCP header.  Only the last segment may have been
+		pushed. */
+		binary.BigEndian.PutUint32(s[tcp+4:], seq+uint32(i*mss))
+		if nseg-1 != i {
+			s[tcp+13] &^= tcpFlagPSH
+		}
+		copy(s[tcp+16:tcp+18], sums[2*i:])
+		segs[i] = s
+	}
+	return segs, nil
+}
@@ -0,0 +1,243 @@
+package main
+
+/*
+ * mtu.go
+ * Keep packets within the MTU of insert's network
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import "encoding/binary"
+
+/* Sizes of the headers we care about */
+const (
+	ipv4HdrLen   = 20
+	ipv6HdrLen   = 40
+	tcpHdrLen    = 20
+	icmpHdrLen   = 8
+	ipv6MinMTU   = 1280
+	icmpv4Quote  = 8 /* Bytes of payload quoted after the IPv4 header */
+	tcpOptMSS    = 2
+	tcpOptEOL    = 0
+	tcpOptNOP    = 1
+	tcpFlagSYN   = 0x02
+	ipv4FlagDF   = 0x4000
+	ipProtoTCP   = 6
+	ipProtoICMP  = 1
+	ipProtoICMP6 = 58
+	hopLimit     = 64
+)
+
+/* fitMTU keeps the IP packet in f within mtu bytes.  TCP SYNs have their MSS
+clamped, in place, so the connection's packets will fit.  If f's too big and
+mustn't be fragmented, an ICMP error for its sender is returned, and f
+shouldn't be sent.  Otherwise nil is returned. */
+func fitMTU(f Frame, mtu int) Frame {
+	et, off := frameType(f)
+	switch et {
+	case 0x0800:
+		if off+ipv4HdrLen > len(f) || 4 != f[off]>>4 {
+			return nil
+		}
+		hl := int(f[off]&0x0F) * 4
+		tl := int(binary.BigEndian.Uint16(f[off+2:]))
+		if ipv4HdrLen > hl || off+tl > len(f) || hl > tl {
+			return nil
+		}
+		if ipProtoTCP == f[off+9] &&
+			0 == binary.BigEndian.Uint16(f[off+6:])&0x1FFF {
+			clampMSS(f[off+hl:off+tl], mtu-ipv4HdrLen-tcpHdrLen)
+		}
+		if tl > mtu &&
+			0 != binary.BigEndian.Uint16(f[off+6:])&ipv4FlagDF {
+			return fragNeeded4(f, off, hl, mtu)
+		}
+	case 0x86DD:
+		if off+ipv6HdrLen > len(f) || 6 != f[off]>>4 {
+			return nil
+		}
+		tl := ipv6HdrLen + int(binary.BigEndian.Uint16(f[off+4:]))
+		if off+tl > len(f) {
+			return nil
+		}
+		if ipProtoTCP == f[off+6] {
+			clampMSS(f[off+ipv6HdrLen:off+tl],
+				mtu-ipv6HdrLen-tcpHdrLen)
+		}
+		if tl > mtu {
+			return tooBig6(f, off, tl, mtu)
+		}
+	}
+	return nil
+}
+
+/* clampMSS lowers the MSS option in the TCP segment seg to mss, if it's a SYN
+with a bigger one, and fixes the checksum */
+func clampMSS(seg []byte, mss int) {
+	if tcpHdrLen > len(seg) || 0 == seg[13]&tcpFlagSYN || 0 >= mss {
+		return
+	}
+	hl := int(seg[12]>>4) * 4
+	if tcpHdrLen > hl || hl > len(seg) {
+		return
+	}
+	for i := tcpHdrLen; i < hl; {
+		switch seg[i] {
+		case tcpOptEOL:
+			return
+		case tcpOptNOP:
+			i++
+			continue
+		}
+		if i+1 >= hl || 2 > seg[i+1] || i+int(seg[i+1]) > hl {
+			return
+		}
+		if tcpOptMSS != seg[i] || 4 != seg[i+1] {
+			i += int(seg[i+1])
+			continue
+		}
+		old := binary.BigEndian.Uint16(seg[i+2:])
+		if int(old) <= mss {
+			return
+		}
+		binary.BigEndian.PutUint16(seg[i+2:], uint16(mss))
+		/* A value at an odd offset counts towards the checksum with
+		its bytes swapped */
+		o, n := old, uint16(mss)
+		if 1 == i%2 {
+			o, n = o>>8|o<<8, n>>8|n<<8
+		}
+		binary.BigEndian.PutUint16(seg[16:], csumUpdate(
+			binary.BigEndian.Uint16(seg[16:]), o, n))
+		return
+	}
+}
+
+/* frameType returns f's ethertype and the offset of its payload, skipping a
+VLAN tag.  The ethertype is 0 if f's too short. */
+func frameType(f Frame) (uint16, int) {
+	off := 12
+	if off+2 > len(f) {
+		return 0, 0
+	}
+	et := binary.BigEndian.Uint16(f[off:])
+	off += 2
+	if 0x8100 == et && off+4 <= len(f) {
+		et = binary.BigEndian.Uint16(f[off+2:])
+		off += 4
+	}
+	return et, off
+}
+
+/* csumUpdate returns the internet checksum sum, updated for a 16-bit word
+changing from o to n, per RFC 1624 */
+func csumUpdate(sum, o, n uint16) uint16 {
+	s := uint32(^sum) + uint32(^o) + uint32(n)
+	s = (s & 0xFFFF) + s>>16
+	s = (s & 0xFFFF) + s>>16
+	return ^uint16(s)
+}
+
+/* csum returns the internet checksum of b, starting from the partial sum s */
+func csum(s uint32, b []byte) uint16 {
+	for ; 1 < len(b); b = b[2:] {
+		s += uint32(binary.BigEndian.Uint16(b))
+	}
+	if 1 == len(b) {
+		s += uint32(b[0]) << 8
+	}
+	for 0xFFFF < s {
+		s = (s & 0xFFFF) + s>>16
+	}
+	return ^uint16(s)
+}
+
+/* replyHdr returns the start of a reply to f, whose payload is at off, with
+the MAC addresses swapped and room for a header of hl bytes and a message of n
+bytes */
+func replyHdr(f Frame, off, hl, n int) Frame {
+	r := make(Frame, off+hl+n)
+	copy(r, f[6:12])
+	copy(r[6:], f[:6])
+	copy(r[12:], f[12:off])
+	return r
+}
+
+/* fragNeeded4 returns an ICMP fragmentation needed message for f, an IPv4
+packet with a hl-byte header at off */
+func fragNeeded4(f Frame, off, hl, mtu int) Frame {
+	q := f[off:]
+	if len(q) > hl+icmpv4Quote {
+		q = q[:hl+icmpv4Quote]
+	}
+	r := replyHdr(f, off, ipv4HdrLen, icmpHdrLen+len(q))
+	ip := r[off:]
+	ip[0] = 0x45
+	binary.BigEndian.PutUint16(ip[2:], uint16(len(ip)))
+	ip[8] = hopLimit
+	ip[9] = ipProtoICMP
+	copy(ip[12:16], f[off+16:off+20])
+	copy(ip[16:20], f[off+12:off+16])
+	binary.BigEndian.PutUint16(ip[10:], csum(0, ip[:ipv4HdrLen]))
+	icmp := ip[ipv4HdrLen:]
+	icmp[0] = 3 /* Destination unreachable */
+	icmp[1] = 4 /* Fragmentation needed */
+	binary.BigEndian.PutUint16(icmp[6:], uint16(mtu))
+	copy(icmp[icmpHdrLen:], q)
+	binary.BigEndian.PutUint16(icmp[2:], csum(0, icmp))
+	return r
+}
+
+/* tooBig6 returns an ICMPv6 packet too big message for f, a tl-byte IPv6
+packet at off */
+func tooBig6(f Frame, off, tl, mtu int) Frame {
+	if ipv6MinMTU > mtu {
+		mtu = ipv6MinMTU
+	}
+	q := f[off : off+tl]
+	if max := ipv6MinMTU - ipv6HdrLen - icmpHdrLen; len(q) > max {
+		q = q[:max]
+	}
+	r := replyHdr(f, off, ipv6HdrLen, icmpHdrLen+len(q))
+	ip := r[off:]
+	ip[0] = 0x60
+	binary.BigEndian.PutUint16(ip[4:], uint16(icmpHdrLen+len(q)))
+	ip[6] = ipProtoICMP6
+	ip[7] = hopLimit
+	copy(ip[8:24], f[off+24:off+40])
+	copy(ip[24:40], f[off+8:off+24])
+	icmp := ip[ipv6HdrLen:]
+	icmp[0] = 2 /* Packet too big */
+	binary.BigEndian.PutUint32(icmp[4:], uint32(mtu))
+	copy(icmp[icmpHdrLen:], q)
+	binary.BigEndian.PutUint16(icmp[2:], icmp6Csum(ip))
+	return r
+}
+
+/* icmp6Csum returns the checksum of the ICMPv6 message after the IPv6 header
+ip, which must have its addresses and payload length set */
+func icmp6Csum(ip []byte) uint16 {
+	/* Pseudo-header: addresses, length, and next header */
+	var s uint32
+	for i := 8; i < ipv6HdrLen; i += 2 {
+		s += uint32(binary.BigEndian.Uint16(ip[i:]))
+	}
+	pl := int(binary.BigEndian.Uint16(ip[4:]))
+	s += uint32(pl) + ipProtoICMP6
+	return csum(s, ip[ipv6HdrLen:ipv6HdrLen+pl])
+}
@@ -0,0 +1,254 @@
+package main
+
+/*
+ * neigh.go
+ * Answer ARP and neighbor solicitations for insert's network locally
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"bytes"
+	"encoding/binary"
+	"net"
+	"sync"
+	"time"
+)
+
+/* ARP and neighbor discovery constants */
+const (
+	arpLen       = 28 /* Ethernet/IPv4 ARP message */
+	arpRequest   = 1
+	arpReply     = 2
+	ndSolicit    = 135
+	ndAdvert     = 136
+	ndLen        = 24 /* Solicitation or advertisement without options */
+	ndOptSrcLL   = 1
+	ndOptTgtLL   = 2
+	ndHopLimit   = 255
+	ndSolicited  = 0x40 /* Advertisement flags */
+	ndOverride   = 0x20
+	neighRefresh = time.Second /* Least time between refresh requests */
+)
+
+/* NeighCache remembers which MAC addresses hosts on insert's network have,
+from ARP and neighbor discovery messages insert sends, and answers requests
+from the kernel for them without waiting for the tunnel.  Once an entry's half
+way to expiring, requests are also sent to insert so a fresh reply refreshes
+it. */
+type NeighCache struct {
+	life time.Duration
+
+	l sync.Mutex
+	m map[string]*neigh /* Keyed by 4- or 16-byte IP address */
+}
+
+/* A cached neighbor */
+type neigh struct {
+	mac     net.HardwareAddr
+	learned time.Time /* When the last reply came in */
+	asked   time.Time /* When a request was last let through */
+}
+
+/* NewNeighCache returns a NeighCache whose entries last for life */
+func NewNeighCache(life time.Duration) *NeighCache {
+	return &NeighCache{life: life, m: make(map[string]*neigh)}
+}
+
+/* Learn remembers the sender's address if f, from insert, is an ARP or
+neighbor discovery message.  A nil NeighCache learns nothing. */
+func (c *NeighCache) Learn(f Frame) {
+	if nil == c {
+		return
+	}
+	et, off := frameType(f)
+	switch et {
+	case 0x0806:
+		a := f[off:]
+		if !isEthARP(a) {
+			return
+		}
+		c.add(a[14:18], a[8:14])
+	case 0x86DD:
+		ip, icmp := ndMsg(f, off)
+		if nil == icmp {
+			return
+		}
+		switch icmp[0] {
+		case ndSolicit:
+			/* DAD probes come from the unspecified address */
+			if !net.IP(ip[8:24]).IsUnspecified() {
+				c.add(ip[8:24], ndOption(icmp, ndOptSrcLL))
+			}
+		case ndAdvert:
+			c.add(icmp[8:24], ndOption(icmp, ndOptTgtLL))
+		}
+	}
+}
+
+/* Answer returns a reply for the kernel if f, read from tun, is an ARP
+request or neighbor solicitation for a cached address, or nil if not.  fwd is
+true if f should still be sent to insert. */
+func (c *NeighCache) Answer(f Frame) (r Frame, fwd bool) {
+	if nil == c {
+		return nil, true
+	}
+	et, off := frameType(f)
+	switch et {
+	case 0x0806:
+		a := f[off:]
+		if !isEthARP(a) || arpRequest != binary.BigEndian.Uint16(a[6:]) ||
+			bytes.Equal(a[14:18], a[24:28]) {
+			return nil, true
+		}
+		mac, fwd := c.lookup(a[24:28])
+		if nil == mac {
+			return nil, true
+		}
+		return arpAnswer(f, off, mac), fwd
+	case 0x86DD:
+		ip, icmp := ndMsg(f, off)
+		if nil == icmp || ndSolicit != icmp[0] ||
+			net.IP(ip[8:24]).IsUnspecified() {
+			return nil, true
+		}
+		mac, fwd := c.lookup(icmp[8:24])
+		if nil == mac {
+			return nil, true
+		}
+		return ndAnswer(f, off, icmp[8:24], mac), fwd
+	}
+	return nil, true
+}
+
+/* Cache mac for ip, if mac looks like a MAC address */
+func (c *NeighCache) add(ip, mac []byte) {
+	if macLen != len(mac) || net.IP(ip).IsUnspecified() ||
+		0 != mac[0]&0x01 {
+		return
+	}
+	c.l.Lock()
+	defer c.l.Unlock()
+	c.m[string(ip)] = &neigh{
+		mac:     append(net.HardwareAddr(nil), mac...),
+		learned: time.Now(),
+	}
+}
+
+/* Look up ip's MAC address.  Returns nil if it's not cached or has expired.
+fwd is true if the entry's due to be refreshed. */
+func (c *NeighCache) lookup(ip []byte) (mac net.HardwareAddr, fwd bool) {
+	c.l.Lock()
+	defer c.l.Unlock()
+	n, ok := c.m[string(ip)]
+	if !ok {
+		return nil, true
+	}
+	now := time.Now()
+	age := now.Sub(n.learned)
+	if age > c.life {
+		delete(c.m, string(ip))
+		return nil, true
+	}
+	if age > c.life/2 && now.Sub(n.asked) > neighRefresh {
+		n.asked = now
+		fwd = true
+	}
+	return n.mac, fwd
+}
+
+/* isEthARP returns true if a is an Ethernet/IPv4 ARP message */
+func isEthARP(a []byte) bool {
+	return arpLen <= len(a) &&
+		1 == binary.BigEndian.Uint16(a) &&
+		0x0800 == binary.BigEndian.Uint16(a[2:]) &&
+		macLen == a[4] && 4 == a[5]
+}
+
+/* ndMsg returns the IPv6 header and ICMPv6 message if the packet at off in f
+is a neighbor solicitation or advertisement, or nils if not */
+func ndMsg(f Frame, off int) (ip, icmp []byte) {
+	if off+ipv6HdrLen+ndLen > len(f) || 6 != f[off]>>4 {
+		return nil, nil
+	}
+	ip = f[off:]
+	/* Only on-link messages count */
+	pl := int(binary.BigEndian.Uint16(ip[4:]))
+	if ipProtoICMP6 != ip[6] || ndHopLimit != ip[7] || ndLen > pl ||
+		ipv6HdrLen+pl > len(ip) {
+		return nil, nil
+	}
+	icmp = ip[ipv6HdrLen : ipv6HdrLen+pl]
+	if (ndSolicit != icmp[0] && ndAdvert != icmp[0]) || 0 != icmp[1] {
+		return nil, nil
+	}
+	return ip, icmp
+}
+
+/* ndOption returns the link-layer address in the first option of type t in
+the neighbor discovery message icmp, or nil if there isn't one */
+func ndOption(icmp []byte, t byte) []byte {
+	for o := icmp[ndLen:]; 2 <= len(o); {
+		l := int(o[1]) * 8
+		if 0 == l || l > len(o) {
+			return nil
+		}
+		if t == o[0] && 2+macLen <= l {
+			return o[2 : 2+macLen]
+		}
+		o = o[l:]
+	}
+	return nil
+}
+
+/* arpAnswer returns an ARP reply from mac to the ARP request at off in f */
+func arpAnswer(f Frame, off int, mac net.HardwareAddr) Frame {
+	a := f[off:]
+	r := replyHdr(f, off, arpLen, 0)
+	copy(r[6:], mac)
+	b := r[off:]
+	copy(b, a[:6])
+	binary.BigEndian.PutUint16(b[6:], arpReply)
+	copy(b[8:], mac)
+	copy(b[14:], a[24:28])
+	copy(b[18:], a[8:18])
+	return r
+}
+
+/* ndAnswer returns a neighbor advertisement from mac for target in reply to
+the solicitation at off in f */
+func ndAnswer(f Frame, off int, target []byte, mac net.HardwareAddr) Frame {
+	r := replyHdr(f, off, ipv6HdrLen, ndLen+8)
+	copy(r[6:], mac)
+	ip := r[off:]
+	ip[0] = 0x60
+	binary.BigEndian.PutUint16(ip[4:], ndLen+8)
+	ip[6] = ipProtoICMP6
+	ip[7] = ndHopLimit
+	copy(ip[8:24], target)
+	copy(ip[24:40], f[off+8:off+24])
+	icmp := ip[ipv6HdrLen:]
+	icmp[0] = ndAdvert
+	icmp[4] = ndSolicited | ndOverride
+	copy(icmp[8:24], target)
+	icmp[ndLen] = ndOptTgtLL
+	icmp[ndLen+1] = 1
+	copy(icmp[ndLen+2:], mac)
+	binary.BigEndian.PutUint16(icmp[2:], icmp6Csum(ip))
+	return r
+}
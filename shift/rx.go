@@ -5,7 +5,7 @@ package main
  * Goroutine to receive data from insert
  * by J. Stuart McMurray
  * created 20150122
- * last modified 20150123
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -24,73 +24,414 @@ package main
 
 import (
 	"crypto/sha256"
+	"crypto/subtle"
 	"encoding/binary"
 	"fmt"
+	"runtime"
+	"sync"
+	"sync/atomic"
 )
 
 /* Errors which may be returned */
 var (
 	ErrorBadChecksum = fmt.Errorf("checksum mismatch")
 	ErrorRXTooBig    = fmt.Errorf("the received fram was langer than the tunnel allows")
+	ErrorBadIndex    = fmt.Errorf("bad indexed framing header")
+	ErrorBadRef      = fmt.Errorf("reference to a frame not in the " +
+		"dedup cache")
 )
 
-/* Read data from insert, send it to the tunnel */
+/* Number of records which may wait between each stage of the receive
+pipeline */
+const rxQueueLen = 64
+
+/* A record making its way through the receive pipeline */
+type rxJob struct {
+	sizen  []byte        /* Size, in network byte order */
+	data   []byte        /* Frame, or nil for a keepalive or reference */
+	rxhash []byte        /* Checksum sent by insert, or of the frame referred to */
+	ref    bool          /* True if the frame is in the dedup cache */
+	orig   int           /* Original length of a truncated frame, or 0 */
+	flows  bool          /* True if data is flow records, not a frame */
+	stream bool          /* True if data is a stream record, not a frame */
+	onChan bool          /* True if data is a channel record, not a frame */
+	gso    bool          /* True if data is a super-frame, not a frame */
+	segs   []Frame       /* A super-frame's segments, once it's checked */
+	raw    []byte        /* Still-encrypted record, with indexed framing */
+	block  uint64        /* First block of raw */
+	err    error         /* Set if the record's no good */
+	done   chan struct{} /* Closed when the record's been checked */
+}
+
+/* Read data from insert, send it to the tunnel.  Records are read (and, but
+for indexed framing, decrypted) in order by one goroutine, checked by a pool
+of others, and written to the tunnel in order by another. */
 func rx(tun Tunnel, in *Insert, echan chan error) {
+	/* A resumed session still has a bit of handshake to go */
+	if err := in.FinishHandshake(); nil != err {
+		echan <- err
+		return
+	}
+
+	var (
+		work  = make(chan *rxJob, rxQueueLen) /* To the checkers */
+		order = make(chan *rxJob, rxQueueLen) /* To the writer */
+		quit  = make(chan struct{})           /* Closed on error */
+		once  sync.Once
+		/* Number of times the reader waited on the checkers or
+		writer, and the writer waited on the checkers */
+		readStalls, checkStalls uint64
+	)
+	/* Only the first error is reported */
+	fail := func(err error) {
+		once.Do(func() {
+			close(quit)
+			echan <- err
+		})
+	}
+
+	for i := 0; i < runtime.NumCPU(); i++ {
+		go rxCheck(in, work, tun.MaxFrameLen())
+	}
+	go rxWrite(tun, order, in, fail, &checkStalls)
+
+	/* Read records until something goes wrong */
+	defer close(work)
+	defer close(order)
+	defer func() {
+		verbose("Receive stalls: reading %v, checking %v",
+			readStalls, atomic.LoadUint64(&checkStalls))
+	}()
 	for {
-		/* Read a size from insert */
-		sizen, err := in.RecvEnc(2)
+		j := &rxJob{done: make(chan struct{})}
+		var err error
+		if in.Indexed() {
+			j.block, j.raw, err = recvIndexed(in)
+		} else {
+			err = recvRecord(in, tun.MaxFrameLen(), j)
+		}
 		if nil != err {
-			echan <- err
+			fail(err)
 			return
 		}
 
-		/* Convert to host byte order */
-		sizeh := binary.BigEndian.Uint16(sizen)
+		/* Hand it to the writer and the checkers */
+		for _, c := range []chan *rxJob{order, work} {
+			select {
+			case c <- j:
+				continue
+			default:
+				readStalls++
+			}
+			select {
+			case c <- j:
+			case <-quit:
+				return
+			}
+		}
+	}
+}
 
-		/* Make sure it's not bigger than a frame */
-		if tun.MaxFrameLen() < int(sizeh) {
-			echan <- ErrorRXTooBig
-			return
+/* Decrypt (with indexed framing) and check records from work */
+func rxCheck(in *Insert, work chan *rxJob, maxLen int) {
+	for j := range work {
+		if nil != j.raw {
+			in.isc.At(j.block).XORKeyStream(j.raw, j.raw)
+			j.err = parseRecord(j.raw, maxLen, in.Options, j)
+		}
+		if nil == j.err && nil != j.data {
+			j.err = checkRecord(j.sizen, j.data, j.rxhash)
 		}
+		if nil == j.err && j.gso {
+			j.segs, j.err = resegment(j.data, maxLen)
+		}
+		close(j.done)
+	}
+}
 
-		/* Read that many bytes */
-		data, err := in.RecvEnc(uint(sizeh))
-		if nil != err {
-			echan <- err
+/* Write checked frames from order to tun, in order.  Frames are cached in
+in's dedup cache, if it has one, and references are looked up in it.  Flow
+records are written to in's flow log, stream records go to its streams,
+other channels' frames go to their own tunnel devices, and super-frames go to
+tun a segment at a time. */
+func rxWrite(
+	tun Tunnel,
+	order chan *rxJob,
+	in *Insert,
+	fail func(error),
+	stalls *uint64,
+) {
+	dc := in.dedup
+	for j := range order {
+		/* Wait for it to be checked */
+		select {
+		case <-j.done:
+		default:
+			atomic.AddUint64(stalls, 1)
+			<-j.done
+		}
+		if nil != j.err {
+			fail(j.err)
 			return
 		}
-		data = data[:sizeh]
+		/* Frame insert's sent before, which we should have */
+		if j.ref {
+			f, ok := dc.Get(j.rxhash)
+			if !ok {
+				fail(ErrorBadRef)
+				return
+			}
+			j.data = f
+		} else if nil == j.data {
+			/* Keepalive */
+			continue
+		} else if j.flows {
+			if err := in.flows.Write(in.RemoteAddr(),
+				j.data); nil != err {
+				fail(err)
+				return
+			}
+			continue
+		} else if j.stream {
+			if nil == in.streams {
+				continue
+			}
+			if err := in.streams.Deliver(j.data); nil != err {
+				fail(err)
+				return
+			}
+			continue
+		} else if j.onChan {
+			if err := in.chans.Deliver(j.data); nil != err {
+				fail(err)
+				return
+			}
+			continue
+		} else if j.gso {
+			/* Super-frames aren't cached */
+			for _, s := range j.segs {
+				if err := tun.Write(s); nil != err {
+					fail(err)
+					return
+				}
+			}
+			continue
+		} else if 0 != j.orig {
+			/* Truncated frames are written as they are, and not
+			cached */
+			debug("Truncated frame: %v of %v bytes", len(j.data),
+				j.orig)
+		} else if nil != dc {
+			dc.Add(j.rxhash, j.data)
+		}
+		/* Send frame to the kernel */
+		in.neigh.Learn(j.data)
+		if err := tun.Write(j.data); nil != err {
+			fail(err)
+			return
+		}
+	}
+}
+
+/* Make sure rxhash is the checksum of sizen and data */
+func checkRecord(sizen, data, rxhash []byte) error {
+	/* Compute the local checksum */
+	h := sha256.New224()
+	h.Write(sizen)
+	h.Write(data)
+	exhashS := h.Sum(nil)
 
-		/* Read the checksum */
-		rxhash, err := in.RecvEnc(sha256.Size224)
+	/* Verify checksum in constant time */
+	if 1 != subtle.ConstantTimeCompare(exhashS, rxhash) {
+		return ErrorBadChecksum
+	}
+	return nil
+}
+
+/* Read a record from insert's continuous stream into j's size, data and
+checksum */
+func recvRecord(in *Insert, maxLen int, j *rxJob) error {
+	/* Read a size from insert */
+	sizen, err := in.RecvEnc(2)
+	if nil != err {
+		return err
+	}
+	j.sizen = sizen
+
+	/* Convert to host byte order */
+	sizeh := binary.BigEndian.Uint16(sizen)
 
+	switch {
+	case 0 != in.Options&OptDedup && dedupRef == sizeh:
+		/* A reference is just the cached frame's checksum */
+		j.ref = true
+		j.rxhash, err = in.RecvEnc(sha256.Size224)
+		return err
+	case 0 != in.Options&OptTrunc && truncRec == sizeh:
+		/* The real size and original length come next, and are
+		checksummed along with the size */
+		th, err := in.RecvEnc(truncHdrLen)
 		if nil != err {
-			echan <- err
-			return
+			return err
 		}
-
-		/* Compute the local checksum */
-		exhashA := sha256.Sum224(append(sizen, data...))
-		/* Turn into a slice */
-		exhashS := make([]byte, len(exhashA))
-		for i := 0; i < len(exhashA); i++ {
-			exhashS[i] = exhashA[i]
+		j.sizen = append(sizen, th...)
+		sizeh = binary.BigEndian.Uint16(th)
+		j.orig = int(binary.BigEndian.Uint16(th[2:]))
+	case 0 != in.Options&OptFlows && flowRec == sizeh,
+		0 != in.Options&OptStreams && streamRec == sizeh:
+		/* The real size comes next, and is checksummed along with the
+		size.  Flow and stream records don't go to the tunnel, so may
+		be bigger than a frame. */
+		fh, err := in.RecvEnc(2)
+		if nil != err {
+			return err
 		}
-
-		/* Verify checksum in constant time */
-		diff := 0
-		for i := 0; i < len(rxhash); i++ {
-			if exhashS[i] != rxhash[i] {
-				diff |= 1
-			}
+		j.sizen = append(sizen, fh...)
+		j.flows = flowRec == sizeh
+		j.stream = streamRec == sizeh
+		sizeh = binary.BigEndian.Uint16(fh)
+	case 0 != in.Options&OptChannels && chanRec == sizeh:
+		/* The real size comes next, and is checksummed along with the
+		size, then the channel */
+		ch, err := in.RecvEnc(2)
+		if nil != err {
+			return err
 		}
-		if 0 != diff {
-			echan <- ErrorBadChecksum
+		j.sizen = append(sizen, ch...)
+		j.onChan = true
+		sizeh = binary.BigEndian.Uint16(ch)
+		maxLen += chanHdrLen
+	case 0 != in.Options&OptGRO && gsoRec == sizeh:
+		/* The real size comes next, and is checksummed along with the
+		size.  It's the segments which have to fit in a frame. */
+		gh, err := in.RecvEnc(2)
+		if nil != err {
+			return err
 		}
+		j.sizen = append(sizen, gh...)
+		j.gso = true
+		sizeh = binary.BigEndian.Uint16(gh)
+	}
 
-		/* Send frame to the kernel */
-		if err := tun.Write(data); nil != err {
-			echan <- err
+	/* Make sure it's not bigger than a frame */
+	if !j.flows && !j.stream && !j.gso && maxLen < int(sizeh) {
+		return ErrorRXTooBig
+	}
+
+	/* Read that many bytes */
+	data, err := in.RecvEnc(uint(sizeh))
+	if nil != err {
+		return err
+	}
+	j.data = data[:sizeh]
+
+	/* Read the checksum */
+	j.rxhash, err = in.RecvEnc(sha256.Size224)
+	return err
+}
+
+/* Largest record insert sends with indexed framing, a truncated frame of the
+largest size with its sizes and checksum */
+const maxIndexedLen = 2 + truncHdrLen + 0xFFFF + sha256.Size224
+
+/* Read a record with indexed framing from insert, returning its first block
+and the record, still encrypted */
+func recvIndexed(in *Insert) (block uint64, raw []byte, err error) {
+	/* Work out where the record is */
+	hdr, err := in.recvAll(indexHdrLen)
+	if nil != err {
+		return
+	}
+	in.isch.XORKeyStream(hdr, hdr)
+	block = binary.BigEndian.Uint64(hdr)
+	n := int(binary.BigEndian.Uint32(hdr[8:]))
+	/* Blocks may never be used twice, nor may records wander into the
+	header blocks or be bigger than any insert sends */
+	if maxIndexedLen < n || block < in.rxBlock || hdrBlock <= block ||
+		hdrBlock <= block+nBlocks(n) {
+		err = ErrorBadIndex
+		return
+	}
+	in.rxBlock = block + nBlocks(n)
+
+	/* Get the record */
+	raw, err = in.recvAll(uint(n))
+	return
+}
+
+/* Split a decrypted record into j's size, data and checksum.  j's data is
+left nil for keepalives and references to cached frames.  opts are the
+session's options. */
+func parseRecord(rec []byte, maxLen int, opts uint32, j *rxJob) error {
+	if 2 > len(rec) {
+		return ErrorBadIndex
+	}
+	hl := 2 /* Length of the checksummed header */
+	sizeh := int(binary.BigEndian.Uint16(rec))
+
+	switch {
+	case 0 == sizeh:
+		/* Keepalive */
+		if 4 > len(rec) || len(rec) != 4+
+			int(binary.BigEndian.Uint16(rec[2:])) {
+			return ErrorBadIndex
+		}
+		j.sizen = rec[:2]
+		return nil
+	case 0 != opts&OptDedup && dedupRef == sizeh:
+		/* Reference to a cached frame */
+		if len(rec) != 2+sha256.Size224 {
+			return ErrorBadIndex
+		}
+		j.sizen = rec[:2]
+		j.ref = true
+		j.rxhash = rec[2:]
+		return nil
+	case 0 != opts&OptTrunc && truncRec == sizeh:
+		/* Truncated frame, with its real size and original length */
+		hl += truncHdrLen
+		if hl > len(rec) {
+			return ErrorBadIndex
+		}
+		sizeh = int(binary.BigEndian.Uint16(rec[2:]))
+		j.orig = int(binary.BigEndian.Uint16(rec[4:]))
+	case 0 != opts&OptFlows && flowRec == sizeh,
+		0 != opts&OptStreams && streamRec == sizeh:
+		/* Flow or stream records, with their real size */
+		hl += 2
+		if hl > len(rec) {
+			return ErrorBadIndex
+		}
+		j.flows = flowRec == sizeh
+		j.stream = streamRec == sizeh
+		sizeh = int(binary.BigEndian.Uint16(rec[2:]))
+	case 0 != opts&OptChannels && chanRec == sizeh:
+		/* Another channel's frame, with its real size */
+		hl += 2
+		if hl > len(rec) {
+			return ErrorBadIndex
 		}
+		j.onChan = true
+		sizeh = int(binary.BigEndian.Uint16(rec[2:]))
+		maxLen += chanHdrLen
+	case 0 != opts&OptGRO && gsoRec == sizeh:
+		/* Merged TCP segments, with their real size */
+		hl += 2
+		if hl > len(rec) {
+			return ErrorBadIndex
+		}
+		j.gso = true
+		sizeh = int(binary.BigEndian.Uint16(rec[2:]))
+	}
+
+	if !j.flows && !j.stream && !j.gso && maxLen < sizeh {
+		return ErrorRXTooBig
+	}
+	if len(rec) != hl+sizeh+sha256.Size224 {
+		return ErrorBadIndex
 	}
+	j.sizen = rec[:hl]
+	j.data = rec[hl : hl+sizeh]
+	j.rxhash = rec[hl+sizeh:]
+	return nil
 }
@@ -0,0 +1,135 @@
+package main
+
+/*
+ * sealer.go
+ * Encrypt records on many cores for indexed framing
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"crypto/sha256"
+	"encoding/binary"
+	"sync"
+)
+
+/* A record waiting to be encrypted and sent with indexed framing */
+type sealJob struct {
+	f     Frame       /* Frame to marshall, or nil */
+	b     []byte      /* Already-marshalled record, if f is nil */
+	block uint64      /* First block of the record */
+	done  chan []byte /* Gets the header and encrypted record */
+}
+
+/* Sealer hashes and encrypts records for an insert using indexed framing on
+several goroutines at once, and writes them to insert in the order they were
+sent. */
+type Sealer struct {
+	in    *Insert       /* Insert to which to send records */
+	jobs  chan *sealJob /* Records for the workers */
+	order chan *sealJob /* Records for the writer, in order */
+	block uint64        /* First block for the next record */
+	err   error         /* Error writing to insert */
+	errL  sync.Mutex    /* Lock for err */
+}
+
+/* NewSealer starts n workers and a writer for in, which must be using
+indexed framing.  Up to n records may be queued. */
+func NewSealer(in *Insert, n int) *Sealer {
+	s := &Sealer{
+		in:    in,
+		jobs:  make(chan *sealJob, n),
+		order: make(chan *sealJob, n),
+		block: dataBlock,
+	}
+	for i := 0; i < n; i++ {
+		go s.work()
+	}
+	go s.write()
+	return s
+}
+
+/* SendFrame queues f to be marshalled, encrypted and sent.  It returns an
+error if a previous record couldn't be sent. */
+func (s *Sealer) SendFrame(f Frame) error {
+	return s.send(&sealJob{f: f}, 2+len(f)+sha256.Size224)
+}
+
+/* SendRecord queues the marshalled record b to be encrypted and sent.  It
+returns an error if a previous record couldn't be sent. */
+func (s *Sealer) SendRecord(b []byte) error {
+	return s.send(&sealJob{b: b}, len(b))
+}
+
+/* Give j, which is n bytes long, its blocks and queue it */
+func (s *Sealer) send(j *sealJob, n int) error {
+	s.errL.Lock()
+	err := s.err
+	s.errL.Unlock()
+	if nil != err {
+		return err
+	}
+	j.block = s.block
+	s.block += nBlocks(n)
+	j.done = make(chan []byte, 1)
+	s.order <- j
+	s.jobs <- j
+	return nil
+}
+
+/* Close stops the workers and writer once the queued records are done */
+func (s *Sealer) Close() {
+	close(s.jobs)
+	close(s.order)
+}
+
+/* Marshall and encrypt records */
+func (s *Sealer) work() {
+	for j := range s.jobs {
+		b := j.b
+		if nil != j.f {
+			var err error
+			if b, err = j.f.Marshall(); nil != err {
+				/* Can't happen, tx checks the size */
+				b = nil
+			}
+		}
+		rec := make([]byte, indexHdrLen+len(b))
+		binary.BigEndian.PutUint64(rec, j.block)
+		binary.BigEndian.PutUint32(rec[8:], uint32(len(b)))
+		s.in.sic.At(j.block).XORKeyStream(rec[indexHdrLen:], b)
+		j.done <- rec
+	}
+}
+
+/* Write records to insert in order, encrypting their headers */
+func (s *Sealer) write() {
+	for j := range s.order {
+		rec := <-j.done
+		/* After an error, just keep the queue moving */
+		if nil != s.err {
+			continue
+		}
+		s.in.sich.XORKeyStream(rec[:indexHdrLen], rec[:indexHdrLen])
+		if err := s.in.sendAll(rec); nil != err {
+			s.errL.Lock()
+			s.err = err
+			s.errL.Unlock()
+		}
+	}
+}
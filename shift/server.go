@@ -0,0 +1,142 @@
+package main
+
+/*
+ * server.go
+ * Serve many inserts from one shift
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"log"
+	"net"
+	"sync"
+	"time"
+)
+
+/* How long an insert may take to handshake, so one which connects and goes
+quiet doesn't hold a session slot forever */
+const serverHandshakeTimeout = 30 * time.Second
+
+/* ServerConfig holds the settings for serving many inserts */
+type ServerConfig struct {
+	Addr    string           /* Listen address */
+	Force   int              /* 4 for IPv4, 6 for IPv6, 0 for either */
+	HP      *HandshakeParams /* Handshake parameters */
+	Shared  Tunnel           /* Shared tunnel device, or nil for one each */
+	MaxSess int              /* Maximum number of concurrent sessions */
+	QLen    int              /* Per-session queued frames */
+	MaxMACs int              /* Per-session learned MAC addresses */
+	MinWait time.Duration    /* Minimum idle time before a keepalive */
+	MaxWait time.Duration    /* Maximum idle time before a keepalive */
+}
+
+/* Serve listens on conf.Addr and handles each insert which connects in its
+own goroutines until the listener fails. */
+func Serve(conf *ServerConfig) error {
+	/* Listen for inserts */
+	cn, err := NewConnector(conf.Addr, false, conf.Force)
+	if nil != err {
+		return err
+	}
+	defer cn.Close()
+	log.Printf("Listening for inserts on %v", cn.Addr())
+
+	/* Switch for the shared tunnel, if we have one */
+	var sw *Switch
+	if nil != conf.Shared {
+		sw = NewSwitch(conf.Shared)
+	}
+
+	/* Number of sessions in progress */
+	var (
+		nSess  int
+		nSessL sync.Mutex
+	)
+
+	for {
+		c, err := cn.Conn()
+		if nil != err {
+			return err
+		}
+
+		/* Don't take on too many */
+		nSessL.Lock()
+		if nSess >= conf.MaxSess {
+			nSessL.Unlock()
+			log.Printf("[%v] Refusing connection, already have %v "+
+				"sessions", c.RemoteAddr(), conf.MaxSess)
+			c.Close()
+			continue
+		}
+		nSess++
+		nSessL.Unlock()
+
+		go func() {
+			serveOne(c, conf, sw)
+			nSessL.Lock()
+			nSess--
+			nSessL.Unlock()
+		}()
+	}
+}
+
+/* Handshake with and proxy frames for one insert */
+func serveOne(c net.Conn, conf *ServerConfig, sw *Switch) {
+	name := c.RemoteAddr().String()
+	verbose("[%v] Connected", name)
+
+	/* Handshake */
+	c.SetDeadline(time.Now().Add(serverHandshakeTimeout))
+	in, err := NewInsertFromConn(c, conf.HP)
+	if nil != err {
+		log.Printf("[%v] Handshake failed: %v", name, err)
+		return
+	}
+	defer in.Close()
+	c.SetDeadline(time.Time{})
+
+	/* Get a tunnel for this insert */
+	var tun Tunnel
+	if nil != sw {
+		tun = sw.Attach(name, conf.QLen, conf.MaxMACs)
+	} else {
+		t, tunname, err := MakeTun()
+		if nil != err {
+			log.Printf("[%v] Unable to make tun device: %v",
+				name, err)
+			return
+		}
+		trackTun(t)
+		defer untrackTun(t)
+		log.Printf("[%v] Tunnel device: %v", name, tunname)
+		tun = t
+	}
+	defer tun.Close()
+	log.Printf("[%v] Session started", name)
+
+	/* Read frames from the tunnel for as long as the session lasts */
+	fchan := make(chan Frame)
+	rdone := make(chan struct{})
+	defer close(rdone)
+	go readIntoChan(tun, fchan, rdone)
+
+	/* Proxy frames until something goes wrong */
+	err = runSession(tun, fchan, in, conf.MinWait, conf.MaxWait)
+	log.Printf("[%v] Session ended: %v", name, err)
+}
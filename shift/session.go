@@ -0,0 +1,130 @@
+package main
+
+/*
+ * session.go
+ * Run sessions with insert, and keep the tunnel going between them
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"log"
+	"math/rand"
+	"sync/atomic"
+	"time"
+)
+
+/* Run tx and rx for a session with in until one of them fails, sending
+frames read from fchan and writing received frames to tun.  The connection to
+insert is closed before returning. */
+func runSession(
+	tun Tunnel,
+	fchan chan Frame,
+	in *Insert,
+	minWait time.Duration,
+	maxWait time.Duration,
+) error {
+	/* One error from each of tx and rx fits without blocking, so neither
+	will leak. */
+	echan := make(chan error, 2)
+	dchan := make(chan struct{})
+
+	/* Forwarded connections go to this session while it lasts */
+	if nil != in.fwd && 0 != in.Options&OptStreams {
+		in.streams = NewStreamMux(in.fwd, tun.MaxFrameLen())
+		go in.streams.Run()
+		defer in.streams.Close()
+	}
+
+	/* Fire off a goroutine to encrypt and send traffic */
+	go tx(tun, fchan, in, echan, dchan, minWait, maxWait)
+
+	/* Fire off another to decrypt traffic and put it on the tun device */
+	go rx(tun, in, echan)
+
+	/* Wait for an error */
+	err := <-echan
+	close(dchan)
+	in.Close()
+	return err
+}
+
+/* Read frames from tun into fchan for the life of the program.  While there's
+no session (i.e. active is 0), frames are queued in fchan until it's full if
+hold is true, or discarded if hold is false.  fchan will be closed if tun can't
+be read. */
+func holdFrames(tun Tunnel, fchan chan Frame, hold bool, active *int32) {
+	var drops uint64 /* Frames dropped during outages */
+	for {
+		f, err := tun.Read()
+		if nil != err {
+			log.Printf("Unable to read from tunnel: %v", err)
+			close(fchan)
+			return
+		}
+		/* In a session, wait for tx to take it */
+		if 0 != atomic.LoadInt32(active) {
+			fchan <- f
+			continue
+		}
+		/* No session, hold or drop it */
+		if hold {
+			select {
+			case fchan <- f:
+				continue
+			default:
+			}
+		}
+		drops++
+		if 1 == drops%1024 {
+			debug("%v frames dropped while disconnected", drops)
+		}
+	}
+}
+
+/* Throw away any frames queued in fchan */
+func drainFrames(fchan chan Frame) {
+	for {
+		select {
+		case <-fchan:
+		default:
+			return
+		}
+	}
+}
+
+/* Work out how long to wait before the nfail'th consecutive attempt to
+connect (starting at 0).  The first attempt is made right away, after which
+the wait starts at min and doubles every time up to max.  Up to half of it is
+randomly taken off so that many shifts don't retry in lockstep. */
+func backoff(nfail int, min, max time.Duration) time.Duration {
+	if 0 == nfail || 0 >= min {
+		return 0
+	}
+	d := min
+	for i := 1; i < nfail && d < max; i++ {
+		d *= 2
+	}
+	if d > max {
+		d = max
+	}
+	if half := int64(d / 2); 0 < half {
+		d -= time.Duration(rand.Int63n(half))
+	}
+	return d
+}
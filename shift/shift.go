@@ -6,7 +6,7 @@ package main
  * The local half of thriftiness, uses stdin/out
  * by J. Stuart McMurray
  * created 20150115
- * last modified 20150126
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -29,9 +29,12 @@ import (
 	"github.com/kd5pbo/confflags"
 	"github.com/kd5pbo/easylogger"
 	"log"
+	"math/rand"
 	"os"
 	"os/signal"
 	"strconv"
+	"sync"
+	"sync/atomic"
 	"time"
 )
 
@@ -92,6 +95,105 @@ func mymain() int {
 				"to the current time to match the target's "+
 				"idea of the time.  May be negative.",
 		)
+		pipeline = flag.Bool(
+			"pipeline",
+			false,
+			"Use the pipelined handshake, which takes one round "+
+				"trip instead of two.  Insert must be built "+
+				"with the p HANDSHAKE.",
+		)
+		ticketLife = flag.Duration(
+			"ticketlife",
+			5*time.Minute,
+			"With -pipeline, how long to keep insert's "+
+				"resumption tickets.  Reconnecting with a "+
+				"ticket takes no round trips.  Should be "+
+				"shorter than insert's TICKETLIFE.  0 to "+
+				"not resume sessions.",
+		)
+		indexed = flag.Bool(
+			"indexed",
+			false,
+			"With -pipeline, ask insert for indexed framing, "+
+				"which lets records be encrypted and "+
+				"decrypted on many cores at once.",
+		)
+		dedup = flag.Int(
+			"dedup",
+			0,
+			"With -pipeline, ask insert to send frames it's "+
+				"sent recently as short references to a "+
+				"cache of this many frames (at most 65535).  "+
+				"Insert may agree to a smaller cache.  0 for "+
+				"no cache.",
+		)
+		trunc = flag.Bool(
+			"trunc",
+			false,
+			"With -pipeline, let insert send frames cut down "+
+				"to its TRUNCLEN, for monitoring.  They're "+
+				"written to the tunnel device as they are.",
+		)
+		flows = flag.String(
+			"flows",
+			"",
+			"With -pipeline, ask insert to send flow records "+
+				"instead of frames, and append them to this "+
+				"file, one flow per line.",
+		)
+		fwds = flag.String(
+			"fwd",
+			"",
+			"With -pipeline, comma-separated list of "+
+				"port:address:port.  Connections to the "+
+				"first port here are made by insert to the "+
+				"address and port on its network, and only "+
+				"the bytes sent each way go through the "+
+				"tunnel.  The address must be an IP "+
+				"address.  May not be specified with -multi.",
+		)
+		pmtu = flag.Int(
+			"pmtu",
+			0,
+			"Largest IP packet insert's network (and the path "+
+				"to it) takes.  TCP SYNs sent to insert have "+
+				"their MSS clamped to fit, and packets too "+
+				"big which mustn't be fragmented get an ICMP "+
+				"error back.  0 for no limit.",
+		)
+		neighLife = flag.Uint(
+			"neigh",
+			0,
+			"Answer ARP requests and IPv6 neighbor solicitations "+
+				"for hosts on insert's network locally, for up "+
+				"to this many seconds after their last reply.  "+
+				"0 to send them all to insert.  May not be "+
+				"specified with -multi.",
+		)
+		chans = flag.Int(
+			"chans",
+			0,
+			"With -pipeline, make this many more tunnel devices, "+
+				"for frames from the interfaces after the "+
+				"first in insert's PCAPINT, in order.  May "+
+				"not be specified with -multi.",
+		)
+		gro = flag.Bool(
+			"gro",
+			false,
+			"With -pipeline, let insert merge runs of TCP "+
+				"segments into super-frames, which are split "+
+				"up again before they're written to the "+
+				"tunnel device.",
+		)
+		skewWin = flag.Int64(
+			"skew",
+			60,
+			"With -pipeline, the number of seconds either side "+
+				"of -o to search for insert's idea of the "+
+				"time.  The offset found is remembered for "+
+				"the next connection.",
+		)
 		minWait = flag.Duration(
 			"minka",
 			2*time.Second,
@@ -102,11 +204,69 @@ func mymain() int {
 			170*time.Second,
 			"Maximum idle time before sending keepalives.",
 		)
+		multi = flag.Bool(
+			"multi",
+			false,
+			"Keep listening on -addr and serve many inserts at "+
+				"once, each with its own tunnel device.  May "+
+				"not be specified with -c.",
+		)
+		shared = flag.Bool(
+			"shared",
+			false,
+			"With -multi, share a single tunnel device between "+
+				"all inserts, switching frames by MAC address.",
+		)
+		maxSess = flag.Int(
+			"maxsess",
+			64,
+			"With -multi, the maximum number of concurrent inserts.",
+		)
+		sessQ = flag.Int(
+			"sessq",
+			256,
+			"With -shared, the number of frames queued for each "+
+				"insert before frames are dropped.",
+		)
+		sessMACs = flag.Int(
+			"sessmacs",
+			256,
+			"With -shared, the maximum number of MAC addresses "+
+				"learned behind each insert.",
+		)
+		retryMin = flag.Duration(
+			"retry",
+			time.Second,
+			"Time to wait before reconnecting after a failed "+
+				"attempt.  Doubles after every consecutive "+
+				"failure, up to -maxretry.",
+		)
+		retryMax = flag.Duration(
+			"maxretry",
+			time.Minute,
+			"Maximum time to wait before reconnecting.",
+		)
+		outage = flag.String(
+			"outage",
+			"hold",
+			"What to do with frames read from the tunnel device "+
+				"while there's no connection to insert, "+
+				"either hold (up to -holdq frames) or drop.",
+		)
+		holdQ = flag.Int(
+			"holdq",
+			1024,
+			"Number of frames to hold while there's no "+
+				"connection to insert.",
+		)
 	)
 
 	/* Parse command-line flags */
 	confflags.Parse(nil)
 
+	/* Used to jitter reconnect times */
+	rand.Seed(time.Now().UnixNano())
+
 	/* Work out whether to use IPv4 or IPv6 */
 	ipv := 0
 	/* For IPv4 */
@@ -123,6 +283,16 @@ func mymain() int {
 		ipv = 6
 	}
 
+	/* Server mode only makes sense when listening */
+	if *multi && *connect {
+		log.Printf("Unable to both connect and serve many inserts")
+		return -5
+	}
+	if *shared && !*multi {
+		log.Printf("A shared tunnel device requires -multi")
+		return -6
+	}
+
 	/* Make sure key is the right length and make it a byte array */
 	if keyLen != len(*key) {
 		log.Printf("Key (%v) is %v bytes, but should be %v bytes",
@@ -142,58 +312,278 @@ func mymain() int {
 		log.Printf("Running as non-root user (uid %v).  This may "+
 			"cause problems.", u)
 	}
-	/* Try to open a tun device */
-	tun, tunname, err := MakeTun()
-	if nil != err {
-		log.Printf("Unable to make tun device: %v", err)
-		return -1
+	/* Handshake parameters */
+	hp := &HandshakeParams{
+		Junk:    []byte(*junk),
+		Key:     keyb,
+		Offset:  *timeoff,
+		Name:    *insertName,
+		NameLen: *insertNameLen,
+
+		Pipelined: *pipeline,
+		PMTU:      *pmtu,
+	}
+	if *pipeline && 0 < *ticketLife {
+		hp.Tickets = NewTicketJar(*ticketLife)
+	}
+	if *pipeline {
+		hp.Skew = NewSkewMemo(*timeoff, *skewWin)
+	}
+	if *indexed {
+		if !*pipeline {
+			log.Printf("Indexed framing requires -pipeline")
+			return -8
+		}
+		hp.Options |= OptIndexed
+	}
+	if 0 != *dedup {
+		if !*pipeline {
+			log.Printf("Dedup requires -pipeline")
+			return -8
+		}
+		if 0 > *dedup || 0xFFFF < *dedup {
+			log.Printf("Dedup cache size must be between 0 and 65535")
+			return -9
+		}
+		hp.Options |= DedupOption(*dedup)
+	}
+	if *trunc {
+		if !*pipeline {
+			log.Printf("Truncated frames require -pipeline")
+			return -8
+		}
+		hp.Options |= OptTrunc
+	}
+	if "" != *flows {
+		if !*pipeline {
+			log.Printf("Flow records require -pipeline")
+			return -8
+		}
+		f, err := os.OpenFile(*flows,
+			os.O_WRONLY|os.O_APPEND|os.O_CREATE, 0600)
+		if nil != err {
+			log.Printf("Unable to open flow log %v: %v", *flows, err)
+			return -10
+		}
+		defer f.Close()
+		hp.Flows = NewFlowLog(f)
+		hp.Options |= OptFlows
+	}
+	if "" != *fwds {
+		if !*pipeline || *multi {
+			log.Printf("Forwarding requires -pipeline, and not " +
+				"-multi")
+			return -8
+		}
+		fw, err := NewForwarder(*fwds)
+		if nil != err {
+			log.Printf("Unable to forward %v: %v", *fwds, err)
+			return -11
+		}
+		hp.Forwards = fw
+		hp.Options |= OptStreams
+	}
+
+	if 0 != *neighLife {
+		if *multi {
+			log.Printf("Answering neighbor requests locally may " +
+				"not be used with -multi")
+			return -12
+		}
+		hp.Neigh = NewNeighCache(time.Duration(*neighLife) * time.Second)
+	}
+
+	if 0 != *chans {
+		if !*pipeline || *multi {
+			log.Printf("Channels require -pipeline, and not -multi")
+			return -8
+		}
+		if 0 > *chans || 0xFF < *chans {
+			log.Printf("Channels must be between 0 and 255")
+			return -13
+		}
+		hp.Options |= OptChannels
+	}
+	if *gro {
+		if !*pipeline {
+			log.Printf("Super-frames require -pipeline")
+			return -8
+		}
+		hp.Options |= OptGRO
 	}
-	log.Printf("Tunnel device: %v", tunname)
-	/* Destroy the tun device when we're done with it */
-	defer func() { tun.Close() }()
 
-	/* Register a callback for SIGINT to close the tunnel befor exiting */
+	/* Register a callback for SIGINT to close the tunnels befor exiting */
 	schan := make(chan os.Signal)
 	signal.Notify(schan, os.Interrupt)
 	go func() {
 		/* Wait for a Ctrl+C */
 		<-schan
-		/* Close the tun device */
-		tun.Close()
+		/* Close the tun devices */
+		closeTuns()
 		/* Exit */
 		os.Exit(1)
 	}()
 
-	/* Make or accept a connection */
-	in, err := NewInsert(
-		*addr,
-		*connect,
-		ipv,
-		[]byte(*junk),
-		keyb,
-		*timeoff,
-		*insertName,
-		*insertNameLen,
-	)
+	/* Serve many inserts */
+	if *multi {
+		return serveMany(ipv, hp, *shared, *maxSess, *sessQ,
+			*sessMACs, *minWait, *maxWait, *addr)
+	}
+
+	/* Try to open a tun device */
+	tun, tunname, err := MakeTun()
+	if nil != err {
+		log.Printf("Unable to make tun device: %v", err)
+		return -1
+	}
+	log.Printf("Tunnel device: %v", tunname)
+	/* Destroy the tun device when we're done with it, but not before.  It
+	stays up between connections to insert. */
+	trackTun(tun)
+	defer closeTuns()
+
+	/* Work out what to do with frames while there's no connection */
+	var hold bool
+	switch *outage {
+	case "hold":
+		hold = true
+	case "drop":
+		hold = false
+	default:
+		log.Printf("Unknown outage policy %q", *outage)
+		return -7
+	}
+
+	/* Listen or get ready to connect */
+	cn, err := NewConnector(*addr, *connect, ipv)
 	if nil != err {
-		log.Printf("Error establishing connection to insert: %v", err)
+		log.Printf("Error setting up connection to insert: %v", err)
 		return -2
 	}
-	log.Printf("Connected to %v", in.RemoteAddr())
+	defer cn.Close()
 
-	/* Channel on which to receive errors from the frame-copying
-	goroutines */
-	echan := make(chan error, 1)
+	/* Read from the tunnel for as long as it's around */
+	fchan := make(chan Frame, *holdQ)
+	var active int32
+	go holdFrames(tun, fchan, hold, &active)
 
-	/* Fire off a goroutine to encrypt and send traffic */
-	go tx(tun, in, echan, *minWait, *maxWait)
+	/* And from the other channels' tunnels */
+	if 0 != *chans {
+		hp.Chans, err = NewChannels(*chans, hold, *holdQ, &active)
+		if nil != err {
+			log.Printf("Unable to make channel tun device: %v", err)
+			return -1
+		}
+	}
 
-	/* Fire off another to decrypt traffic and put it on the tun device */
-	go rx(tun, in, echan)
+	/* Make or accept a connection, proxy frames until it fails, repeat */
+	for nfail := 0; ; {
+		/* Wait a bit if we've failed before */
+		if d := backoff(nfail, *retryMin, *retryMax); 0 != d {
+			verbose("Waiting %v before reconnecting", d)
+			time.Sleep(d)
+		}
+		in, err := cn.NewInsert(hp)
+		if nil != err {
+			log.Printf("Error establishing connection to insert: "+
+				"%v", err)
+			nfail++
+			continue
+		}
+		nfail = 0
+		log.Printf("Connected to %v", in.RemoteAddr())
 
-	/* Wait for an error */
-	err = <-echan
-	fmt.Printf("Fatal error: %v\n", err)
+		/* Proxy frames until something goes wrong */
+		atomic.StoreInt32(&active, 1)
+		err = runSession(tun, fchan, in, *minWait, *maxWait)
+		atomic.StoreInt32(&active, 0)
+
+		/* Without the tunnel, there's no point in going on */
+		if ErrorTunClosed == err {
+			fmt.Printf("Fatal error: %v\n", err)
+			return 0
+		}
+		log.Printf("Lost connection to insert: %v", err)
+
+		/* Don't send stale frames if we're not meant to hold them */
+		if !hold {
+			drainFrames(fchan)
+			hp.Chans.Drain()
+		}
+	}
+}
+
+/* Serve many inserts, either with a tunnel device each or all sharing one */
+func serveMany(
+	ipv int,
+	hp *HandshakeParams,
+	shared bool,
+	maxSess int,
+	sessQ int,
+	sessMACs int,
+	minWait time.Duration,
+	maxWait time.Duration,
+	addr string,
+) int {
+	conf := &ServerConfig{
+		Addr:    addr,
+		Force:   ipv,
+		HP:      hp,
+		MaxSess: maxSess,
+		QLen:    sessQ,
+		MaxMACs: sessMACs,
+		MinWait: minWait,
+		MaxWait: maxWait,
+	}
 
+	/* Make the shared tunnel device */
+	if shared {
+		tun, tunname, err := MakeTun()
+		if nil != err {
+			log.Printf("Unable to make tun device: %v", err)
+			return -1
+		}
+		log.Printf("Shared tunnel device: %v", tunname)
+		trackTun(tun)
+		defer closeTuns()
+		conf.Shared = tun
+	} else if "" != *ip {
+		log.Printf("Every insert's tunnel device will get the same " +
+			"IP address")
+	}
+
+	/* Serve until something goes wrong */
+	err := Serve(conf)
+	fmt.Printf("Fatal error: %v\n", err)
 	return 0
 }
+
+/* Tunnel devices to close on exit */
+var (
+	tuns  = make(map[Tunnel]bool)
+	tunsL sync.Mutex
+)
+
+/* Note that t is to be closed on exit */
+func trackTun(t Tunnel) {
+	tunsL.Lock()
+	defer tunsL.Unlock()
+	tuns[t] = true
+}
+
+/* Note that t no longer needs to be closed on exit */
+func untrackTun(t Tunnel) {
+	tunsL.Lock()
+	defer tunsL.Unlock()
+	delete(tuns, t)
+}
+
+/* Close all of the tracked tunnel devices */
+func closeTuns() {
+	tunsL.Lock()
+	defer tunsL.Unlock()
+	for t := range tuns {
+		t.Close()
+		delete(tuns, t)
+	}
+}
@@ -0,0 +1,150 @@
+package main
+
+/*
+ * skew.go
+ * Work out how far off insert's clock is
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"crypto/subtle"
+	"fmt"
+	"log"
+	"net"
+	"runtime"
+	"sync"
+)
+
+/* Errors which may be returned */
+var (
+	ErrorNoOffset = fmt.Errorf("no time offset in the window decrypts " +
+		"the name")
+)
+
+/* SkewMemo remembers the time offset learned for each insert, by address */
+type SkewMemo struct {
+	def    int64            /* Offset to use for new inserts */
+	window int64            /* Seconds either side of the offset to try */
+	l      sync.Mutex       /* Lock for o */
+	o      map[string]int64 /* Learned offsets */
+}
+
+/* NewSkewMemo makes a SkewMemo which starts with offset def and searches
+window seconds either side of it */
+func NewSkewMemo(def, window int64) *SkewMemo {
+	if 0 > window {
+		window = 0
+	}
+	return &SkewMemo{def: def, window: window, o: make(map[string]int64)}
+}
+
+/* Offset returns the last offset learned for the insert at addr */
+func (m *SkewMemo) Offset(addr net.Addr) int64 {
+	m.l.Lock()
+	defer m.l.Unlock()
+	if o, ok := m.o[ticketKey(addr)]; ok {
+		return o
+	}
+	return m.def
+}
+
+/* Learn remembers the offset for the insert at addr */
+func (m *SkewMemo) Learn(addr net.Addr, off int64) {
+	m.l.Lock()
+	defer m.l.Unlock()
+	m.o[ticketKey(addr)] = off
+}
+
+/* Search tries every offset within the window of the one last learned for
+the insert at addr, in parallel, to find the one with which the encrypted
+name, ename, decrypts to name.  now is the time insert's nonce arrived.  The
+cryptors made with that offset are returned, with the insert to shift cryptor
+having already decrypted the name, along with the offset. */
+func (m *SkewMemo) Search(
+	addr net.Addr,
+	key [keyLen]byte,
+	nonce [nonceLen]byte,
+	now int64,
+	name []byte,
+	ename []byte,
+) (sic, isc *Cryptor, off int64, err error) {
+	base := m.Offset(addr)
+
+	/* Offsets to try */
+	cands := make(chan int64, 2*m.window+1)
+	for o := base - m.window; o <= base+m.window; o++ {
+		cands <- o
+	}
+	close(cands)
+
+	/* Offsets which work.  As the low two bits of the time are masked
+	off, several neighboring offsets will work, of which the closest to
+	base is used. */
+	var (
+		best  *Cryptor /* Shift to insert cryptor for best */
+		bestI *Cryptor /* Insert to shift cryptor for best */
+		bestO int64    /* Best offset */
+		found bool     /* True if any offsets work */
+		bestL sync.Mutex
+	)
+
+	/* Try candidates on every CPU */
+	var wg sync.WaitGroup
+	for i := 0; i < runtime.NumCPU(); i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			dec := make([]byte, len(ename))
+			for o := range cands {
+				s, i, err := newCryptorPair(key, nonce, now+o)
+				if nil != err {
+					continue
+				}
+				i.XORKeyStream(dec, ename)
+				if 1 != subtle.ConstantTimeCompare(dec, name) {
+					continue
+				}
+				bestL.Lock()
+				if !found || abs(o-base) < abs(bestO-base) {
+					best, bestI, bestO, found = s, i, o, true
+				}
+				bestL.Unlock()
+			}
+		}()
+	}
+	wg.Wait()
+
+	if !found {
+		return nil, nil, 0, ErrorNoOffset
+	}
+	if bestO != base {
+		log.Printf("[%v] Insert's clock is %v seconds off (was %v)",
+			addr, bestO, base)
+		m.Learn(addr, bestO)
+	}
+	return best, bestI, bestO, nil
+}
+
+/* Absolute value of n */
+func abs(n int64) int64 {
+	if 0 > n {
+		return -n
+	}
+	return n
+}
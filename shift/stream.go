@@ -0,0 +1,416 @@
+package main
+
+/*
+ * stream.go
+ * Forward TCP connections to hosts on insert's network
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"crypto/sha256"
+	"encoding/binary"
+	"fmt"
+	"log"
+	"net"
+	"strings"
+	"sync"
+	"time"
+)
+
+/* A record with this size is a stream record, which starts with its real
+size.  Stream records start with the stream's ID and what the record is. */
+const (
+	streamRec    = 4
+	streamHdrLen = 3
+	streamOpen   = 1 /* Connect to a remote host */
+	streamData   = 2 /* Bytes for the other end */
+	streamClose  = 3 /* No more bytes from this end */
+	streamWindow = 4 /* Room for more bytes from the other end */
+)
+
+/* Bytes from insert wait for the local end to take them, up to streamBufLen
+of them, and insert's told when there's room for more.  A stream whose local
+end or insert doesn't take any bytes for streamTimeout has its connection
+closed. */
+const (
+	streamBufLen  = 128 * 1024
+	streamTimeout = 10 * time.Second
+)
+
+/* Errors which may be returned */
+var (
+	ErrorBadStream = fmt.Errorf("bad stream record")
+	ErrorBadFwd    = fmt.Errorf("forward must be port:address:port")
+)
+
+/* A connection accepted on a forwarded port */
+type fwdConn struct {
+	c  *net.TCPConn
+	to *net.TCPAddr /* Where insert should connect */
+}
+
+/* Forwarder accepts connections on local ports for the life of the program
+and hands them to whichever session with insert wants them */
+type Forwarder struct {
+	conns chan fwdConn
+}
+
+/* NewForwarder listens on the local ports in the comma-separated list of
+port:address:port forwards in fwds.  Addresses must be IP addresses, as
+insert doesn't resolve names.  IPv6 addresses go in square brackets. */
+func NewForwarder(fwds string) (*Forwarder, error) {
+	f := &Forwarder{conns: make(chan fwdConn)}
+	for _, fwd := range strings.Split(fwds, ",") {
+		parts := strings.SplitN(fwd, ":", 2)
+		if 2 != len(parts) {
+			return nil, ErrorBadFwd
+		}
+		to, err := net.ResolveTCPAddr("tcp", parts[1])
+		if nil != err {
+			return nil, err
+		}
+		if nil == to.IP {
+			return nil, ErrorBadFwd
+		}
+		l, err := net.Listen("tcp", net.JoinHostPort("", parts[0]))
+		if nil != err {
+			return nil, err
+		}
+		log.Printf("Forwarding %v to %v", l.Addr(), to)
+		go f.accept(l.(*net.TCPListener), to)
+	}
+	return f, nil
+}
+
+/* Accept connections on l, to be forwarded to to */
+func (f *Forwarder) accept(l *net.TCPListener, to *net.TCPAddr) {
+	for {
+		c, err := l.AcceptTCP()
+		if nil != err {
+			log.Printf("Unable to accept forwarded connection: %v",
+				err)
+			return
+		}
+		debug("Forwarded connection from %v to %v", c.RemoteAddr(), to)
+		f.conns <- fwdConn{c: c, to: to}
+	}
+}
+
+/* StreamMux carries the forwarded connections for a session with insert, one
+stream per connection.  Insert makes its own connections to the remote hosts,
+so only the bytes sent each way go through the tunnel. */
+type StreamMux struct {
+	fw       *Forwarder
+	out      chan []byte   /* Marshalled records for tx */
+	done     chan struct{} /* Closed at the end of the session */
+	maxChunk int           /* Most bytes to read at once */
+
+	l       sync.Mutex
+	streams map[uint16]*stream
+	next    uint16 /* Next ID to try */
+}
+
+/* A forwarded connection.  It's forgotten once both ends are done and
+everything from insert's been written. */
+type stream struct {
+	c         *net.TCPConn
+	buf       []byte        /* Bytes from insert, for write */
+	wake      chan struct{} /* Something's been added to buf */
+	credit    int           /* Bytes insert will still take */
+	room      chan struct{} /* Insert's taking more */
+	sentClose bool          /* Nothing more from the local end */
+	gotClose  bool          /* Nothing more from the remote end */
+	wrote     bool          /* Everything from insert's been written */
+}
+
+/* NewStreamMux makes a StreamMux which takes connections from fw, reading at
+most maxLen bytes into a record.  Its Run method must be called. */
+func NewStreamMux(fw *Forwarder, maxLen int) *StreamMux {
+	return &StreamMux{
+		fw:       fw,
+		out:      make(chan []byte),
+		done:     make(chan struct{}),
+		maxChunk: maxLen - streamHdrLen,
+		streams:  make(map[uint16]*stream),
+	}
+}
+
+/* Out returns the channel of records to send to insert.  A nil StreamMux's
+is nil, which blocks forever. */
+func (m *StreamMux) Out() chan []byte {
+	if nil == m {
+		return nil
+	}
+	return m.out
+}
+
+/* Run opens streams for forwarded connections until Close is called */
+func (m *StreamMux) Run() {
+	for {
+		select {
+		case fc := <-m.fw.conns:
+			m.open(fc)
+		case <-m.done:
+			return
+		}
+	}
+}
+
+/* Close closes all of the session's connections */
+func (m *StreamMux) Close() {
+	close(m.done)
+	m.l.Lock()
+	defer m.l.Unlock()
+	for id, s := range m.streams {
+		s.c.Close()
+		delete(m.streams, id)
+	}
+}
+
+/* Open a stream for fc and start reading from it */
+func (m *StreamMux) open(fc fwdConn) {
+	/* Find an unused ID */
+	m.l.Lock()
+	for _, ok := m.streams[m.next]; ok; _, ok = m.streams[m.next] {
+		m.next++
+	}
+	id := m.next
+	m.next++
+	s := &stream{
+		c:    fc.c,
+		wake: make(chan struct{}, 1),
+		room: make(chan struct{}, 1),
+	}
+	m.streams[id] = s
+	m.l.Unlock()
+
+	/* Tell insert where to connect */
+	addr := fc.to.IP.To4()
+	if nil == addr {
+		addr = fc.to.IP.To16()
+	}
+	b := make([]byte, streamHdrLen+2, streamHdrLen+2+len(addr))
+	binary.BigEndian.PutUint16(b[streamHdrLen:], uint16(fc.to.Port))
+	b = append(b, addr...)
+	if !m.send(id, streamOpen, b) || !m.grant(id, streamBufLen) {
+		fc.c.Close()
+		return
+	}
+	go m.read(id, s)
+	go m.write(id, s)
+}
+
+/* Send what's read from s's local end to insert as stream id, as insert has
+room for it */
+func (m *StreamMux) read(id uint16, s *stream) {
+	for {
+		n, ok := m.credit(s)
+		if !ok {
+			return
+		}
+		if 0 == n {
+			/* Give up, which sends insert a close */
+			debug("Insert isn't taking more from %v",
+				s.c.RemoteAddr())
+			s.c.Close()
+			break
+		}
+		b := make([]byte, streamHdrLen+n)
+		n, err := s.c.Read(b[streamHdrLen:])
+		m.l.Lock()
+		s.credit -= n
+		m.l.Unlock()
+		if 0 != n && !m.send(id, streamData, b[:streamHdrLen+n]) {
+			return
+		}
+		if nil != err {
+			break
+		}
+	}
+	m.send(id, streamClose, make([]byte, streamHdrLen))
+	m.l.Lock()
+	defer m.l.Unlock()
+	s.sentClose = true
+	m.forget(id, s)
+}
+
+/* Wait for insert to have room for bytes from s, and return how many may be
+read, up to m.maxChunk.  The number is 0 if insert's not taken any for
+streamTimeout, and ok is false if the session's over. */
+func (m *StreamMux) credit(s *stream) (n int, ok bool) {
+	t := time.NewTimer(streamTimeout)
+	defer t.Stop()
+	for {
+		m.l.Lock()
+		n = s.credit
+		m.l.Unlock()
+		if 0 != n {
+			break
+		}
+		select {
+		case <-s.room:
+		case <-t.C:
+			return 0, true
+		case <-m.done:
+			return 0, false
+		}
+	}
+	if n > m.maxChunk {
+		n = m.maxChunk
+	}
+	return n, true
+}
+
+/* Tell insert it may send n more bytes for stream id.  Returns false if the
+session's over. */
+func (m *StreamMux) grant(id uint16, n int) bool {
+	b := make([]byte, streamHdrLen+4)
+	binary.BigEndian.PutUint32(b[streamHdrLen:], uint32(n))
+	return m.send(id, streamWindow, b)
+}
+
+/* Write what insert sends as stream id, s, to its local end.  Once the local
+end's given up on, what's left is thrown away. */
+func (m *StreamMux) write(id uint16, s *stream) {
+	failed := false
+	for {
+		m.l.Lock()
+		b := s.buf
+		s.buf = nil
+		closed := s.gotClose
+		m.l.Unlock()
+
+		/* Wait for something to write, unless insert's done */
+		if 0 == len(b) {
+			if closed {
+				break
+			}
+			select {
+			case <-s.wake:
+			case <-m.done:
+				return
+			}
+			continue
+		}
+		if failed {
+			continue
+		}
+		s.c.SetWriteDeadline(time.Now().Add(streamTimeout))
+		if _, err := s.c.Write(b); nil != err {
+			/* Give up, which sends insert a close */
+			debug("Unable to write to forwarded connection: %v",
+				err)
+			s.c.Close()
+			failed = true
+			continue
+		}
+
+		/* Let insert fill the room back up */
+		if !m.grant(id, len(b)) {
+			return
+		}
+	}
+	s.c.CloseWrite()
+	m.l.Lock()
+	defer m.l.Unlock()
+	s.wrote = true
+	m.forget(id, s)
+}
+
+/* Marshall b, which has room for the stream header before the data, as a
+record of type op for stream id and hand it to tx.  Returns false if the
+session's over. */
+func (m *StreamMux) send(id uint16, op byte, b []byte) bool {
+	binary.BigEndian.PutUint16(b, id)
+	b[2] = op
+	rec := make([]byte, 4, 4+len(b)+sha256.Size224)
+	binary.BigEndian.PutUint16(rec, streamRec)
+	binary.BigEndian.PutUint16(rec[2:], uint16(len(b)))
+	rec = append(rec, b...)
+	sum := sha256.Sum224(rec)
+	rec = append(rec, sum[:]...)
+	select {
+	case m.out <- rec:
+		return true
+	case <-m.done:
+		return false
+	}
+}
+
+/* Deliver handles the stream record b from insert.  It never waits for the
+local end. */
+func (m *StreamMux) Deliver(b []byte) error {
+	if streamHdrLen > len(b) {
+		return ErrorBadStream
+	}
+	id := binary.BigEndian.Uint16(b)
+	m.l.Lock()
+	defer m.l.Unlock()
+	s, ok := m.streams[id]
+	/* Streams we've given up on are ignored, as are bytes after a close,
+	but insert may still have room for more */
+	if !ok || (s.gotClose && streamWindow != b[2]) {
+		return nil
+	}
+	op := b[2]
+	b = b[streamHdrLen:]
+	switch op {
+	case streamData:
+		/* Insert sent more than it was allowed */
+		if len(s.buf)+len(b) > streamBufLen {
+			debug("Too many bytes from insert for %v",
+				s.c.RemoteAddr())
+			s.c.Close()
+			s.buf = nil
+			break
+		}
+		s.buf = append(s.buf, b...)
+		wake(s.wake)
+	case streamWindow:
+		if 4 != len(b) {
+			return ErrorBadStream
+		}
+		s.credit += int(binary.BigEndian.Uint32(b))
+		wake(s.room)
+	case streamClose:
+		s.gotClose = true
+		wake(s.wake)
+		m.forget(id, s)
+	default:
+		return ErrorBadStream
+	}
+	return nil
+}
+
+/* Close and forget stream id, s, if both ends are done.  m.l must be
+held. */
+func (m *StreamMux) forget(id uint16, s *stream) {
+	if s.sentClose && s.gotClose && s.wrote {
+		s.c.Close()
+		delete(m.streams, id)
+	}
+}
+
+/* Wake whatever's waiting on c, if it's not already been woken */
+func wake(c chan struct{}) {
+	select {
+	case c <- struct{}{}:
+	default:
+	}
+}
@@ -0,0 +1,196 @@
+package main
+
+/*
+ * switch.go
+ * Share one tunnel device between many inserts, switching by MAC address
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"fmt"
+	"log"
+	"sync"
+)
+
+/* Errors which may be returned */
+var (
+	ErrorPortClosed = fmt.Errorf("switch port closed")
+)
+
+/* Length of a MAC address */
+const macLen = 6
+
+/* A MAC address, usable as a map key */
+type MAC [macLen]byte
+
+/* Switch learns which insert is behind which (remote) MAC address and
+forwards frames read from a shared tunnel device to the right insert.  Frames
+for unknown, broadcast, or multicast addresses are flooded to every insert. */
+type Switch struct {
+	tun   Tunnel               /* Shared tunnel device */
+	l     sync.Mutex           /* Lock for ports and macs */
+	ports map[*SwitchPort]bool /* Attached inserts */
+	macs  map[MAC]*SwitchPort  /* Where MAC addresses live */
+}
+
+/* SwitchPort is one insert's view of a Switch.  It implements the Tunnel
+interface, so it can be handed to tx and rx like a tunnel device. */
+type SwitchPort struct {
+	sw      *Switch       /* Switch to which this port is attached */
+	name    string        /* Name for logging */
+	q       chan Frame    /* Frames to send to insert */
+	dchan   chan struct{} /* Closed when the port is closed */
+	once    sync.Once     /* Close dchan only once */
+	maxMACs int           /* Maximum number of MACs to learn */
+	nMACs   int           /* Number of MACs learned, locked by sw.l */
+	drops   uint64        /* Frames dropped for a full queue */
+}
+
+/* NewSwitch makes a switch on top of tun and starts reading frames from it */
+func NewSwitch(tun Tunnel) *Switch {
+	sw := &Switch{
+		tun:   tun,
+		ports: make(map[*SwitchPort]bool),
+		macs:  make(map[MAC]*SwitchPort),
+	}
+	go sw.forward()
+	return sw
+}
+
+/* Attach makes a new port on the switch which will queue at most qlen frames
+and learn at most maxMACs addresses. */
+func (sw *Switch) Attach(name string, qlen, maxMACs int) *SwitchPort {
+	p := &SwitchPort{
+		sw:      sw,
+		name:    name,
+		q:       make(chan Frame, qlen),
+		dchan:   make(chan struct{}),
+		maxMACs: maxMACs,
+	}
+	sw.l.Lock()
+	defer sw.l.Unlock()
+	sw.ports[p] = true
+	return p
+}
+
+/* Read frames from the tunnel device, and send them to the right port(s) */
+func (sw *Switch) forward() {
+	for {
+		f, err := sw.tun.Read()
+		if nil != err {
+			log.Printf("Switch unable to read from tunnel: %v", err)
+			return
+		}
+		/* Runts go nowhere */
+		if len(f) < 2*macLen {
+			continue
+		}
+		var dst MAC
+		copy(dst[:], f[:macLen])
+
+		sw.l.Lock()
+		/* If we know where it goes, send it there */
+		if p, ok := sw.macs[dst]; ok && 0 == dst[0]&0x01 {
+			p.enqueue(f)
+		} else {
+			/* Flood broadcast, multicast, and unknown frames */
+			for p := range sw.ports {
+				p.enqueue(f)
+			}
+		}
+		sw.l.Unlock()
+	}
+}
+
+/* Queue a frame to be sent to insert, dropping it if the queue is full */
+func (p *SwitchPort) enqueue(f Frame) {
+	select {
+	case p.q <- f:
+	default:
+		p.drops++
+		if 1 == p.drops%1024 {
+			log.Printf("[%v] Queue full, %v frames dropped",
+				p.name, p.drops)
+		}
+	}
+}
+
+/* Read returns the next frame destined for the insert behind this port */
+func (p *SwitchPort) Read() (Frame, error) {
+	select {
+	case f := <-p.q:
+		return f, nil
+	case <-p.dchan:
+		return nil, ErrorPortClosed
+	}
+}
+
+/* Write learns the frame's source address and writes it to the tunnel */
+func (p *SwitchPort) Write(f Frame) error {
+	if len(f) >= 2*macLen && 0 == f[macLen]&0x01 {
+		var src MAC
+		copy(src[:], f[macLen:2*macLen])
+		p.sw.learn(src, p)
+	}
+	return p.sw.tun.Write(f)
+}
+
+/* Note that src lives behind p, if p has room for another address */
+func (sw *Switch) learn(src MAC, p *SwitchPort) {
+	sw.l.Lock()
+	defer sw.l.Unlock()
+	/* Already know about it */
+	o, ok := sw.macs[src]
+	if ok && o == p {
+		return
+	}
+	/* Don't learn too many */
+	if p.nMACs >= p.maxMACs {
+		return
+	}
+	/* Moved from another port */
+	if ok {
+		o.nMACs--
+	}
+	sw.macs[src] = p
+	p.nMACs++
+	debug("[%v] Learned %02X", p.name, src)
+}
+
+/* Close detaches the port from the switch and forgets its addresses.  The
+shared tunnel device is left alone. */
+func (p *SwitchPort) Close() error {
+	p.once.Do(func() {
+		p.sw.l.Lock()
+		defer p.sw.l.Unlock()
+		delete(p.sw.ports, p)
+		for m, o := range p.sw.macs {
+			if o == p {
+				delete(p.sw.macs, m)
+			}
+		}
+		close(p.dchan)
+	})
+	return nil
+}
+
+/* MaxFrameLen is the shared tunnel device's maximum frame length */
+func (p *SwitchPort) MaxFrameLen() int {
+	return p.sw.tun.MaxFrameLen()
+}
@@ -0,0 +1,99 @@
+package main
+
+/*
+ * ticket.go
+ * Resumption tickets for the pipelined handshake
+ * by J. Stuart McMurray
+ * created 20261018
+ * last modified 20261018
+ *
+ * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+import (
+	"net"
+	"sync"
+	"time"
+)
+
+/* Ticket lets shift resume a session with an insert without a round trip */
+type Ticket struct {
+	ID      [nonceLen]byte /* Sent to insert in the clear */
+	Secret  [keyLen]byte   /* Key for the resumed session */
+	Options uint32         /* Options agreed on in the original session */
+	Expiry  time.Time      /* Not good after this */
+}
+
+/* TicketJar holds the most recent ticket from each insert, by address */
+type TicketJar struct {
+	life time.Duration      /* How long a ticket's good for */
+	l    sync.Mutex         /* Lock for t */
+	t    map[string]*Ticket /* Tickets, by insert's address */
+}
+
+/* NewTicketJar makes a TicketJar in which tickets last for life */
+func NewTicketJar(life time.Duration) *TicketJar {
+	return &TicketJar{life: life, t: make(map[string]*Ticket)}
+}
+
+/* Take removes and returns the ticket for the insert at addr, if there's one
+which hasn't expired.  Tickets are only good once. */
+func (j *TicketJar) Take(addr net.Addr) (*Ticket, bool) {
+	if nil == j {
+		return nil, false
+	}
+	j.l.Lock()
+	defer j.l.Unlock()
+	k := ticketKey(addr)
+	t, ok := j.t[k]
+	if !ok {
+		return nil, false
+	}
+	delete(j.t, k)
+	if time.Now().After(t.Expiry) {
+		return nil, false
+	}
+	return t, true
+}
+
+/* Put stores a ticket with the given id, secret and options for the insert
+at addr.  An all-zero id means insert didn't give out a ticket. */
+func (j *TicketJar) Put(
+	addr net.Addr,
+	id [nonceLen]byte,
+	secret [keyLen]byte,
+	options uint32,
+) {
+	if nil == j || [nonceLen]byte{} == id {
+		return
+	}
+	j.l.Lock()
+	defer j.l.Unlock()
+	j.t[ticketKey(addr)] = &Ticket{
+		ID:      id,
+		Secret:  secret,
+		Options: options,
+		Expiry:  time.Now().Add(j.life),
+	}
+}
+
+/* Inserts which connect to us will come from a different port each time, so
+tickets are kept by host */
+func ticketKey(addr net.Addr) string {
+	if a, ok := addr.(*net.TCPAddr); ok {
+		return a.IP.String()
+	}
+	return addr.String()
+}
@@ -5,7 +5,7 @@ package main
  * Goroutine to send data to insert
  * by J. Stuart McMurray
  * created 20150116
- * last modified 20150126
+ * last modified 20261018
  *
  * Copyright (c) 2014 J. Stuart McMurray <kd5pbo@gmail.com>
  *
@@ -29,6 +29,7 @@ import (
 	"log"
 	"math"
 	"math/big"
+	"runtime"
 	"time"
 )
 
@@ -39,23 +40,33 @@ var (
 
 /* Errors that might be sent on echan */
 var (
-	ErrorKATooBig = fmt.Errorf("Keepalive size is larger than a 16-bit uint")
+	ErrorKATooBig  = fmt.Errorf("Keepalive size is larger than a 16-bit uint")
+	ErrorTunClosed = fmt.Errorf("unable to read from tunnel")
 )
 
-/* Reads from the tun device and sends the data to insert. fatal errors will be
+/* Sends frames from fchan (read from tun) to insert. fatal errors will be
 reported on echan.  The goroutine will terminate when dchan is closed. */
 func tx(
 	tun Tunnel,
+	fchan chan Frame,
 	in *Insert,
 	echan chan error,
+	dchan chan struct{},
 	/* Time range to wait before sending a keepalive */
 	minWait time.Duration,
 	maxWait time.Duration,
 ) {
-	/* Start reads from the tunnel into a chan */
-	fchan := make(chan Frame)
-	go readIntoChan(tun, fchan, echan)
-
+	/* With indexed framing, records are encrypted on every core */
+	var s *Sealer
+	if in.Indexed() {
+		s = NewSealer(in, runtime.NumCPU())
+		defer s.Close()
+	}
+	/* Frames from other channels wait for an insert which takes them */
+	var cout chan chanFrame
+	if 0 != in.Options&OptChannels {
+		cout = in.chans.Out()
+	}
 	for {
 		/* Bounded random wait before sending keepalive */
 		wait, err := randomWait(minWait, maxWait)
@@ -65,8 +76,29 @@ func tx(
 		}
 		/* Wait for either time to send a keepalive or a packet */
 		select {
+		case <-dchan: /* Told to stop */
+			return
+
 		case <-time.After(wait): /* Send a keepalive */
-			if err := sendKeepalive(in); nil != err {
+			if err := sendKeepalive(in, s); nil != err {
+				echan <- err
+				return
+			}
+
+		case rec := <-in.streams.Out(): /* Send a stream record */
+			var err error
+			if nil != s {
+				err = s.SendRecord(rec)
+			} else {
+				err = in.SendEnc(rec)
+			}
+			if nil != err {
+				echan <- err
+				return
+			}
+
+		case cf := <-cout: /* (Maybe) send another channel's frame */
+			if err := sendChanFrame(in, cf, s); nil != err {
 				echan <- err
 				return
 			}
@@ -74,13 +106,15 @@ func tx(
 		case f, ok := <-fchan: /* (Maybe) send a frame */
 			/* Give up if the channel's closed */
 			if !ok {
+				echan <- ErrorTunClosed
 				return
 			}
 			/* Try to send the frame to insert */
 			if err := sendToInsert(
 				in,
 				f,
-				tun.MaxFrameLen(),
+				tun,
+				s,
 			); nil != err {
 				echan <- err
 				return
@@ -89,25 +123,50 @@ func tx(
 	}
 }
 
-/* Read from a Tunnel into a chan, which will be closed on error (which will
-be sent to echan) */
-func readIntoChan(t Tunnel, fchan chan Frame, echan chan error) {
+/* Read from a Tunnel into a chan, which will be closed on error.  Reading
+stops when dchan is closed. */
+func readIntoChan(t Tunnel, fchan chan Frame, dchan chan struct{}) {
 	for {
 		/* Read a frame from the tunnel */
 		f, err := t.Read()
 		/* Give up if there's an error */
 		if nil != err {
-			echan <- err
+			debug("Unable to read from tunnel: %v", err)
 			close(fchan)
 			return
 		}
 		/* Send the frame on the channel */
-		fchan <- f
+		select {
+		case fchan <- f:
+		case <-dchan:
+			return
+		}
 	}
 }
 
-/* Marshall a frame and send it to the insert if it's shorter than maxLen  */
-func sendToInsert(in *Insert, f Frame, maxLen int) error {
+/* Marshall a frame and send it to the insert if it's no longer than tun's
+maximum frame length.  If s isn't nil, it's used to send the frame.  With a
+path MTU set, TCP SYNs are clamped to it, and packets too big for it which
+mustn't be fragmented are answered on tun with an ICMP error instead.  ARP
+requests and neighbor solicitations for cached addresses are answered on tun,
+too. */
+func sendToInsert(in *Insert, f Frame, tun Tunnel, s *Sealer) error {
+	maxLen := tun.MaxFrameLen()
+	if 0 != in.pmtu {
+		if r := fitMTU(f, in.pmtu); nil != r {
+			debug("Packet too big for path MTU %v", in.pmtu)
+			return tun.Write(r)
+		}
+	}
+	if r, fwd := in.neigh.Answer(f); nil != r {
+		if err := tun.Write(r); nil != err {
+			return err
+		}
+		if !fwd {
+			return nil
+		}
+	}
+
 	/* Drop frames that are bigger than the tunnel can handle */
 	if maxLen < len(f) {
 		log.Printf(
@@ -127,6 +186,10 @@ func sendToInsert(in *Insert, f Frame, maxLen int) error {
 		)
 		return nil
 	}
+	/* Let the sealer marshall and send it */
+	if nil != s {
+		return s.SendFrame(f)
+	}
 	/* Marshall a nice message */
 	mf, err := f.Marshall()
 	if nil != err { /* Shouldn't happen */
@@ -141,6 +204,35 @@ func sendToInsert(in *Insert, f Frame, maxLen int) error {
 	return nil
 }
 
+/* Marshall a frame from another channel as a channel record and send it to
+insert, as sendToInsert does.  Only path MTU replies are made locally. */
+func sendChanFrame(in *Insert, cf chanFrame, s *Sealer) error {
+	tun := in.chans.Tun(cf.ch)
+	if 0 != in.pmtu {
+		if r := fitMTU(cf.f, in.pmtu); nil != r {
+			debug("Packet too big for path MTU %v", in.pmtu)
+			return tun.Write(r)
+		}
+	}
+
+	/* Drop frames that are bigger than the tunnel or protocol can
+	handle */
+	if tun.MaxFrameLen() < len(cf.f) ||
+		math.MaxUint16 < chanHdrLen+len(cf.f) {
+		log.Printf(
+			"Dropping channel %v frame of length %v",
+			cf.ch,
+			len(cf.f),
+		)
+		return nil
+	}
+	rec := cf.Marshall()
+	if nil != s {
+		return s.SendRecord(rec)
+	}
+	return in.SendEnc(rec)
+}
+
 /* randomWait returns a time.Duration between min and max */
 func randomWait(min, max time.Duration) (time.Duration, error) {
 	big, err := rand.Int(rand.Reader, big.NewInt(int64(max-min)))
@@ -150,8 +242,8 @@ func randomWait(min, max time.Duration) (time.Duration, error) {
 	return time.Duration(big.Int64()) + min, nil
 }
 
-/* sendKeepalive sends a keepalive to Insert */
-func sendKeepalive(in *Insert) error {
+/* sendKeepalive sends a keepalive to Insert, using s if it's not nil */
+func sendKeepalive(in *Insert, s *Sealer) error {
 	/* Get a random size */
 	big, err := rand.Int(rand.Reader, big.NewInt(int64(kaMax-kaMin)))
 	if nil != err {
@@ -178,6 +270,9 @@ func sendKeepalive(in *Insert) error {
 	header := append([]byte{0x00, 0x00}, sizen...)
 	ka := append(header, junk...)
 	debug("Sending %v-byte keepalive", sizeh)
+	if nil != s {
+		return s.SendRecord(ka)
+	}
 	if err := in.SendEnc(ka); nil != err {
 		return err
 	}